@@ -1,29 +1,257 @@
 #pragma once
 
 #include "memory.h"
+#include "roots.h"
+#include "safepoint.h"
+#include "scavenger.h"
+#include "sweeper.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 class Gc{
     Memory& memory_;
 public:
-    Gc(Memory& mem) : memory_{mem} { }
+    static const size_t DefaultRefCountBatch = 512;
+
+    // index in the weak table, valid till DropWeakRef
+    using WeakRef = size_t;
+    using WeakRefCallback = std::function<void(WeakRef, void* data)>;
+
+    struct RefCountStats {
+        size_t batches = 0;
+        size_t freed_objects = 0;
+        size_t freed_bytes = 0;
+    };
+
+    // guarded pool objects are neither traced nor swept, a collected heap must not sample
+    Gc(Memory& mem) : memory_{mem} { assert(memory_.GetGuardedPool() == nullptr); }
 
     void RegisterRootObject(void* obj) {
-        Block& blk = memory_.GetBlockFromUserData(obj);
-        blk.root = true;
+        GetGcInfo(obj).root = true;
+        roots_.Add(obj);
     }
 
     void UnregisterRootObject(void* obj) {
-        Block& blk = memory_.GetBlockFromUserData(obj);
-        blk.root = false;
+        GetGcInfo(obj).root = false;
+        roots_.Remove(obj);
+    }
+
+    RootSet& Roots() { return roots_; }
+
+    Safepoint& Safepoints() { return safepoint_; }
+
+    /*
+    Heap access for several mutator threads, they have to be registered in Safepoints().
+    Collections triggered inside Alloc (see GcPacer) and Collect stop the world.
+    */
+    void* Alloc(size_t sz) {
+        safepoint_.Poll();
+        HeapLock lock = LockHeap();
+        return memory_.alloc(sz);
+    }
+
+    void Free(void* ptr) {
+        safepoint_.Poll();
+        HeapLock lock = LockHeap();
+        ClearWeakRefsOf(ptr);
+        // references counted for the object are gone with it
+        auto counted = counted_refs_.find(ptr);
+        if (counted != counted_refs_.end()) {
+            decrements_.insert(decrements_.end(), counted->second.begin(), counted->second.end());
+            counted_refs_.erase(counted);
+        }
+        memory_.free(ptr);
+    }
+
+    /*
+    Weak references live in a table outside of the heap, they do not keep objects alive.
+    Live references are indexed by their targets: after marking references to unmarked objects
+    are cleared, Free and reference counting clear the ones of the objects they free.
+    Cleared references are queued for TakeClearedWeakRefs (every reference at most once, so the
+    queue is never longer than the table). With a callback the queue is handed to it instead,
+    when the heap lock is released after the collection (or free) on the thread that ran it,
+    so the callback may use the heap. Entry stays in the table till DropWeakRef, which also
+    takes it out of the queue, so a reused handle is never reported for the reference it replaced.
+    Data given to MakeWeakRef tells the owner what was evicted, e.g. a cache key.
+    */
+    WeakRef MakeWeakRef(void* obj, void* data = nullptr) {
+        HeapLock lock = LockHeap();
+        WeakRef ref = weak_refs_.size();
+        if (!free_weak_refs_.empty()) {
+            ref = free_weak_refs_.back();
+            free_weak_refs_.pop_back();
+        } else {
+            weak_refs_.emplace_back();
+        }
+        weak_refs_[ref] = {obj, data, true, false};
+        weak_index_.emplace(obj, ref);
+        ++live_weak_refs_;
+        return ref;
+    }
+
+    // nullptr once the object is dead
+    void* GetWeak(WeakRef ref) {
+        safepoint_.Poll();
+        HeapLock lock = LockHeap();
+        assert(ref < weak_refs_.size() && weak_refs_[ref].used);
+        void* obj = weak_refs_[ref].target;
+        // object may be reachable only through the reference now, marking must not miss it
+        if (obj != nullptr && marking_) {
+            Grey(GetGcInfo(obj));
+        }
+        return obj;
+    }
+
+    void DropWeakRef(WeakRef ref) {
+        HeapLock lock = LockHeap();
+        assert(ref < weak_refs_.size() && weak_refs_[ref].used);
+        if (weak_refs_[ref].queued) {
+            cleared_weak_refs_.erase(std::find(cleared_weak_refs_.begin(), cleared_weak_refs_.end(), ref));
+        }
+        if (weak_refs_[ref].target != nullptr) {
+            auto range = weak_index_.equal_range(weak_refs_[ref].target);
+            weak_index_.erase(std::find_if(range.first, range.second, [ref](const auto& entry){
+                return entry.second == ref;
+            }));
+        }
+        weak_refs_[ref] = {};
+        free_weak_refs_.push_back(ref);
+        --live_weak_refs_;
+    }
+
+    void SetWeakRefCallback(WeakRefCallback callback) {
+        HeapLock lock = LockHeap();
+        weak_ref_callback_ = std::move(callback);
+    }
+
+    // references cleared since the last call, oldest first
+    std::vector<WeakRef> TakeClearedWeakRefs() {
+        HeapLock lock = LockHeap();
+        return TakeClearedWeakRefsLocked();
+    }
+
+    size_t WeakRefCount() const { return live_weak_refs_; }
+
+    // finishes the cycle in progress, if any, and does a full one
+    void Collect() {
+        HeapLock lock = LockHeap();
+        StopTheWorldScope stw{safepoint_};
+        if (marking_) {
+            while(GcMarkStep()) { };
+            GcCollect();
+        }
+        FullGc();
+    }
+
+    /*
+    Sweeping of every cycle is done on a background thread, the collection pause is only marking.
+    Heap must be used only through Alloc, Free and Collect from then on.
+    */
+    void EnableBackgroundSweep(size_t segments = Sweeper::DefaultSegments) {
+        HeapLock lock = LockHeap();
+        sweeper_ = std::make_unique<Sweeper>(memory_, heap_mutex_, segments);
+    }
+
+    bool Sweeping() const { return sweeper_ != nullptr && sweeper_->Sweeping(); }
+
+    const Sweeper* BackgroundSweeper() const { return sweeper_.get(); }
+
+    // waits till the background sweep of the last cycle is done
+    void WaitForSweep() {
+        if (sweeper_ != nullptr) {
+            SafeRegion safe{safepoint_};
+            sweeper_->Wait();
+        }
     }
 
+    // sweeps the rest of the last cycle right away, takes the heap lock unless it is held
+    void FinishSweep() {
+        HeapLock lock{*this, true};
+        if (sweeper_ != nullptr) {
+            sweeper_->Finish();
+        }
+    }
+
+    /*
+    Pages of big free blocks are given back to the OS every period, the pass takes the heap lock.
+    Heap must be used only through this class from then on: collection steps take the lock too,
+    direct calls of Memory race with the scavenger thread.
+    */
+    void EnableScavenger(std::chrono::milliseconds period, size_t min_free_block = Scavenger::DefaultMinFreeBlock) {
+        HeapLock lock = LockHeap();
+        scavenger_ = std::make_unique<Scavenger>(memory_, heap_mutex_, min_free_block);
+        scavenger_->Start(period);
+    }
+
+    const Scavenger* PageScavenger() const { return scavenger_.get(); }
+
+    // bytes of blocks and large objects found live by the last marking, dead ones may be not swept yet
+    size_t MarkedSize() const { return marked_size_; }
+
+    /*
+    Hybrid mode: most garbage is freed by deferred reference counting right after it becomes
+    unreachable, tracing runs only now and then to free cycles.
+
+    Counts in object headers are references from other heap objects only, roots are not counted.
+    Stores of pointers into heap objects must go through LinkToObj: the new target is counted
+    at once, decrement of the old one is buffered. Objects with count zero (new ones included)
+    wait in the zero count table (ZCT). Every batch buffered decrements are applied, then
+    objects from the ZCT which are not referenced from roots are freed, with objects whose
+    count drops to zero because of them. Batch is processed when either buffer holds batch
+    entries, when the pacer reaches its trigger and when allocation fails.
+
+    Counts stick at GcInfo::StickyRefCount, tracing recomputes all of them: every collection
+    frees cycles and sticky garbage and rebuilds the ZCT from the marked objects.
+    Tracing takes heap words equal to the address of an object as references to it, memory
+    that never holds pointers should be allocated with alloc_noscan. Every counted reference
+    is remembered with the object that holds it, and only those are decremented when the holder
+    dies or the link is replaced, so a word that just looks like a pointer never frees a live object.
+    */
+    void EnableRefCounting(size_t batch = DefaultRefCountBatch) {
+        HeapLock lock = LockHeap();
+        FinishSweep();
+        rc_batch_ = batch;
+        ref_count_observer_ = std::make_unique<RefCountObserver>(*this);
+        // references to objects allocated before were not counted, they are left to tracing
+        ForAllObjects([](void*, GcInfo& info){
+            info.ref_count = GcInfo::StickyRefCount;
+        });
+    }
+
+    bool RefCounting() const { return ref_count_observer_ != nullptr; }
+
+    const RefCountStats& RefCounts() const { return rc_stats_; }
+    size_t ZctSize() const { return zct_.size(); }
+    size_t PendingDecrements() const { return decrements_.size(); }
+
+    // from gets a pointer to `to` in a field that was empty
     void* LinkToPtr(void* from, void* to) {
-        Block& blk_from = memory_.GetBlockFromUserData(from);
-        Block& blk_to = memory_.GetBlockFromUserData(to);
-        if (blk_from.marked) {
-            blk_to.to_be_checked = true;
+        return LinkToPtr(from, to, nullptr);
+    }
+
+    /*
+    `to` (may be nullptr) replaces `old` (may be nullptr) in a field of from. May be called
+    with the heap lock held (e.g. from a memory observer), counts are only buffered then.
+    */
+    void* LinkToPtr(void* from, void* to, void* old) {
+        if (!HeapLocked()) {
+            safepoint_.Poll();
+        }
+        // outside of marking marks may be left for the sweeper
+        if (to != nullptr && marking_ && GetGcInfo(from).marked) {
+            GetGcInfo(to).to_be_checked = true;
+        }
+        if (RefCounting()) {
+            CountLink(from, to, old);
         }
         return to;
     }
@@ -33,23 +261,156 @@ public:
         return reinterpret_cast<To*>(LinkToPtr(from, to));
     }
 
-    void GcInit() {
-        memory_.ForAllBlocks([&](Block& blk){
-            blk.marked = false;
-            blk.to_be_checked = blk.root;
-            return true;
+    template<typename From, typename To>
+    To* LinkToObj(From* from, To* to, To* old) {
+        return reinterpret_cast<To*>(LinkToPtr(from, to, old));
+    }
+
+    /*
+    World stopped (or single mutator), takes the heap lock unless it is held. Applies buffered
+    decrements and frees objects that are unreachable by counts, returns freed bytes. Nothing is
+    done during marking.
+    */
+    size_t ProcessRefCounts() {
+        HeapLock lock{*this, true};
+        if (!RefCounting() || marking_) {
+            return 0;
+        }
+        FinishSweep();
+        ++rc_stats_.batches;
+
+        // entries of objects freed with free are dropped
+        KeepObjects(decrements_);
+        for (void* obj : decrements_) {
+            GcInfo& info = GetGcInfo(obj);
+            if (info.ref_count != GcInfo::StickyRefCount && info.ref_count > 0 && --info.ref_count == 0) {
+                AddToZct(obj);
+            }
+        }
+        decrements_.clear();
+        KeepObjects(zct_);
+
+        // marked is free outside of a cycle, it tells objects referenced from roots
+        std::vector<GcInfo*> rooted;
+        roots_.ForAllRoots([&](void* obj){
+            if (OwnsObject(obj)) {
+                rooted.push_back(&GetGcInfo(obj));
+            }
         });
+        ResolveAmbiguousRoots([&](GcInfo& info){
+            rooted.push_back(&info);
+        });
+        for (GcInfo* info : rooted) {
+            info->marked = true;
+        }
+
+        std::vector<void*> zct;
+        std::vector<void*> dead;
+        zct.swap(zct_);
+        for (void* obj : zct) {
+            GcInfo& info = GetGcInfo(obj);
+            if (!info.zct) {
+                continue;
+            }
+            info.zct = false;
+            if (info.ref_count != 0) {
+                continue;
+            }
+            if (info.marked) {
+                AddToZct(obj);
+                continue;
+            }
+            dead.push_back(obj);
+        }
+        // children counted for dead objects lose a reference, some of them die too
+        for (size_t idx = 0; idx < dead.size(); ++idx) {
+            auto counted = counted_refs_.find(dead[idx]);
+            if (counted == counted_refs_.end()) {
+                continue;
+            }
+            for (void* child : counted->second) {
+                GcInfo& info = GetGcInfo(child);
+                if (info.ref_count == GcInfo::StickyRefCount || info.ref_count == 0 || --info.ref_count != 0) {
+                    continue;
+                }
+                if (info.marked) {
+                    AddToZct(child);
+                } else {
+                    info.zct = false;
+                    dead.push_back(child);
+                }
+            }
+            counted_refs_.erase(counted);
+        }
+
+        for (GcInfo* info : rooted) {
+            info->marked = false;
+        }
+        if (!weak_index_.empty()) {
+            for (void* obj : dead) {
+                ClearWeakRefsOf(obj);
+            }
+        }
+        size_t freed = 0;
+        for (void* obj : dead) {
+            freed += ObjectSize(obj);
+        }
+        memory_.free_batch(dead.data(), dead.size());
+        rc_stats_.freed_objects += dead.size();
+        rc_stats_.freed_bytes += freed;
+        return freed;
+    }
+
+    // between GcInit and GcCollect
+    bool Marking() const { return marking_; }
+
+    // objects allocated while marking is in progress are live in the current cycle
+    void AllocateBlack(void* obj) {
+        GcInfo& info = GetGcInfo(obj);
+        if (!info.marked) {
+            info.marked = true;
+            marked_size_ += ObjectSize(obj);
+        }
+    }
+
+    // mark bits are cleared by GcCollect (or the sweeper), so only roots have to be visited here
+    void GcInit() {
+        HeapLock lock{*this, true};
+        assert(memory_.GetGuardedPool() == nullptr);
+        FinishSweep();
+        marking_ = true;
+        marked_size_ = 0;
+        GreyRoots();
     }
 
     bool GcMarkStep() {
+        HeapLock lock{*this, true};
         bool result = false;
         memory_.ForAllBlocks([&](Block& blk){
             if(blk.to_be_checked) {
                 result = true;
                 blk.marked = true;
+                marked_size_ += BlockBytes(blk);
                 blk.to_be_checked = false;
-                IterateObjPointers(blk, [&](Block& blk){
-                    blk.to_be_checked |= !blk.marked;
+                IterateObjPointers(blk, [&](GcInfo& info){
+                    Grey(info);
+                });
+                return false;
+            }
+            return true;
+        });
+        if (result) {
+            return result;
+        }
+        // large objects are traced separately and scanned only if they may hold pointers
+        memory_.los_.ForAllObjects([&](LargeObject& obj){
+            if (obj.to_be_checked) {
+                result = true;
+                obj.marked = true;
+                marked_size_ += obj.GetMappingSize();
+                obj.to_be_checked = false;
+                IterateObjPointers(obj, [&](GcInfo& info){
+                    Grey(info);
                 });
                 return false;
             }
@@ -58,35 +419,431 @@ public:
         return result;
     }
 
+    /*
+    Final pause of the cycle, done by GcCollect. The write barrier covers only stores into
+    marked heap objects, a reference moved from the heap into a root or a handle after GcInit
+    is not seen by it, so roots are greyed again and marking is finished.
+    */
+    void GcRemark() {
+        HeapLock lock{*this, true};
+        GreyRoots();
+        while (GcMarkStep()) { }
+    }
+
     void GcCollect() {
-        auto get_occupied_unmarked_block = [&]()->Block*{
-            Block* result = nullptr;
-            memory_.ForAllBlocks([&](Block& blk){
-                if (!blk.IsFree() && !blk.marked) {
-                    result = &blk;
-                    return false;
-                }
-                blk.marked = false;
-                return true;
-            });
-            return result;
-        };
-        Block* blk = nullptr;
-        while((blk = get_occupied_unmarked_block()) != nullptr) {
-            memory_.free(blk->ToUserData());
+        HeapLock lock{*this, true};
+        GcRemark();
+        ClearWeakRefs([this](void* obj){ return !GetGcInfo(obj).marked; });
+        if (RefCounting()) {
+            RecomputeRefCounts();
+        }
+        if (sweeper_ != nullptr) {
+            marking_ = false;
+            sweeper_->Start();
+            return;
         }
+        std::vector<void*> dead;
+        memory_.ForAllBlocks([&](Block& blk){
+            if (!blk.IsFree() && !blk.marked) {
+                dead.push_back(blk.ToUserData());
+            }
+            blk.marked = false;
+            blk.to_be_checked = false;
+            return true;
+        });
+        memory_.los_.ForAllObjects([&](LargeObject& obj){
+            if (!obj.marked) {
+                dead.push_back(obj.ToUserData());
+            }
+            obj.marked = false;
+            obj.to_be_checked = false;
+            return true;
+        });
+        memory_.free_batch(dead.data(), dead.size());
+        marking_ = false;
     }
 
     void FullGc() {
+        HeapLock lock{*this, true};
         GcInit();
         while(GcMarkStep()) { };
         GcCollect();
     }
 private:
+    bool marking_ = false;
+    size_t marked_size_ = 0;
+    Safepoint safepoint_;
+    std::mutex heap_mutex_;
+    // declared after the heap mutex, they are destroyed first
+    std::unique_ptr<Sweeper> sweeper_;
+    std::unique_ptr<Scavenger> scavenger_;
+
+    // puts new objects into the ZCT and processes it when it is full
+    class RefCountObserver : public MemoryObserver {
+    public:
+        explicit RefCountObserver(Gc& gc) : gc_{gc} { gc_.memory_.AddObserver(this); }
+        RefCountObserver(const RefCountObserver&) = delete;
+        RefCountObserver& operator=(const RefCountObserver&) = delete;
+        ~RefCountObserver() { gc_.memory_.RemoveObserver(this); }
+
+        void BeforeAlloc(size_t) override {
+            if (gc_.zct_.size() >= gc_.rc_batch_ && !gc_.marking_) {
+                StopTheWorldScope stw{gc_.safepoint_};
+                gc_.ProcessRefCounts();
+            }
+        }
+
+        void OnAlloc(void* ptr, size_t) override {
+            gc_.AddToZct(ptr);
+        }
+
+    private:
+        Gc& gc_;
+    };
+
+    size_t rc_batch_ = DefaultRefCountBatch;
+    std::vector<void*> zct_;
+    std::vector<void*> decrements_;
+    // holder -> objects whose counts include a reference from it, one entry per reference
+    std::unordered_map<void*, std::vector<void*>> counted_refs_;
+    RefCountStats rc_stats_;
+    std::unique_ptr<RefCountObserver> ref_count_observer_;
+
+    struct WeakEntry {
+        void* target = nullptr;
+        void* data = nullptr;
+        bool used = false;
+        bool queued = false; // in cleared_weak_refs_
+    };
+
+    std::vector<WeakEntry> weak_refs_;
+    std::vector<WeakRef> free_weak_refs_;
+    std::vector<WeakRef> cleared_weak_refs_;
+    // target -> its references, cleared ones are not in it
+    std::unordered_multimap<void*, WeakRef> weak_index_;
+    size_t live_weak_refs_ = 0;
+    WeakRefCallback weak_ref_callback_;
+
+    /*
+    Heap mutex taken by a mutator. The owning thread is remembered: taking the lock again
+    asserts instead of hanging, and LinkToPtr can tell that it runs under the lock.
+    Collection steps lock reentrantly, they are called by Collect and the pacer with the lock
+    held and by a single mutator without it. Background sweeper and scavenger lock heap_mutex_
+    directly.
+    */
+    class HeapLock {
+    public:
+        // reentrant lock takes nothing if the calling thread holds the heap already
+        explicit HeapLock(Gc& gc, bool reentrant = false) : gc_{gc}, lock_{gc.heap_mutex_, std::defer_lock} {
+            if (reentrant && gc_.HeapLocked()) {
+                return;
+            }
+            assert(!gc_.HeapLocked());
+            // waiting for the heap is a safe region, holder of the heap may be stopping the world
+            if (!lock_.try_lock()) {
+                SafeRegion safe{gc_.safepoint_};
+                lock_.lock();
+            }
+            gc_.heap_owner_ = std::this_thread::get_id();
+        }
+        HeapLock(const HeapLock&) = delete;
+        HeapLock& operator=(const HeapLock&) = delete;
+        // cleared weak references go to the callback after unlocking, it may use the heap
+        ~HeapLock() {
+            if (!lock_.owns_lock()) {
+                return;
+            }
+            WeakRefCallback callback;
+            std::vector<std::pair<WeakRef, void*>> cleared;
+            if (gc_.weak_ref_callback_ && !gc_.cleared_weak_refs_.empty()) {
+                callback = gc_.weak_ref_callback_;
+                for (WeakRef ref : gc_.TakeClearedWeakRefsLocked()) {
+                    cleared.emplace_back(ref, gc_.weak_refs_[ref].data);
+                }
+            }
+            gc_.heap_owner_ = std::thread::id{};
+            lock_.unlock();
+            for (const auto& [ref, data] : cleared) {
+                callback(ref, data);
+            }
+        }
+
+    private:
+        Gc& gc_;
+        std::unique_lock<std::mutex> lock_;
+    };
+
+    HeapLock LockHeap() { return HeapLock{*this}; }
+
+    bool HeapLocked() const { return heap_owner_ == std::this_thread::get_id(); }
+
+    std::atomic<std::thread::id> heap_owner_{};
+    RootSet roots_;
+
+    // shadow stacks are shared by all heaps of the thread, handles of other heaps are skipped
+    bool OwnsObject(void* obj) const {
+        return memory_.IsInAddrSpace(obj) || memory_.los_.Owns(obj);
+    }
+
+    static void Grey(GcInfo& info) {
+        info.to_be_checked |= !info.marked;
+    }
+
+    static size_t BlockBytes(const Block& blk) {
+        return blk.GetUserDataSize() + align(sizeof(Block));
+    }
+
+    size_t ObjectSize(void* obj) {
+        if (memory_.IsInAddrSpace(obj)) {
+            return BlockBytes(Block::FromUserData(obj));
+        }
+        return LargeObject::FromUserData(obj).GetMappingSize();
+    }
+
+    // obj is a pointer returned by alloc, header is right before it
+    GcInfo& GetGcInfo(void* obj) {
+        if (memory_.IsInAddrSpace(obj)) {
+            return Block::FromUserData(obj);
+        }
+        return LargeObject::FromUserData(obj);
+    }
+
+    void GreyRoots() {
+        roots_.ForAllRoots([&](void* obj){
+            if (OwnsObject(obj)) {
+                Grey(GetGcInfo(obj));
+            }
+        });
+        GreyAmbiguousRoots();
+    }
+
+    void GreyAmbiguousRoots() {
+        ResolveAmbiguousRoots([](GcInfo& info){
+            Grey(info);
+        });
+    }
+
+    // words from thread stacks may point anywhere, they are resolved with one walk over sorted candidates
+    template <typename Handler>
+    void ResolveAmbiguousRoots(Handler&& handler) {
+        std::vector<void*> candidates;
+        roots_.ForAllAmbiguousRoots([&](void* word){
+            if (memory_.IsInAddrSpace(word)) {
+                candidates.push_back(word);
+            } else if (LargeObject* large = memory_.los_.Find(word)) {
+                handler(*large);
+            }
+        });
+        if (candidates.empty()) {
+            return;
+        }
+        std::sort(candidates.begin(), candidates.end());
+        size_t idx = 0;
+        memory_.ForAllBlocks([&](Block& blk){
+            while (idx < candidates.size() && blk.InBlock(memory_.aspace_.address(candidates[idx]))) {
+                if (!blk.IsFree()) {
+                    handler(blk);
+                }
+                ++idx;
+            }
+            return idx < candidates.size();
+        });
+    }
+
+    // batch is processed only when the lock is taken here, the holder may be processing one
+    void CountLink(void* from, void* to, void* old) {
+        if (HeapLocked()) {
+            CountLinkLocked(from, to, old);
+            return;
+        }
+        HeapLock lock = LockHeap();
+        CountLinkLocked(from, to, old);
+        if (decrements_.size() >= rc_batch_ && !marking_) {
+            StopTheWorldScope stw{safepoint_};
+            ProcessRefCounts();
+        }
+    }
+
+    // old is decremented only if its reference from `from` was counted
+    void CountLinkLocked(void* from, void* to, void* old) {
+        if (to != nullptr) {
+            GcInfo& info = GetGcInfo(to);
+            if (info.ref_count != GcInfo::StickyRefCount) {
+                ++info.ref_count;
+                counted_refs_[from].push_back(to);
+            }
+        }
+        if (old != nullptr) {
+            auto counted = counted_refs_.find(from);
+            if (counted == counted_refs_.end()) {
+                return;
+            }
+            std::vector<void*>& children = counted->second;
+            auto child = std::find(children.begin(), children.end(), old);
+            if (child == children.end()) {
+                return;
+            }
+            *child = children.back();
+            children.pop_back();
+            if (children.empty()) {
+                counted_refs_.erase(counted);
+            }
+            decrements_.push_back(old);
+        }
+    }
+
+    // one scan of the live references, heap lock held
+    template <typename Dead>
+    void ClearWeakRefs(Dead&& dead) {
+        for (auto it = weak_index_.begin(); it != weak_index_.end(); ) {
+            if (dead(it->first)) {
+                ClearWeakRef(it->second);
+                it = weak_index_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // references to obj, which is freed, heap lock held
+    void ClearWeakRefsOf(void* obj) {
+        auto range = weak_index_.equal_range(obj);
+        for (auto it = range.first; it != range.second; ++it) {
+            ClearWeakRef(it->second);
+        }
+        weak_index_.erase(range.first, range.second);
+    }
+
+    void ClearWeakRef(WeakRef ref) {
+        WeakEntry& entry = weak_refs_[ref];
+        entry.target = nullptr;
+        entry.queued = true;
+        cleared_weak_refs_.push_back(ref);
+    }
+
+    std::vector<WeakRef> TakeClearedWeakRefsLocked() {
+        std::vector<WeakRef> cleared;
+        cleared.swap(cleared_weak_refs_);
+        for (WeakRef ref : cleared) {
+            weak_refs_[ref].queued = false;
+        }
+        return cleared;
+    }
+
+    void AddToZct(void* obj) {
+        GcInfo& info = GetGcInfo(obj);
+        if (!info.zct) {
+            info.zct = true;
+            zct_.push_back(obj);
+        }
+    }
+
+    // leaves unique pointers to allocated objects, resolved with one walk over the sorted pointers
+    void KeepObjects(std::vector<void*>& objs) {
+        std::sort(objs.begin(), objs.end());
+        objs.erase(std::unique(objs.begin(), objs.end()), objs.end());
+        auto large_begin = std::stable_partition(objs.begin(), objs.end(), [this](void* obj){
+            return memory_.IsInAddrSpace(obj);
+        });
+        std::vector<void*> kept;
+        kept.reserve(objs.size());
+        auto it = objs.begin();
+        memory_.ForAllBlocks([&](Block& blk){
+            while (it != large_begin && blk.InBlock(memory_.aspace_.address(*it))) {
+                if (!blk.IsFree() && blk.ToUserData() == *it) {
+                    kept.push_back(*it);
+                }
+                ++it;
+            }
+            return it != large_begin;
+        });
+        for (it = large_begin; it != objs.end(); ++it) {
+            LargeObject* large = memory_.los_.Find(*it);
+            if (large != nullptr && large->ToUserData() == *it) {
+                kept.push_back(*it);
+            }
+        }
+        objs.swap(kept);
+    }
+
+    // marked objects are live, each of them counts as a reference for the objects it points to
+    void RecomputeRefCounts() {
+        zct_.clear();
+        decrements_.clear();
+        counted_refs_.clear();
+        ForAllObjects([](void*, GcInfo& info){
+            info.ref_count = 0;
+            info.zct = false;
+        });
+        ForAllObjects([&](void* obj, GcInfo& info){
+            if (info.marked) {
+                ForAllReferences(obj, [&](void* child, GcInfo& child_info){
+                    if (child_info.ref_count != GcInfo::StickyRefCount) {
+                        ++child_info.ref_count;
+                        counted_refs_[obj].push_back(child);
+                    }
+                });
+            }
+        });
+        ForAllObjects([&](void* obj, GcInfo& info){
+            if (info.marked && info.ref_count == 0) {
+                AddToZct(obj);
+            }
+        });
+    }
+
     template <typename Handler>
-    void IterateObjPointers(const Block& blk, Handler&& handler) {
-        void **ptr = reinterpret_cast<void**>(blk.ToUserData());
-        size_t sz = blk.GetUserDataSize() / sizeof(void*);
+    void ForAllObjects(Handler&& handler) {
+        memory_.ForAllBlocks([&](Block& blk){
+            if (!blk.IsFree()) {
+                handler(blk.ToUserData(), blk);
+            }
+            return true;
+        });
+        memory_.los_.ForAllObjects([&](LargeObject& obj){
+            handler(obj.ToUserData(), obj);
+            return true;
+        });
+    }
+
+    // objects whose exact address is stored in obj, counts are kept for such references only
+    template <typename Handler>
+    void ForAllReferences(void* obj, Handler&& handler) {
+        const GcInfo& info = GetGcInfo(obj);
+        if (info.no_pointers) {
+            return;
+        }
+        void** ptr = reinterpret_cast<void**>(obj);
+        const size_t sz = (memory_.IsInAddrSpace(obj) ? Block::FromUserData(obj).GetUserDataSize()
+                                                      : LargeObject::FromUserData(obj).GetUserDataSize()) / sizeof(void*);
+        for (size_t idx = 0; idx < sz; ++idx) {
+            void* word = ptr[idx];
+            if (memory_.IsInAddrSpace(word)) {
+                const auto address = memory_.aspace_.address(word);
+                memory_.ForAllBlocks([&](Block& blk){
+                    if (!blk.InBlock(address)) {
+                        return true;
+                    }
+                    if (!blk.IsFree() && blk.ToUserData() == word) {
+                        handler(word, blk);
+                    }
+                    return false;
+                });
+            } else if (LargeObject* large = memory_.los_.Find(word)) {
+                if (large->ToUserData() == word) {
+                    handler(word, *large);
+                }
+            }
+        }
+    }
+
+    template <typename Obj, typename Handler>
+    void IterateObjPointers(const Obj& obj, Handler&& handler) {
+        if (obj.no_pointers) {
+            return;
+        }
+        void **ptr = reinterpret_cast<void**>(obj.ToUserData());
+        size_t sz = obj.GetUserDataSize() / sizeof(void*);
         for (size_t idx = 0; idx < sz; ++idx) {
             if (memory_.IsInAddrSpace(ptr[idx])) {
                 const auto address = memory_.aspace_.address(ptr[idx]);
@@ -96,6 +853,8 @@ private:
                     }
                     return true;
                 });
+            } else if (LargeObject* large = memory_.los_.Find(ptr[idx])) {
+                handler(*large);
             }
         }
     }
@@ -1,37 +1,50 @@
 // faster implementation of GC
 #pragma once
 
+#include "mark_stack.h"
 #include "memory.h"
+#include "roots.h"
 
+#include <algorithm>
 #include <vector>
 
 class Gc{
     Memory& memory_;
 public:
-    // unsafe, max N of blocks is limited to preallocated amount of data in vector to_be_checked
-    Gc(Memory& mem) : memory_{mem}, to_be_checked{mem.allocator<Block*>()} { to_be_checked.reserve(16); }
+    static const size_t DefaultMarkStackSegments = 256;
+
     /*
-    For safe implementation we need:
-    1. update Allocator class: add reallocate method and account blocks flags during reallocation of blocks
-    2. on blocks reallocation we need to check presence of their adderesses in to_be_checked vector
-       and update these addresses
+    Grey blocks are kept in a mark stack outside of the collected memory, at most
+    mark_stack_segments segments of MarkStack::SegmentSize bytes. When it overflows
+    marking goes on by rescanning the heap for grey blocks, so any graph can be marked.
     */
+    Gc(Memory& mem, size_t mark_stack_segments = DefaultMarkStackSegments)
+        : memory_{mem}
+        , to_be_checked{mark_stack_segments}
+    {
+        // guarded pool objects are not traced, a collected heap must not sample
+        assert(memory_.GetGuardedPool() == nullptr);
+    }
 
     void RegisterRootObject(void* obj) {
-        Block& blk = memory_.GetBlockFromUserData(obj);
-        blk.root = true;
+        GetGcInfo(obj).root = true;
+        roots_.Add(obj);
     }
 
     void UnregisterRootObject(void* obj) {
-        Block& blk = memory_.GetBlockFromUserData(obj);
-        blk.root = false;
+        GetGcInfo(obj).root = false;
+        roots_.Remove(obj);
     }
 
+    RootSet& Roots() { return roots_; }
+
     void* LinkToPtr(void* from, void* to) {
-        Block& blk_from = memory_.GetBlockFromUserData(from);
-        Block& blk_to = memory_.GetBlockFromUserData(to);
-        if (blk_from.marked) {
-            blk_to.to_be_checked = true;
+        if (GetGcInfo(from).marked) {
+            if (memory_.IsInAddrSpace(to)) {
+                Grey(Block::FromUserData(to));
+            } else {
+                Grey(LargeObject::FromUserData(to));
+            }
         }
         return to;
     }
@@ -41,59 +54,72 @@ public:
         return reinterpret_cast<To*>(LinkToPtr(from, to));
     }
 
+    // between GcInit and GcCollect
+    bool Marking() const { return marking_; }
+
+    // objects allocated while marking is in progress are live in the current cycle
+    void AllocateBlack(void* obj) {
+        GetGcInfo(obj).marked = true;
+    }
+
+    // mark bits are cleared by GcCollect, so only roots have to be visited here
     void GcInit() {
-        void *data = to_be_checked.data();
-        const auto address = memory_.aspace_.address(data);
-        Block* blk = nullptr;
-        memory_.ForAllBlocks([&](Block& b){
-            if (b.InBlock(address)) {
-                blk = &b;
-                return false;
-            }
-            return true;
-        });
-        assert(blk != nullptr);
-        memory_.ForAllBlocks([&](Block& blk){
-            blk.marked = false;
-            if (blk.root) {
-                blk.to_be_checked = true;
-                to_be_checked.push_back(&blk);
+        assert(memory_.GetGuardedPool() == nullptr);
+        marking_ = true;
+        to_be_checked.Clear();
+        to_be_checked.ClearOverflow();
+        large_to_be_checked.clear();
+        // shadow stacks are shared by all heaps of the thread, handles of other heaps are skipped
+        roots_.ForAllRoots([&](void* obj){
+            if (memory_.IsInAddrSpace(obj)) {
+                Grey(Block::FromUserData(obj));
+            } else if (memory_.los_.Owns(obj)) {
+                Grey(LargeObject::FromUserData(obj));
             }
-            return true;
         });
-        blk->marked = true;
+        GreyAmbiguousRoots();
     }
 
     bool GcMarkStep() {
-        if (to_be_checked.empty()) {
-            return false;
+        if (!large_to_be_checked.empty()) {
+            LargeObject* obj = large_to_be_checked.back();
+            large_to_be_checked.pop_back();
+            Mark(*obj);
+            return true;
         }
-        Block* blk = to_be_checked.back();
-        to_be_checked.pop_back();
-
-        blk->marked = true;
-        blk->to_be_checked = false;
-        IterateObjPointers(*blk, [&](Block& blk){
-            if (!blk.marked && !blk.to_be_checked) {
-                to_be_checked.push_back(&blk);
+        Block* blk = nullptr;
+        while (to_be_checked.Pop(blk)) {
+            // after a rescan a block may be on the stack twice
+            if (!blk->marked) {
+                Mark(*blk);
+                return true;
             }
-        });
-        return true;
+        }
+        return to_be_checked.Overflowed() && RescanGrey();
     }
 
+    const MarkStack<Block*>& MarkStackStats() const { return to_be_checked; }
+
     void GcCollect() {
-        to_be_checked.clear();
+        std::vector<void*> dead;
         memory_.ForAllBlocks([&](Block& blk){
             if (!blk.IsFree() && !blk.marked) {
-                to_be_checked.push_back(&blk);
+                dead.push_back(blk.ToUserData());
             }
             blk.marked = false;
+            blk.to_be_checked = false;
             return true;
         });
-
-        for(auto *blk : to_be_checked) {
-            memory_.free(blk->ToUserData());
-        }
+        memory_.los_.ForAllObjects([&](LargeObject& obj){
+            if (!obj.marked) {
+                dead.push_back(obj.ToUserData());
+            }
+            obj.marked = false;
+            obj.to_be_checked = false;
+            return true;
+        });
+        memory_.free_batch(dead.data(), dead.size());
+        marking_ = false;
     }
 
     void FullGc() {
@@ -102,12 +128,92 @@ public:
         GcCollect();
     }
 private:
-    std::vector<Block *, Allocator<Block *>> to_be_checked;
+    bool marking_ = false;
+    MarkStack<Block *> to_be_checked;
+    // large objects are few, their grey list lives outside of the managed heap
+    std::vector<LargeObject *> large_to_be_checked;
+
+    RootSet roots_;
+
+    // obj is a pointer returned by alloc, header is right before it
+    GcInfo& GetGcInfo(void* obj) {
+        if (memory_.IsInAddrSpace(obj)) {
+            return Block::FromUserData(obj);
+        }
+        return LargeObject::FromUserData(obj);
+    }
+
+    // grey flag is set even if the stack is full, RescanGrey finds such blocks later
+    void Grey(Block& blk) {
+        if (!blk.marked && !blk.to_be_checked) {
+            blk.to_be_checked = true;
+            to_be_checked.Push(&blk);
+        }
+    }
+
+    void Grey(LargeObject& large) {
+        if (!large.marked && !large.to_be_checked) {
+            large.to_be_checked = true;
+            large_to_be_checked.push_back(&large);
+        }
+    }
+
+    // refills the overflowed mark stack with grey blocks, false if there are none
+    bool RescanGrey() {
+        to_be_checked.ClearOverflow();
+        memory_.ForAllBlocks([&](Block& blk){
+            if (blk.to_be_checked && !blk.marked) {
+                return to_be_checked.Push(&blk);
+            }
+            return true;
+        });
+        return !to_be_checked.Empty();
+    }
+
+    template <typename Obj>
+    void Mark(Obj& obj) {
+        obj.marked = true;
+        obj.to_be_checked = false;
+        IterateObjPointers(obj, [&](Block& blk){
+            Grey(blk);
+        }, [&](LargeObject& large){
+            Grey(large);
+        });
+    }
 
-    template <typename Handler>
-    void IterateObjPointers(const Block& blk, Handler&& handler) {
-        void **ptr = reinterpret_cast<void**>(blk.ToUserData());
-        size_t sz = blk.GetUserDataSize() / sizeof(void*);
+    // words from thread stacks may point anywhere, they are resolved with one walk over sorted candidates
+    void GreyAmbiguousRoots() {
+        std::vector<void*> candidates;
+        roots_.ForAllAmbiguousRoots([&](void* word){
+            if (memory_.IsInAddrSpace(word)) {
+                candidates.push_back(word);
+            } else if (LargeObject* large = memory_.los_.Find(word)) {
+                Grey(*large);
+            }
+        });
+        if (candidates.empty()) {
+            return;
+        }
+        std::sort(candidates.begin(), candidates.end());
+        size_t idx = 0;
+        memory_.ForAllBlocks([&](Block& blk){
+            while (idx < candidates.size() && blk.InBlock(memory_.aspace_.address(candidates[idx]))) {
+                if (!blk.IsFree()) {
+                    Grey(blk);
+                }
+                ++idx;
+            }
+            return idx < candidates.size();
+        });
+    }
+
+    template <typename Obj, typename BlockHandler, typename LargeHandler>
+    void IterateObjPointers(const Obj& obj, BlockHandler&& handler, LargeHandler&& large_handler) {
+        if (obj.no_pointers) {
+            return;
+        }
+        void **ptr = reinterpret_cast<void**>(obj.ToUserData());
+        size_t sz = obj.GetUserDataSize() / sizeof(void*);
         for (size_t idx = 0; idx < sz; ++idx) {
             if (memory_.IsInAddrSpace(ptr[idx])) {
                 const auto address = memory_.aspace_.address(ptr[idx]);
@@ -117,6 +223,8 @@ private:
                     }
                     return true;
                 });
+            } else if (LargeObject* large = memory_.los_.Find(ptr[idx])) {
+                large_handler(*large);
             }
         }
     }
@@ -0,0 +1,467 @@
+#pragma once
+
+#include "large_object_space.h"
+#include "roots.h"
+#include "size.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/*
+Mark-region space for gc managed objects (Immix).
+
+Space is cut into blocks of BlockSize bytes, every block into lines of LineSize bytes.
+Marking sets the mark of an object and of all lines the object covers, sweeping
+does not free objects one by one: lines without marks are free, a run of free
+lines is a hole. Allocation bumps a pointer through holes of partly used (recyclable)
+blocks, then through free blocks. Objects bigger than a line that do not fit
+into the current hole are bumped into a separate free block (overflow allocation),
+so medium objects do not waste the small holes. Objects bigger than MaxMediumSize
+go to a LargeObjectSpace.
+
+Objects are precise: every object has a header with its size and the number of
+leading pointer slots, the first `pointers` words of an object are pointers to objects
+of this space (or nullptr), the rest is never scanned. This is what allows evacuation:
+at the start of a cycle sparse recyclable blocks are chosen, objects in them
+reached through a heap slot are copied into free blocks and the slot is updated.
+Objects reached from roots (registered, shadow stacks, scanned stacks) are marked
+before any slot is traced, so they are pinned and never move.
+
+Space is not thread safe, it is meant for one mutator. Collection happens in
+alloc when the space is exhausted, or by Collect().
+
+    ImmixSpace space{lowest, highest};
+    auto* node = reinterpret_cast<Node*>(space.alloc(sizeof(Node), 1));   // Node::next is the first field
+    space.RegisterRootObject(node);
+*/
+class ImmixSpace {
+public:
+    static const size_t BlockSize = 32 * 1024;
+    static const size_t LineSize = 128;
+    static const size_t LinesPerBlock = BlockSize / LineSize;
+    static const size_t Granule = 8;
+    static const size_t MaxMediumSize = BlockSize / 4;
+    // recyclable blocks with at most this share of live lines are evacuated
+    static const size_t EvacuationLivePercent = 25;
+
+    struct Header {
+        uint32_t size;      // whole object with the header, aligned to Granule
+        uint16_t pointers;  // leading pointer slots
+        uint8_t mark;       // epoch of the last cycle that found the object live
+        uint8_t forwarded;  // object was evacuated, new address is in its first slot
+    };
+
+    static const size_t HeaderSize = sizeof(Header);
+
+    ImmixSpace(void* lowest_addr, void* highest_addr)
+        : base_{align(reinterpret_cast<uintptr_t>(lowest_addr), BlockSize)}
+        , blocks_((reinterpret_cast<uintptr_t>(highest_addr) - base_) / BlockSize)
+    {
+        assert(reinterpret_cast<uintptr_t>(highest_addr) > base_);
+        assert(!blocks_.empty());
+        for (size_t idx = blocks_.size(); idx > 0; --idx) {
+            free_blocks_.push_back(idx - 1);
+        }
+    }
+
+    ImmixSpace(const ImmixSpace&) = delete;
+    ImmixSpace& operator=(const ImmixSpace&) = delete;
+
+    // returns nullptr if there is no memory even after collection
+    void* alloc(size_t sz, size_t pointers = 0) {
+        assert(pointers * sizeof(void*) <= sz);
+        // forwarding address needs one slot
+        const size_t size = align(HeaderSize + std::max(sz, sizeof(void*)), Granule);
+        void* obj = TryAlloc(size, pointers);
+        if (obj == nullptr) {
+            Collect();
+            obj = TryAlloc(size, pointers);
+        }
+        return obj;
+    }
+
+    void RegisterRootObject(void* obj) { roots_.Add(obj); }
+    void UnregisterRootObject(void* obj) { roots_.Remove(obj); }
+    RootSet& Roots() { return roots_; }
+
+    void Collect() {
+        ++cycles_;
+        epoch_ = epoch_ == 255 ? 1 : epoch_ + 1;
+        ResetAllocator();
+        SelectEvacuationCandidates();
+        for (BlockInfo& info : blocks_) {
+            std::memset(info.line_marks, 0, sizeof(info.line_marks));
+        }
+
+        // roots first, so that every object reachable from them is pinned
+        roots_.ForAllRoots([&](void* obj){
+            MarkPinned(obj);
+        });
+        roots_.ForAllAmbiguousRoots([&](void* word){
+            if (void* obj = FindObject(word)) {
+                MarkPinned(obj);
+            }
+        });
+        while (!mark_stack_.empty()) {
+            void* obj = mark_stack_.back();
+            mark_stack_.pop_back();
+            IterateObjPointers(obj, [&](void*& slot){
+                Trace(slot);
+            });
+        }
+
+        Sweep();
+    }
+
+    // handler gets a reference to every pointer slot of obj
+    template <typename Handler>
+    static void IterateObjPointers(void* obj, Handler&& handler) {
+        void** slots = reinterpret_cast<void**>(obj);
+        const size_t count = HeaderOf(obj).pointers;
+        for (size_t idx = 0; idx < count; ++idx) {
+            if (slots[idx] != nullptr) {
+                handler(slots[idx]);
+            }
+        }
+    }
+
+    bool Contains(const void* ptr) const {
+        const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+        return addr >= base_ && addr < base_ + blocks_.size() * BlockSize;
+    }
+
+    size_t Blocks() const { return blocks_.size(); }
+    size_t FreeBlocks() const { return free_blocks_.size(); }
+    size_t RecyclableBlocks() const { return recyclable_blocks_.size(); }
+    size_t Cycles() const { return cycles_; }
+    size_t EvacuatedObjects() const { return evacuated_objects_; }
+    size_t EvacuatedBytes() const { return evacuated_bytes_; }
+    // lines marked by the last collection
+    size_t LiveLines() const { return live_lines_; }
+    const LargeObjectSpace& LargeObjects() const { return los_; }
+
+private:
+    enum class BlockState : uint8_t { Free, Recyclable, Full };
+
+    struct BlockInfo {
+        uint8_t line_marks[LinesPerBlock] = {};
+        uint64_t starts[BlockSize / Granule / 64] = {}; // bit per granule where an object header starts
+        size_t live_lines = 0;
+        BlockState state = BlockState::Free;
+        bool evacuate = false;
+    };
+
+    // bump allocation region [cursor, limit)
+    struct Cursor {
+        uintptr_t cursor = 0;
+        uintptr_t limit = 0;
+        size_t block = 0;
+        size_t line = LinesPerBlock; // next line to look for a hole from
+    };
+
+    static Header& HeaderOf(void* obj) {
+        return *reinterpret_cast<Header*>(reinterpret_cast<uintptr_t>(obj) - HeaderSize);
+    }
+
+    size_t BlockIndex(uintptr_t addr) const { return (addr - base_) / BlockSize; }
+    uintptr_t BlockStart(size_t block) const { return base_ + block * BlockSize; }
+
+    void* TryAlloc(size_t size, size_t pointers) {
+        if (size > MaxMediumSize) {
+            return LargeAlloc(size, pointers);
+        }
+        if (small_.cursor + size > small_.limit) {
+            const bool medium = size > LineSize;
+            if (medium && (overflow_.cursor + size <= overflow_.limit || NextFreeBlock(overflow_))) {
+                return Place(overflow_, size, pointers);
+            }
+            do {
+                if (!NextHole(small_)) {
+                    return nullptr;
+                }
+            } while (small_.cursor + size > small_.limit);
+        }
+        return Place(small_, size, pointers);
+    }
+
+    void* Place(Cursor& c, size_t size, size_t pointers) {
+        const uintptr_t addr = c.cursor;
+        c.cursor += size;
+        Header& header = *reinterpret_cast<Header*>(addr);
+        header = Header{static_cast<uint32_t>(size), static_cast<uint16_t>(pointers), 0, 0};
+        SetStart(addr, true);
+        void* obj = reinterpret_cast<void*>(addr + HeaderSize);
+        std::memset(obj, 0, pointers * sizeof(void*));
+        return obj;
+    }
+
+    void* LargeAlloc(size_t size, size_t pointers) {
+        void* mem = los_.alloc(size);
+        if (mem == nullptr) {
+            return nullptr;
+        }
+        *reinterpret_cast<Header*>(mem) = Header{static_cast<uint32_t>(size), static_cast<uint16_t>(pointers), 0, 0};
+        void* obj = reinterpret_cast<char*>(mem) + HeaderSize;
+        std::memset(obj, 0, pointers * sizeof(void*));
+        return obj;
+    }
+
+    // next run of free lines in the cursor's block, then in recyclable and free blocks
+    bool NextHole(Cursor& c) {
+        while (true) {
+            if (c.line < LinesPerBlock) {
+                const uint8_t* marks = blocks_[c.block].line_marks;
+                size_t first = c.line;
+                while (first < LinesPerBlock && marks[first]) {
+                    ++first;
+                }
+                size_t last = first;
+                while (last < LinesPerBlock && !marks[last]) {
+                    ++last;
+                }
+                c.line = last;
+                if (first < last) {
+                    c.cursor = BlockStart(c.block) + first * LineSize;
+                    c.limit = BlockStart(c.block) + last * LineSize;
+                    return true;
+                }
+            }
+            if (!recyclable_blocks_.empty()) {
+                c.block = recyclable_blocks_.back();
+                recyclable_blocks_.pop_back();
+                c.line = 0;
+            } else if (!NextFreeBlock(c)) {
+                return false;
+            } else {
+                return true;
+            }
+        }
+    }
+
+    bool NextFreeBlock(Cursor& c) {
+        if (free_blocks_.empty()) {
+            return false;
+        }
+        c.block = free_blocks_.back();
+        free_blocks_.pop_back();
+        blocks_[c.block].state = BlockState::Full;
+        c.cursor = BlockStart(c.block);
+        c.limit = c.cursor + BlockSize;
+        c.line = LinesPerBlock;
+        return true;
+    }
+
+    void ResetAllocator() {
+        small_ = Cursor{};
+        overflow_ = Cursor{};
+        evacuation_ = Cursor{};
+    }
+
+    // sparse recyclable blocks while their live lines fit into free blocks
+    void SelectEvacuationCandidates() {
+        size_t reserve = free_blocks_.size() * LinesPerBlock;
+        for (BlockInfo& info : blocks_) {
+            info.evacuate = false;
+            if (info.state == BlockState::Recyclable
+                && info.live_lines * 100 <= LinesPerBlock * EvacuationLivePercent
+                && info.live_lines <= reserve) {
+                info.evacuate = true;
+                reserve -= info.live_lines;
+            }
+        }
+    }
+
+    void SetStart(uintptr_t addr, bool value) {
+        BlockInfo& info = blocks_[BlockIndex(addr)];
+        const size_t granule = (addr - BlockStart(BlockIndex(addr))) / Granule;
+        const uint64_t bit = uint64_t{1} << (granule % 64);
+        if (value) {
+            info.starts[granule / 64] |= bit;
+        } else {
+            info.starts[granule / 64] &= ~bit;
+        }
+    }
+
+    bool IsStart(uintptr_t addr) const {
+        const BlockInfo& info = blocks_[BlockIndex(addr)];
+        const size_t granule = (addr - BlockStart(BlockIndex(addr))) / Granule;
+        return info.starts[granule / 64] & (uint64_t{1} << (granule % 64));
+    }
+
+    // object containing an arbitrary word, nullptr if there is none
+    void* FindObject(void* word) {
+        const uintptr_t addr = reinterpret_cast<uintptr_t>(word);
+        if (!Contains(word)) {
+            if (LargeObject* large = los_.Find(word)) {
+                return reinterpret_cast<char*>(large->ToUserData()) + HeaderSize;
+            }
+            return nullptr;
+        }
+        const size_t block = BlockIndex(addr);
+        const uintptr_t start = BlockStart(block);
+        // nearest object start at or below the word
+        for (uintptr_t granule = align(addr - start + 1, Granule) / Granule; granule > 0; --granule) {
+            const uintptr_t header = start + (granule - 1) * Granule;
+            if (IsStart(header)) {
+                const Header& h = *reinterpret_cast<const Header*>(header);
+                return addr >= header + HeaderSize && addr < header + h.size
+                       ? reinterpret_cast<void*>(header + HeaderSize)
+                       : nullptr;
+            }
+        }
+        return nullptr;
+    }
+
+    // precise pointers point right after an object header
+    bool IsObject(void* obj) {
+        if (Contains(obj)) {
+            return IsStart(reinterpret_cast<uintptr_t>(obj) - HeaderSize);
+        }
+        LargeObject* large = los_.Find(obj);
+        return large != nullptr && reinterpret_cast<char*>(large->ToUserData()) + HeaderSize == obj;
+    }
+
+    // returns true if obj was not marked before
+    bool Mark(void* obj) {
+        if (!Contains(obj)) {
+            LargeObject& large = LargeObject::FromUserData(reinterpret_cast<char*>(obj) - HeaderSize);
+            if (large.marked) {
+                return false;
+            }
+            large.marked = true;
+            mark_stack_.push_back(obj);
+            return true;
+        }
+        Header& header = HeaderOf(obj);
+        if (header.mark == epoch_) {
+            return false;
+        }
+        header.mark = epoch_;
+        const uintptr_t begin = reinterpret_cast<uintptr_t>(&header);
+        BlockInfo& info = blocks_[BlockIndex(begin)];
+        const size_t first = (begin - BlockStart(BlockIndex(begin))) / LineSize;
+        const size_t last = (begin + header.size - 1 - BlockStart(BlockIndex(begin))) / LineSize;
+        std::memset(info.line_marks + first, 1, last - first + 1);
+        mark_stack_.push_back(obj);
+        return true;
+    }
+
+    void MarkPinned(void* obj) {
+        if (IsObject(obj)) {
+            Mark(obj);
+        }
+    }
+
+    void Trace(void*& slot) {
+        void* obj = slot;
+        if (!IsObject(obj)) {
+            return;
+        }
+        if (!Contains(obj)) {
+            Mark(obj);
+            return;
+        }
+        Header& header = HeaderOf(obj);
+        if (header.forwarded) {
+            slot = *reinterpret_cast<void**>(obj);
+            return;
+        }
+        if (header.mark != epoch_ && blocks_[BlockIndex(reinterpret_cast<uintptr_t>(obj))].evacuate) {
+            if (void* copy = Evacuate(obj)) {
+                slot = copy;
+                return;
+            }
+        }
+        Mark(obj);
+    }
+
+    // copies obj into a free block, nullptr if there is no room left
+    void* Evacuate(void* obj) {
+        Header& header = HeaderOf(obj);
+        if (evacuation_.cursor + header.size > evacuation_.limit && !NextFreeBlock(evacuation_)) {
+            return nullptr;
+        }
+        const uintptr_t addr = evacuation_.cursor;
+        evacuation_.cursor += header.size;
+        std::memcpy(reinterpret_cast<void*>(addr), &header, header.size);
+        SetStart(addr, true);
+        void* copy = reinterpret_cast<void*>(addr + HeaderSize);
+        header.forwarded = 1;
+        *reinterpret_cast<void**>(obj) = copy;
+        ++evacuated_objects_;
+        evacuated_bytes_ += header.size;
+        Mark(copy);
+        return copy;
+    }
+
+    /*
+    Object starts of dead objects are cleared, so a stale header is never taken for an object
+    (holes are reused without clearing). Blocks are classified by their line marks.
+    */
+    void Sweep() {
+        free_blocks_.clear();
+        recyclable_blocks_.clear();
+        live_lines_ = 0;
+        for (size_t block = blocks_.size(); block > 0; --block) {
+            BlockInfo& info = blocks_[block - 1];
+            const uintptr_t start = BlockStart(block - 1);
+            for (size_t word = 0; word < BlockSize / Granule / 64; ++word) {
+                uint64_t bits = info.starts[word];
+                while (bits != 0) {
+                    const size_t bit = __builtin_ctzll(bits);
+                    bits &= bits - 1;
+                    const Header& header = *reinterpret_cast<const Header*>(start + (word * 64 + bit) * Granule);
+                    if (header.mark != epoch_) {
+                        info.starts[word] &= ~(uint64_t{1} << bit);
+                    }
+                }
+            }
+            info.live_lines = std::count(info.line_marks, info.line_marks + LinesPerBlock, 1);
+            live_lines_ += info.live_lines;
+            if (info.live_lines == 0) {
+                info.state = BlockState::Free;
+                free_blocks_.push_back(block - 1);
+            } else if (info.live_lines < LinesPerBlock) {
+                info.state = BlockState::Recyclable;
+                recyclable_blocks_.push_back(block - 1);
+            } else {
+                info.state = BlockState::Full;
+            }
+        }
+
+        std::vector<LargeObject*> dead;
+        los_.ForAllObjects([&](LargeObject& obj){
+            if (!obj.marked) {
+                dead.push_back(&obj);
+            }
+            obj.marked = false;
+            return true;
+        });
+        for (LargeObject* obj : dead) {
+            los_.free(obj->ToUserData());
+        }
+    }
+
+    const uintptr_t base_;
+    std::vector<BlockInfo> blocks_;
+    std::vector<size_t> free_blocks_;
+    std::vector<size_t> recyclable_blocks_;
+
+    Cursor small_;
+    Cursor overflow_;
+    Cursor evacuation_;
+
+    LargeObjectSpace los_;
+    RootSet roots_;
+    std::vector<void*> mark_stack_;
+    uint8_t epoch_ = 0;
+
+    size_t cycles_ = 0;
+    size_t evacuated_objects_ = 0;
+    size_t evacuated_bytes_ = 0;
+    size_t live_lines_ = 0;
+};
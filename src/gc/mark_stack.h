@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/mman.h>
+
+/*
+Grey object stack for marking, kept outside of the heap being collected.
+
+Stack is a chain of fixed size segments taken from a pool mapped once with mmap,
+so marking never calls the allocator and memory use is bounded by max_segments.
+When the pool is exhausted Push fails and the stack remembers that it overflowed;
+the collector keeps grey state in object headers, so it can find grey objects
+that were dropped by rescanning the heap (see Gc::GcMarkStep in gc_faster.h).
+
+Pop goes through a small FIFO: items are prefetched when they move from the stack
+into the FIFO and returned PrefetchDistance pops later, when their cache lines
+have hopefully arrived.
+*/
+template <typename T>
+class MarkStack {
+public:
+    static const size_t SegmentSize = 4096;
+    static const size_t PrefetchDistance = 8;
+
+    explicit MarkStack(size_t max_segments)
+        : max_segments_{max_segments}
+    {
+        assert(max_segments > 0);
+        void* pool = ::mmap(nullptr, max_segments * SegmentSize, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        assert(pool != MAP_FAILED);
+        pool_ = static_cast<char*>(pool);
+    }
+
+    MarkStack(const MarkStack&) = delete;
+    MarkStack& operator=(const MarkStack&) = delete;
+
+    ~MarkStack() {
+        ::munmap(pool_, max_segments_ * SegmentSize);
+    }
+
+    // false if there is no room, the item is dropped and the stack is marked as overflowed
+    bool Push(T item) {
+        if (top_ == nullptr || top_->count == Segment::Capacity) {
+            Segment* segment = NewSegment();
+            if (segment == nullptr) {
+                overflowed_ = true;
+                return false;
+            }
+            segment->prev = top_;
+            top_ = segment;
+        }
+        top_->items[top_->count++] = item;
+        ++size_;
+        return true;
+    }
+
+    bool Pop(T& item) {
+        while (fifo_size_ < PrefetchDistance && top_ != nullptr) {
+            T next = top_->items[--top_->count];
+            if (top_->count == 0) {
+                Segment* empty = top_;
+                top_ = top_->prev;
+                FreeSegment(empty);
+            }
+            __builtin_prefetch(static_cast<const void*>(next));
+            fifo_[(fifo_head_ + fifo_size_) % PrefetchDistance] = next;
+            ++fifo_size_;
+        }
+        if (fifo_size_ == 0) {
+            return false;
+        }
+        item = fifo_[fifo_head_];
+        fifo_head_ = (fifo_head_ + 1) % PrefetchDistance;
+        --fifo_size_;
+        --size_;
+        return true;
+    }
+
+    bool Empty() const { return size_ == 0; }
+    size_t Size() const { return size_; }
+
+    void Clear() {
+        T item;
+        while (Pop(item)) { }
+    }
+
+    bool Overflowed() const { return overflowed_; }
+    void ClearOverflow() { overflowed_ = false; }
+
+    size_t MaxSegments() const { return max_segments_; }
+    size_t Segments() const { return segments_; }
+    size_t PeakSegments() const { return peak_segments_; }
+
+private:
+    struct Segment {
+        static const size_t Capacity = (SegmentSize - sizeof(void*) - sizeof(size_t)) / sizeof(T);
+
+        Segment* prev;
+        size_t count;
+        T items[Capacity];
+    };
+    static_assert(sizeof(Segment) <= SegmentSize, "segment does not fit");
+
+    Segment* NewSegment() {
+        Segment* segment = free_;
+        if (segment != nullptr) {
+            free_ = segment->prev;
+        } else if (used_ < max_segments_) {
+            segment = reinterpret_cast<Segment*>(pool_ + used_++ * SegmentSize);
+        } else {
+            return nullptr;
+        }
+        segment->count = 0;
+        ++segments_;
+        peak_segments_ = segments_ > peak_segments_ ? segments_ : peak_segments_;
+        return segment;
+    }
+
+    void FreeSegment(Segment* segment) {
+        segment->prev = free_;
+        free_ = segment;
+        --segments_;
+    }
+
+    const size_t max_segments_;
+    char* pool_ = nullptr;
+    size_t used_ = 0;          // segments of the pool ever handed out
+    Segment* free_ = nullptr;  // returned segments
+    Segment* top_ = nullptr;
+    size_t segments_ = 0;
+    size_t peak_segments_ = 0;
+    size_t size_ = 0;
+    bool overflowed_ = false;
+
+    T fifo_[PrefetchDistance];
+    size_t fifo_head_ = 0;
+    size_t fifo_size_ = 0;
+};
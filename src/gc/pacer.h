@@ -0,0 +1,188 @@
+#pragma once
+
+#include "gc.h"
+
+#include <algorithm>
+#include <cstddef>
+
+/*
+Schedules collections from Memory::alloc, so the user does not have to call FullGc.
+
+After every cycle the heap goal is set to live size * (1 + gc_percent / 100)
+(like GOGC in Go). Incremental cycle starts when the heap reaches the trigger,
+a bit below the goal; from then on every allocation pays for its bytes with
+mark steps (allocation debt), so marking ends before the heap reaches the goal.
+If it did not, the rest of marking is done at once. In non-incremental mode
+a full collection is done when the heap reaches the goal.
+
+When allocation fails, a full collection is done and allocation is retried.
+With reference counting on (Gc::EnableRefCounting) the pending counts are processed
+first in both cases, a cycle runs only if that did not free enough.
+
+Collection may happen inside any alloc, so objects must be reachable from roots
+(registered roots, handle scopes, scanned stacks) before the next allocation.
+All collection work is done with the world stopped, so the pacer also works
+for several mutators allocating with Gc::Alloc.
+*/
+class GcPacer : public MemoryObserver {
+public:
+    static const int DefaultGcPercent = 100;
+    static const size_t DefaultMinHeap = 16 * 1024;
+
+    GcPacer(Memory& mem, Gc& gc, int gc_percent = DefaultGcPercent, bool incremental = true)
+        : memory_{mem}
+        , gc_{gc}
+        , gc_percent_{gc_percent}
+        , incremental_{incremental}
+    {
+        live_ = HeapSize();
+        UpdateGoal();
+        memory_.AddObserver(this);
+    }
+
+    GcPacer(const GcPacer&) = delete;
+    GcPacer& operator=(const GcPacer&) = delete;
+
+    ~GcPacer() {
+        memory_.RemoveObserver(this);
+    }
+
+    // negative value turns automatic collection off (collection on allocation failure stays)
+    void SetGcPercent(int gc_percent) { gc_percent_ = gc_percent; UpdateGoal(); }
+    void SetMinHeap(size_t min_heap) { min_heap_ = min_heap; UpdateGoal(); }
+    void SetIncremental(bool incremental) { incremental_ = incremental; UpdateGoal(); }
+
+    size_t HeapGoal() const { return goal_; }
+    size_t Trigger() const { return trigger_; }
+    size_t Cycles() const { return cycles_; }
+    size_t MarkSteps() const { return total_steps_; }
+
+    void BeforeAlloc(size_t sz) override {
+        if (busy_ || gc_percent_ < 0) {
+            return;
+        }
+        // heap still holds garbage the background sweeper is freeing, only the goal starts a cycle then
+        const size_t trigger = gc_.Sweeping() ? goal_ : trigger_;
+        if (!gc_.Marking() && HeapSize() + sz < trigger) {
+            return;
+        }
+        Busy busy{*this};
+        StopTheWorldScope stw{gc_.Safepoints()};
+        // garbage freed by reference counting may put the cycle off
+        if (!gc_.Marking() && gc_.RefCounting()) {
+            gc_.ProcessRefCounts();
+            if (HeapSize() + sz < trigger) {
+                return;
+            }
+        }
+        if (gc_.Marking()) {
+            Assist(sz);
+        } else if (incremental_) {
+            StartCycle();
+            Assist(sz);
+        } else {
+            FullCycle();
+        }
+    }
+
+    void OnAlloc(void* ptr, size_t) override {
+        if (gc_.Marking()) {
+            gc_.AllocateBlack(ptr);
+        }
+    }
+
+    bool OnAllocFailure(size_t) override {
+        if (busy_) {
+            return false;
+        }
+        Busy busy{*this};
+        StopTheWorldScope stw{gc_.Safepoints()};
+        const size_t before = HeapSize();
+        // garbage of the last cycle may be still waiting for the background sweeper
+        gc_.FinishSweep();
+        if (HeapSize() < before || gc_.ProcessRefCounts() > 0) {
+            return true;
+        }
+        FullCycle();
+        gc_.FinishSweep();
+        return HeapSize() < before;
+    }
+
+private:
+    struct Busy {
+        GcPacer& pacer;
+        Busy(GcPacer& p) : pacer{p} { pacer.busy_ = true; }
+        ~Busy() { pacer.busy_ = false; }
+    };
+
+    size_t HeapSize() const { return memory_.OccupiedSize() + memory_.LargeObjectsSize(); }
+
+    void UpdateGoal() {
+        const size_t growth = gc_percent_ < 0 ? 0 : live_ / 100 * gc_percent_;
+        goal_ = std::max(min_heap_, live_ + growth);
+        // leave 1/8 of the runway for incremental marking
+        trigger_ = incremental_ ? live_ + (goal_ - live_) / 8 * 7 : goal_;
+    }
+
+    void StartCycle() {
+        gc_.GcInit();
+        steps_ = 0;
+        credit_ = 0;
+        // work of the previous cycle is the estimate for this one
+        const size_t heap = HeapSize();
+        const size_t runway = goal_ > heap ? goal_ - heap : 1;
+        assist_ratio_ = static_cast<double>(std::max<size_t>(last_steps_, 1)) / runway;
+    }
+
+    void Assist(size_t sz) {
+        credit_ += assist_ratio_ * sz;
+        const bool over_goal = HeapSize() + sz >= goal_;
+        while (credit_ >= 1 || over_goal) {
+            credit_ -= 1;
+            ++steps_;
+            if (!gc_.GcMarkStep()) {
+                FinishCycle();
+                return;
+            }
+        }
+    }
+
+    void FullCycle() {
+        if (!gc_.Marking()) {
+            gc_.GcInit();
+            steps_ = 0;
+        }
+        while (gc_.GcMarkStep()) {
+            ++steps_;
+        }
+        FinishCycle();
+    }
+
+    void FinishCycle() {
+        gc_.GcCollect();
+        total_steps_ += steps_;
+        last_steps_ = steps_;
+        // with background sweeping dead objects are still in the heap
+        live_ = gc_.Sweeping() ? gc_.MarkedSize() : HeapSize();
+        ++cycles_;
+        UpdateGoal();
+    }
+
+    Memory& memory_;
+    Gc& gc_;
+    int gc_percent_;
+    bool incremental_;
+    size_t min_heap_ = DefaultMinHeap;
+
+    size_t live_ = 0;
+    size_t goal_ = 0;
+    size_t trigger_ = 0;
+
+    size_t steps_ = 0;
+    size_t last_steps_ = 0;
+    size_t total_steps_ = 0;
+    size_t cycles_ = 0;
+    double assist_ratio_ = 0;
+    double credit_ = 0;
+    bool busy_ = false;
+};
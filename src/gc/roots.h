@@ -0,0 +1,196 @@
+#pragma once
+
+#include "size.h"
+
+#include <algorithm>
+#include <cassert>
+#include <csetjmp>
+#include <cstdint>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+#include <pthread.h>
+
+/*
+Root set of the gc.
+
+Roots come from three sources:
+1. objects registered explicitly (RegisterRootObject), O(1) to add and remove;
+2. shadow stacks - every thread has a stack of slots holding object pointers,
+   slots are pushed by HandleScope::Root and popped all at once when the scope ends;
+3. optional conservative scan of registered thread stacks, every word on the stack
+   that looks like a pointer into the heap is a root.
+
+Enumeration of roots costs in proportion to the number of roots (plus the size
+of the scanned stacks), not to the size of the heap.
+*/
+class ShadowStack {
+public:
+    ShadowStack(const ShadowStack&) = delete;
+    ShadowStack& operator=(const ShadowStack&) = delete;
+
+    // shadow stack of the calling thread
+    static ShadowStack& Current() {
+        thread_local ShadowStack stack;
+        return stack;
+    }
+
+    size_t Depth() const { return slots_.size(); }
+
+    void Push(void** slot) { slots_.push_back(slot); }
+
+    void PopTo(size_t depth) {
+        assert(depth <= slots_.size());
+        slots_.resize(depth);
+    }
+
+    template <typename F>
+    void ForAllRoots(F&& f) const {
+        for (void** slot : slots_) {
+            if (*slot != nullptr) {
+                f(*slot);
+            }
+        }
+    }
+
+    // makes the stack of the calling thread visible to the conservative scan
+    void RegisterThreadStack() {
+        pthread_attr_t attr;
+        void* addr = nullptr;
+        size_t size = 0;
+        pthread_getattr_np(pthread_self(), &attr);
+        pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+        stack_base_ = reinterpret_cast<const char*>(addr) + size;
+    }
+
+    void UnregisterThreadStack() {
+        stack_base_ = nullptr;
+        stack_top_ = nullptr;
+    }
+
+    // lowest used address of the stack of a stopped thread, set while the thread is parked
+    void PublishStackTop(const void* top) { stack_top_ = top; }
+
+    template <typename F>
+    static void ForAllThreads(F&& f) {
+        std::lock_guard<std::mutex> lock{RegistryMutex()};
+        for (ShadowStack* stack : Registry()) {
+            f(*stack);
+        }
+    }
+
+    /*
+    Calls f for every word of registered thread stacks.
+    Stack of the calling thread is scanned up to the current frame (registers are spilled
+    to the stack before), stacks of other threads - up to their published tops.
+    */
+    template <typename F>
+    static void ForAllStackWords(F&& f) {
+        jmp_buf regs;
+        setjmp(regs);
+        ShadowStack& self = Current();
+        ForAllThreads([&](const ShadowStack& stack){
+            if (stack.stack_base_ == nullptr) {
+                return;
+            }
+            const void* top = &stack == &self ? static_cast<const void*>(&regs) : stack.stack_top_;
+            if (top == nullptr) {
+                return;
+            }
+            const uintptr_t lo = align(reinterpret_cast<uintptr_t>(top), sizeof(void*));
+            for (uintptr_t addr = lo; addr + sizeof(void*) <= reinterpret_cast<uintptr_t>(stack.stack_base_); addr += sizeof(void*)) {
+                f(*reinterpret_cast<void* const*>(addr));
+            }
+        });
+    }
+
+private:
+    ShadowStack() {
+        std::lock_guard<std::mutex> lock{RegistryMutex()};
+        Registry().push_back(this);
+    }
+
+    ~ShadowStack() {
+        std::lock_guard<std::mutex> lock{RegistryMutex()};
+        auto& registry = Registry();
+        registry.erase(std::find(registry.begin(), registry.end(), this));
+    }
+
+    static std::vector<ShadowStack*>& Registry() {
+        static std::vector<ShadowStack*> registry;
+        return registry;
+    }
+
+    static std::mutex& RegistryMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    std::vector<void**> slots_;
+    const void* stack_base_ = nullptr;
+    const void* stack_top_ = nullptr;
+};
+
+/*
+Roots pushed in the scope are popped when the scope ends:
+
+    HandleScope scope;
+    Something* obj = scope.Root(obj_ptr);
+*/
+class HandleScope {
+public:
+    HandleScope()
+        : stack_{ShadowStack::Current()}
+        , depth_{stack_.Depth()}
+    {}
+
+    HandleScope(const HandleScope&) = delete;
+    HandleScope& operator=(const HandleScope&) = delete;
+
+    ~HandleScope() { stack_.PopTo(depth_); }
+
+    // slot must outlive the scope, object in it is a root till the end of the scope
+    template <typename T>
+    T*& Root(T*& slot) {
+        stack_.Push(reinterpret_cast<void**>(&slot));
+        return slot;
+    }
+
+private:
+    ShadowStack& stack_;
+    const size_t depth_;
+};
+
+class RootSet {
+public:
+    void Add(void* obj) { explicit_roots_.insert(obj); }
+    void Remove(void* obj) { explicit_roots_.erase(obj); }
+
+    void EnableStackScanning(bool enable) { scan_stacks_ = enable; }
+    bool StackScanningEnabled() const { return scan_stacks_; }
+
+    // exact roots: registered objects and shadow stack slots of all threads
+    template <typename F>
+    void ForAllRoots(F&& f) const {
+        for (void* obj : explicit_roots_) {
+            f(obj);
+        }
+        ShadowStack::ForAllThreads([&](const ShadowStack& stack){
+            stack.ForAllRoots(f);
+        });
+    }
+
+    // ambiguous roots: words of thread stacks, only when stack scanning is enabled
+    template <typename F>
+    void ForAllAmbiguousRoots(F&& f) const {
+        if (scan_stacks_) {
+            ShadowStack::ForAllStackWords(f);
+        }
+    }
+
+private:
+    std::unordered_set<void*> explicit_roots_;
+    bool scan_stacks_ = false;
+};
@@ -0,0 +1,180 @@
+#pragma once
+
+#include "roots.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <csetjmp>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+/*
+Stop-the-world protocol for several mutator threads sharing one gc heap.
+
+Mutators register themselves and call Poll() at allocation and barrier sites,
+Poll is one relaxed load while no collection is requested.
+Collector calls StopTheWorld(), which returns when every other registered mutator
+is either parked in Poll or is in a safe region (e.g. waits for the heap lock),
+and ResumeTheWorld() to let them go.
+Parked threads publish their stack tops, so their stacks can be scanned conservatively.
+*/
+class Safepoint {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Stats {
+        size_t pauses = 0;
+        Clock::duration total_pause{0};
+        Clock::duration max_pause{0};
+        Clock::duration total_time_to_safepoint{0};
+        Clock::duration max_time_to_safepoint{0};
+    };
+
+    Safepoint() = default;
+    Safepoint(const Safepoint&) = delete;
+    Safepoint& operator=(const Safepoint&) = delete;
+
+    void RegisterMutator() {
+        std::unique_lock<std::mutex> lock{mutex_};
+        assert(!IsMutator());
+        // can not join while the world is stopped
+        cv_.wait(lock, [this]{ return !requested_.load(std::memory_order_relaxed); });
+        ++mutators_;
+        MutatorState() = this;
+    }
+
+    void UnregisterMutator() {
+        std::unique_lock<std::mutex> lock{mutex_};
+        assert(IsMutator());
+        --mutators_;
+        MutatorState() = nullptr;
+        cv_.notify_all();
+    }
+
+    bool IsMutator() const { return MutatorState() == this; }
+
+    void Poll() {
+        if (requested_.load(std::memory_order_relaxed)) {
+            Park();
+        }
+    }
+
+    // calling thread does not touch the heap till ExitSafeRegion, collection may proceed
+    void EnterSafeRegion() {
+        if (!IsMutator()) {
+            return;
+        }
+        jmp_buf regs;
+        setjmp(regs); // spill registers, they may hold pointers
+        std::unique_lock<std::mutex> lock{mutex_};
+        ShadowStack::Current().PublishStackTop(&regs);
+        ++parked_;
+        cv_.notify_all();
+    }
+
+    void ExitSafeRegion() {
+        if (!IsMutator()) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock{mutex_};
+        cv_.wait(lock, [this]{ return !requested_.load(std::memory_order_relaxed) || collector_ == std::this_thread::get_id(); });
+        --parked_;
+    }
+
+    void StopTheWorld() {
+        const auto start = Clock::now();
+        std::unique_lock<std::mutex> lock{mutex_};
+        // only one collector at a time, the others wait parked
+        while (requested_.load(std::memory_order_relaxed)) {
+            ParkLocked(lock);
+        }
+        requested_.store(true, std::memory_order_relaxed);
+        collector_ = std::this_thread::get_id();
+        // mutators may unregister while we wait
+        const size_t self = IsMutator() ? 1 : 0;
+        cv_.wait(lock, [&]{ return parked_ + self >= mutators_; });
+        stopped_at_ = Clock::now();
+        const auto ttsp = stopped_at_ - start;
+        stats_.total_time_to_safepoint += ttsp;
+        stats_.max_time_to_safepoint = std::max(stats_.max_time_to_safepoint, ttsp);
+    }
+
+    void ResumeTheWorld() {
+        std::unique_lock<std::mutex> lock{mutex_};
+        assert(collector_ == std::this_thread::get_id());
+        const auto pause = Clock::now() - stopped_at_;
+        ++stats_.pauses;
+        stats_.total_pause += pause;
+        stats_.max_pause = std::max(stats_.max_pause, pause);
+        collector_ = std::thread::id{};
+        requested_.store(false, std::memory_order_relaxed);
+        cv_.notify_all();
+    }
+
+    Stats GetStats() const {
+        std::unique_lock<std::mutex> lock{mutex_};
+        return stats_;
+    }
+
+private:
+    static Safepoint*& MutatorState() {
+        thread_local Safepoint* safepoint = nullptr;
+        return safepoint;
+    }
+
+    void Park() {
+        std::unique_lock<std::mutex> lock{mutex_};
+        ParkLocked(lock);
+    }
+
+    void ParkLocked(std::unique_lock<std::mutex>& lock) {
+        if (!IsMutator()) {
+            cv_.wait(lock, [this]{ return !requested_.load(std::memory_order_relaxed); });
+            return;
+        }
+        jmp_buf regs;
+        setjmp(regs); // spill registers, they may hold pointers
+        ShadowStack::Current().PublishStackTop(&regs);
+        ++parked_;
+        cv_.notify_all();
+        cv_.wait(lock, [this]{ return !requested_.load(std::memory_order_relaxed); });
+        --parked_;
+    }
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::atomic<bool> requested_{false};
+    std::thread::id collector_;
+    size_t mutators_ = 0;
+    size_t parked_ = 0;
+    Clock::time_point stopped_at_;
+    Stats stats_;
+};
+
+// world is stopped while the scope exists
+class StopTheWorldScope {
+public:
+    StopTheWorldScope(Safepoint& safepoint) : safepoint_{safepoint} { safepoint_.StopTheWorld(); }
+    StopTheWorldScope(const StopTheWorldScope&) = delete;
+    StopTheWorldScope& operator=(const StopTheWorldScope&) = delete;
+    ~StopTheWorldScope() { safepoint_.ResumeTheWorld(); }
+
+private:
+    Safepoint& safepoint_;
+};
+
+// blocking operation of a mutator, collection may proceed while it waits
+class SafeRegion {
+public:
+    SafeRegion(Safepoint& safepoint) : safepoint_{safepoint} { safepoint_.EnterSafeRegion(); }
+    SafeRegion(const SafeRegion&) = delete;
+    SafeRegion& operator=(const SafeRegion&) = delete;
+    ~SafeRegion() { safepoint_.ExitSafeRegion(); }
+
+private:
+    Safepoint& safepoint_;
+};
@@ -0,0 +1,190 @@
+#pragma once
+
+#include "memory.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+Sweeps the heap after marking on a background thread, so the pause of a collection is only marking.
+
+Heap is cut into segments by address, a block belongs to the segment of its header.
+Segments are swept in address order, one segment per hold of the heap lock: unmarked
+blocks are freed with free_batch (which coalesces free neighbours), marks are cleared.
+Every segment is searched from the last live block of the previous one, not from the first block.
+Large objects are swept after the last segment. Mutators hold the same lock for alloc and
+free, so they never see a segment in the middle of sweeping; objects allocated in a segment
+that is not swept yet are allocated black (marked), so the sweeper keeps them.
+
+Finish sweeps the rest on the calling thread, it is used when marks are needed again
+(start of the next cycle) or memory is short.
+
+All heap access must go through the heap lock while the sweeper exists (Gc::Alloc, Gc::Free).
+*/
+class Sweeper : public MemoryObserver {
+public:
+    static const size_t DefaultSegments = 64;
+
+    Sweeper(Memory& mem, std::mutex& heap_mutex, size_t segments = DefaultSegments)
+        : memory_{mem}
+        , heap_mutex_{heap_mutex}
+        , segments_{segments}
+        , lowest_{reinterpret_cast<uintptr_t>(&mem.FirstBlock())}
+        , segment_size_{(mem.MemSize() + segments - 1) / segments}
+        , next_segment_{segments}
+    {
+        memory_.AddObserver(this);
+        thread_ = std::thread{[this](){ Run(); }};
+    }
+
+    Sweeper(const Sweeper&) = delete;
+    Sweeper& operator=(const Sweeper&) = delete;
+
+    ~Sweeper() {
+        {
+            std::unique_lock<std::mutex> lock{heap_mutex_};
+            stop_ = true;
+            Finish();
+        }
+        cv_.notify_all();
+        thread_.join();
+        memory_.RemoveObserver(this);
+    }
+
+    // heap lock held, marks of the cycle that just ended are swept in the background
+    void Start() {
+        Finish();
+        next_segment_ = 0;
+        cursor_ = nullptr;
+        sweeping_ = true;
+        cv_.notify_all();
+    }
+
+    // heap lock held, sweeps what is left on the calling thread
+    void Finish() {
+        while (sweeping_) {
+            SweepNext();
+            ++inline_segments_;
+        }
+    }
+
+    // heap lock not held, waits till the sweep in progress is done
+    void Wait() {
+        std::unique_lock<std::mutex> lock{heap_mutex_};
+        cv_.wait(lock, [this](){ return !sweeping_; });
+    }
+
+    bool Sweeping() const { return sweeping_; }
+
+    size_t BackgroundSegments() const { return background_segments_; }
+    size_t InlineSegments() const { return inline_segments_; }
+
+    void OnAlloc(void* ptr, size_t) override {
+        if (!sweeping_) {
+            return;
+        }
+        if (!memory_.IsInAddrSpace(ptr)) {
+            LargeObject::FromUserData(ptr).marked = true;
+            return;
+        }
+        Block& blk = Block::FromUserData(ptr);
+        if (SegmentOf(blk) >= next_segment_) {
+            blk.marked = true;
+        }
+    }
+
+    void OnFree(void* ptr, size_t) override {
+        if (cursor_ != nullptr && ptr == cursor_->ToUserData()) {
+            cursor_ = nullptr;
+        }
+    }
+
+private:
+    size_t SegmentOf(const Block& blk) const {
+        return (reinterpret_cast<uintptr_t>(&blk) - lowest_) / segment_size_;
+    }
+
+    void Run() {
+        std::unique_lock<std::mutex> lock{heap_mutex_};
+        while (true) {
+            cv_.wait(lock, [this](){ return stop_ || sweeping_; });
+            if (stop_) {
+                return;
+            }
+            while (sweeping_ && !stop_) {
+                SweepNext();
+                ++background_segments_;
+                // let mutators in between segments
+                lock.unlock();
+                std::this_thread::yield();
+                lock.lock();
+            }
+        }
+    }
+
+    // heap lock held
+    void SweepNext() {
+        const size_t segment = next_segment_++;
+        dead_.clear();
+        Block& from = cursor_ != nullptr ? *cursor_ : memory_.FirstBlock();
+        from.ForAllFrom([&](Block& blk){
+            const size_t blk_segment = SegmentOf(blk);
+            if (blk_segment > segment) {
+                return false;
+            }
+            if (!blk.IsFree() && (blk_segment < segment || blk.marked)) {
+                cursor_ = &blk;
+            }
+            if (blk_segment < segment) {
+                return true;
+            }
+            if (!blk.IsFree() && !blk.marked) {
+                dead_.push_back(blk.ToUserData());
+            }
+            blk.marked = false;
+            blk.to_be_checked = false;
+            return true;
+        });
+        memory_.free_batch(dead_.data(), dead_.size());
+
+        if (next_segment_ == segments_) {
+            dead_.clear();
+            memory_.los_.ForAllObjects([&](LargeObject& obj){
+                if (!obj.marked) {
+                    dead_.push_back(obj.ToUserData());
+                }
+                obj.marked = false;
+                obj.to_be_checked = false;
+                return true;
+            });
+            memory_.free_batch(dead_.data(), dead_.size());
+            sweeping_ = false;
+            cv_.notify_all();
+        }
+    }
+
+    Memory& memory_;
+    std::mutex& heap_mutex_;
+    std::condition_variable cv_;
+    const size_t segments_;
+    const uintptr_t lowest_;
+    const size_t segment_size_;
+
+    // segments below next_segment_ are swept
+    size_t next_segment_;
+    // live block at or below the first unswept segment, the next segment is searched from it;
+    // free coalesces only free blocks, so it stays a block header until it is freed itself
+    Block* cursor_ = nullptr;
+    bool sweeping_ = false;
+    bool stop_ = false;
+    std::vector<void*> dead_;
+
+    size_t background_segments_ = 0;
+    size_t inline_segments_ = 0;
+
+    std::thread thread_;
+};
@@ -0,0 +1,97 @@
+#include "gc_faster.h"
+
+#include <iostream>
+
+#include <cassert>
+#include <cstddef>
+
+static const size_t pool_size = 1 << 20;
+
+static char mempool[pool_size];
+
+static Memory mem{mempool, &mempool[pool_size]};
+
+struct Node {
+    Node* next;
+    size_t value;
+};
+
+void TestMarkStack() {
+    MarkStack<void*> stack{2};
+    size_t pushed = 0;
+    while (stack.Push(reinterpret_cast<void*>(pushed + 1))) {
+        ++pushed;
+    }
+    assert(stack.Overflowed());
+    assert(stack.Segments() == 2);
+    assert(stack.Size() == pushed);
+
+    // prefetch fifo delays items, but every pushed item comes out once
+    size_t sum = 0;
+    void* item = nullptr;
+    while (stack.Pop(item)) {
+        sum += reinterpret_cast<size_t>(item);
+    }
+    assert(sum == pushed * (pushed + 1) / 2);
+    assert(stack.Empty());
+    assert(stack.Segments() == 0);
+    assert(stack.PeakSegments() == 2);
+
+    // segments are reused
+    stack.ClearOverflow();
+    assert(stack.Push(nullptr));
+    assert(!stack.Overflowed());
+}
+
+// root with more pointers than the mark stack can hold
+void TestOverflow() {
+    const size_t count = 2000;
+    Gc gc{mem, 1};
+
+    auto** table = reinterpret_cast<Node**>(mem.alloc(count * sizeof(Node*)));
+    gc.RegisterRootObject(table);
+    for (size_t idx = 0; idx < count; ++idx) {
+        table[idx] = reinterpret_cast<Node*>(mem.alloc(sizeof(Node)));
+        table[idx]->next = idx > 0 ? table[idx - 1] : nullptr;
+        table[idx]->value = idx;
+    }
+    for (size_t idx = 0; idx < 100; ++idx) {
+        mem.alloc(sizeof(Node));
+    }
+    const size_t occupied = mem.OccupiedSize();
+
+    gc.FullGc();
+    std::cout << "mark stack overflowed with " << gc.MarkStackStats().MaxSegments()
+              << " segment, peak " << gc.MarkStackStats().PeakSegments() << std::endl;
+    assert(gc.MarkStackStats().PeakSegments() == 1);
+    assert(mem.OccupiedSize() < occupied);
+    for (size_t idx = 0; idx < count; ++idx) {
+        assert(!Block::FromUserData(table[idx]).IsFree());
+        assert(table[idx]->value == idx);
+    }
+
+    gc.UnregisterRootObject(table);
+    gc.FullGc();
+    assert(mem.OccupiedSize() == 0);
+}
+
+// handle slots are per thread, a collection of one heap must not touch objects of another
+void TestTwoHeaps() {
+    static char other_pool[pool_size];
+    Memory other{other_pool, &other_pool[pool_size]};
+    HandleScope scope;
+    void* foreign = other.alloc(64);
+    scope.Root(foreign);
+
+    Gc gc{mem};
+    gc.FullGc();
+    assert(other.MemStructureValid());
+    other.free(foreign);
+}
+
+int main(int argc, char** argv) {
+    TestMarkStack();
+    TestOverflow();
+    TestTwoHeaps();
+    return 0;
+}
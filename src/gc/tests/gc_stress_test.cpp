@@ -0,0 +1,105 @@
+#include "gc.h"
+#include "pacer.h"
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <cassert>
+#include <cstddef>
+
+/*
+Several mutator threads build and drop linked lists in the shared heap
+while the pacer runs collections, every list is checked after it is built.
+Runs with sweeping in the pause and with the background sweeper.
+*/
+
+static const size_t pool_size = 1 << 18;
+static const size_t threads = 4;
+static const size_t iterations = 200;
+static const size_t list_length = 40;
+static const size_t magic = 0x5AFE5AFE;
+
+static char mempool[pool_size];
+
+static Memory mem{mempool, &mempool[pool_size]};
+
+struct Node {
+    size_t magic;
+    size_t value;
+    Node* next;
+};
+
+void Mutator(Gc& gc, size_t id) {
+    gc.Safepoints().RegisterMutator();
+    for (size_t it = 0; it < iterations; ++it) {
+        HandleScope scope;
+        Node* head = nullptr;
+        Node* node = nullptr;
+        scope.Root(head);
+        scope.Root(node);
+
+        for (size_t idx = 0; idx < list_length; ++idx) {
+            node = reinterpret_cast<Node*>(gc.Alloc(sizeof(Node)));
+            assert(node != nullptr);
+            node->magic = magic;
+            node->value = id * list_length + idx;
+            node->next = head == nullptr ? nullptr : gc.LinkToObj(node, head);
+            head = node;
+        }
+
+        size_t expected = list_length;
+        for (Node* n = head; n != nullptr; n = n->next) {
+            assert(n->magic == magic);
+            assert(n->value == id * list_length + --expected);
+        }
+        assert(expected == 0);
+    }
+    gc.Safepoints().UnregisterMutator();
+}
+
+static double Ms(Safepoint::Clock::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+void Test(bool background_sweep) {
+    Gc gc{mem};
+    if (background_sweep) {
+        gc.EnableBackgroundSweep();
+    }
+    GcPacer pacer{mem, gc};
+
+    std::vector<std::thread> mutators;
+    for (size_t id = 0; id < threads; ++id) {
+        mutators.emplace_back(Mutator, std::ref(gc), id);
+    }
+    for (auto& t : mutators) {
+        t.join();
+    }
+
+    gc.Collect();
+    gc.WaitForSweep();
+    assert(mem.OccupiedSize() == 0);
+    assert(mem.MemStructureValid());
+
+    const auto stats = gc.Safepoints().GetStats();
+    std::cout << (background_sweep ? "background sweep" : "sweep in pause") << std::endl;
+    if (background_sweep) {
+        std::cout << "segments swept in background/inline: " << gc.BackgroundSweeper()->BackgroundSegments()
+                  << " / " << gc.BackgroundSweeper()->InlineSegments() << std::endl;
+    }
+    std::cout << "cycles: " << pacer.Cycles() << std::endl
+              << "pauses: " << stats.pauses << std::endl
+              << "pause avg/max: " << Ms(stats.total_pause) / stats.pauses
+              << " / " << Ms(stats.max_pause) << " ms" << std::endl
+              << "time to safepoint avg/max: " << Ms(stats.total_time_to_safepoint) / stats.pauses
+              << " / " << Ms(stats.max_time_to_safepoint) << " ms" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    Test(false);
+    Test(true);
+    return 0;
+}
@@ -1,8 +1,14 @@
 #include "gc.h"
+#include "pacer.h"
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <thread>
 
 #include <cstddef>
+#include <cassert>
+#include <cstring>
 
 #include <vector>
 
@@ -28,12 +34,21 @@ void Test() {
     auto* obj2 = alloc.allocate(1);
     auto* obj3 = alloc.allocate(1);
 
+    mem.SetLargeObjectThreshold(4096);
+    auto* big = reinterpret_cast<Something**>(mem.alloc(8192));
+    auto* big_data = mem.alloc_noscan(8192);
+
     std::cout << "Created 3 objects: " << std::endl << mem << std::endl;
 
     gc.RegisterRootObject(obj1);
     obj1->next = gc.LinkToObj(obj1, obj2);
     obj2->next = gc.LinkToObj(obj2, obj3);
     obj3->next = gc.LinkToObj(obj3, obj1);
+    obj2->a = 0;
+    big[0] = gc.LinkToObj(reinterpret_cast<void*>(big), obj2);
+    reinterpret_cast<Something**>(big_data)[0] = obj3;
+    gc.RegisterRootObject(big);
+    gc.RegisterRootObject(big_data);
 
     std::cout << "After objects linked: " << std::endl << mem << std::endl;
 
@@ -49,14 +64,494 @@ void Test() {
     std::cout << "After gc collect: " << std::endl << mem << std::endl;
 
     gc.UnregisterRootObject(obj1);
+    gc.UnregisterRootObject(big);
+    gc.UnregisterRootObject(big_data);
 
     std::cout << "After gc unregister root: " << std::endl << mem << std::endl;
 
     gc.FullGc();
     std::cout << "After full gc: " << std::endl << mem << std::endl;
+
+    {
+        HandleScope scope;
+        Something* head = nullptr;
+        scope.Root(head);
+
+        for (int idx = 0; idx < 3; ++idx) {
+            auto* obj = alloc.allocate(1);
+            obj->a = idx;
+            obj->next = head == nullptr ? nullptr : gc.LinkToObj(obj, head);
+            head = obj;
+        }
+
+        gc.FullGc();
+        std::cout << "After full gc with handle scope: " << std::endl << mem << std::endl;
+        assert(mem.OccupiedSize() != 0);
+        assert(head->next->next->a == 0);
+    }
+
+    gc.FullGc();
+    std::cout << "After handle scope ended: " << std::endl << mem << std::endl;
+    assert(mem.OccupiedSize() == 0);
+
+    {
+        ShadowStack::Current().RegisterThreadStack();
+        gc.Roots().EnableStackScanning(true);
+
+        Something* volatile obj = alloc.allocate(1);
+        obj->a = 42;
+        obj->next = nullptr;
+
+        gc.FullGc();
+        std::cout << "After full gc with stack scanning: " << std::endl << mem << std::endl;
+        assert(!Block::FromUserData(obj).IsFree());
+        assert(obj->a == 42);
+
+        gc.Roots().EnableStackScanning(false);
+        ShadowStack::Current().UnregisterThreadStack();
+    }
+
+    gc.FullGc();
+
+    {
+        // collection only when allocation fails
+        GcPacer pacer{mem, gc, -1};
+        for (int idx = 0; idx < 10000; ++idx) {
+            assert(alloc.allocate(8) != nullptr);
+        }
+        std::cout << "After 10000 allocations with collection on failure: " << pacer.Cycles() << " cycles" << std::endl;
+        assert(pacer.Cycles() > 0);
+
+        // incremental cycles keep the heap near the goal
+        pacer.SetGcPercent(100);
+        size_t peak = 0;
+        for (int idx = 0; idx < 10000; ++idx) {
+            alloc.allocate(8);
+            peak = std::max(peak, mem.OccupiedSize());
+        }
+        std::cout << "After 10000 paced allocations: " << pacer.Cycles() << " cycles, peak "
+                  << peak << " bytes, goal " << pacer.HeapGoal() << " bytes" << std::endl;
+        assert(peak <= 2 * pacer.HeapGoal());
+    }
+}
+
+void TestBackgroundSweep() {
+    {
+        Gc gc{mem};
+        gc.FullGc();
+    }
+    assert(mem.OccupiedSize() == 0);
+
+    Gc gc{mem};
+    gc.EnableBackgroundSweep(8);
+
+    auto** root = reinterpret_cast<void**>(gc.Alloc(sizeof(void*)));
+    gc.RegisterRootObject(root);
+    *root = gc.Alloc(16);
+    for (int idx = 0; idx < 100; ++idx) {
+        gc.Alloc(16);
+    }
+
+    gc.Collect();
+    // objects allocated before the sweeper reaches their segment are kept
+    void* fresh = gc.Alloc(16);
+    *root = gc.LinkToPtr(root, fresh);
+    gc.WaitForSweep();
+    std::cout << "After background sweep: " << std::endl << mem << std::endl;
+    assert(!gc.Sweeping());
+    assert(!Block::FromUserData(fresh).IsFree());
+    assert(!Block::FromUserData(fresh).marked);
+    assert(mem.MemStructureValid());
+
+    gc.UnregisterRootObject(root);
+    gc.Collect();
+    gc.WaitForSweep();
+    assert(mem.OccupiedSize() == 0);
+    std::cout << "Segments swept in background: " << gc.BackgroundSweeper()->BackgroundSegments()
+              << ", inline: " << gc.BackgroundSweeper()->InlineSegments() << std::endl;
+}
+
+void TestRefCounting() {
+    struct Something {
+        int a;
+        struct Something* next;
+    };
+
+    {
+        Gc gc{mem};
+        gc.EnableRefCounting();
+
+        auto* holder = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+        holder->a = 0;
+        holder->next = nullptr;
+        gc.RegisterRootObject(holder);
+
+        // list of three objects hangs from the root
+        Something* list = nullptr;
+        for (int idx = 0; idx < 3; ++idx) {
+            auto* obj = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+            obj->a = idx;
+            obj->next = list == nullptr ? nullptr : gc.LinkToObj(obj, list);
+            list = obj;
+        }
+        holder->next = gc.LinkToObj(holder, list);
+        gc.ProcessRefCounts();
+        assert(!Block::FromUserData(list->next->next).IsFree());
+        assert(Block::FromUserData(list->next).ref_count == 1);
+
+        // replaced list dies at once, without tracing
+        Something* old = holder->next;
+        auto* single = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+        single->a = 0;
+        single->next = nullptr;
+        holder->next = gc.LinkToObj(holder, single, old);
+        const size_t freed = gc.ProcessRefCounts();
+        std::cout << "After list replaced: " << std::endl << mem << std::endl;
+        assert(freed == 3 * (align(sizeof(Something)) + align(sizeof(Block))));
+        assert(!Block::FromUserData(single).IsFree());
+
+        // cycle like obj3->next = obj1 keeps its counts, tracing frees it
+        auto* obj1 = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+        auto* obj2 = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+        auto* obj3 = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+        obj1->next = gc.LinkToObj(obj1, obj2);
+        obj2->next = gc.LinkToObj(obj2, obj3);
+        obj3->next = gc.LinkToObj(obj3, obj1);
+        single->next = gc.LinkToObj(single, obj1);
+        single->next = gc.LinkToObj(single, static_cast<Something*>(nullptr), obj1);
+        assert(gc.ProcessRefCounts() == 0);
+        const size_t occupied = mem.OccupiedSize();
+        gc.FullGc();
+        assert(mem.OccupiedSize() == occupied - 3 * (align(sizeof(Something)) + align(sizeof(Block))));
+        assert(Block::FromUserData(single).ref_count == 1);
+
+        gc.UnregisterRootObject(holder);
+        gc.FullGc();
+        assert(mem.OccupiedSize() == 0);
+        std::cout << "Freed by reference counting: " << gc.RefCounts().freed_objects << " objects in "
+                  << gc.RefCounts().batches << " batches" << std::endl;
+    }
+
+    // root object drops one node per iteration, counting keeps the pacer from tracing
+    for (bool ref_counting : {false, true}) {
+        Gc gc{mem};
+        if (ref_counting) {
+            gc.EnableRefCounting(64);
+        }
+        GcPacer pacer{mem, gc};
+        auto* holder = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+        holder->a = 0;
+        holder->next = nullptr;
+        gc.RegisterRootObject(holder);
+        size_t peak = 0;
+        for (int idx = 0; idx < 5000; ++idx) {
+            auto* obj = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+            obj->a = idx;
+            obj->next = nullptr;
+            holder->next = gc.LinkToObj(holder, obj, holder->next);
+            peak = std::max(peak, mem.OccupiedSize());
+        }
+        std::cout << (ref_counting ? "Reference counting: " : "Tracing only: ") << pacer.Cycles()
+                  << " cycles, peak " << peak << " bytes" << std::endl;
+        if (ref_counting) {
+            assert(pacer.Cycles() == 0);
+            assert(peak < 64 * 2 * (align(sizeof(Something)) + align(sizeof(Block))));
+        } else {
+            assert(pacer.Cycles() > 0);
+        }
+        gc.UnregisterRootObject(holder);
+        gc.FullGc();
+        assert(mem.OccupiedSize() == 0);
+    }
+}
+
+// counts are taken back only for references that were counted
+void TestRefCountedLinks() {
+    struct Something {
+        int a;
+        struct Something* next;
+    };
+
+    // remembers the newest allocation, links it with the heap lock held
+    class Newest : public MemoryObserver {
+    public:
+        Newest(Gc& gc, Something* holder) : gc_{gc}, holder_{holder} { }
+        void OnAlloc(void* ptr, size_t) override {
+            auto* obj = static_cast<Something*>(ptr);
+            obj->a = 0;
+            obj->next = nullptr;
+            holder_->next = gc_.LinkToObj(holder_, obj, holder_->next);
+        }
+    private:
+        Gc& gc_;
+        Something* holder_;
+    };
+
+    Gc gc{mem};
+    gc.EnableRefCounting();
+    auto* holder = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+    holder->a = 0;
+    holder->next = nullptr;
+    gc.RegisterRootObject(holder);
+    auto* live = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+    live->a = 0;
+    live->next = nullptr;
+    holder->next = gc.LinkToObj(holder, live);
+
+    // word that equals the address of live was stored without LinkToObj, it was never counted
+    auto* lookalike = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+    lookalike->a = 0;
+    lookalike->next = live;
+    gc.ProcessRefCounts();
+    assert(Block::FromUserData(lookalike).IsFree());
+    assert(!Block::FromUserData(live).IsFree());
+    assert(Block::FromUserData(live).ref_count == 1);
+
+    {
+        Newest newest{gc, holder};
+        mem.AddObserver(&newest);
+        auto* first = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+        auto* second = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+        mem.RemoveObserver(&newest);
+        assert(holder->next == second);
+        gc.ProcessRefCounts();
+        assert(Block::FromUserData(live).IsFree() && Block::FromUserData(first).IsFree());
+        assert(Block::FromUserData(second).ref_count == 1);
+    }
+
+    gc.UnregisterRootObject(holder);
+    gc.FullGc();
+    assert(mem.OccupiedSize() == 0);
+}
+
+void TestScavenger() {
+    Gc gc{mem};
+    gc.EnableScavenger(std::chrono::milliseconds{1}, 8192);
+    {
+        HandleScope scope;
+        std::vector<void*> objs(32);
+        for (void*& obj : objs) {
+            scope.Root(obj);
+            obj = gc.Alloc(1024);
+            std::memset(obj, 1, 1024);
+        }
+    }
+    gc.Collect();
+
+    // collection steps called directly take the heap lock, the scavenger pass waits for them
+    for (size_t round = 0; round < 2000; ++round) {
+        {
+            HandleScope scope;
+            void* obj = gc.Alloc(16 * 1024);
+            scope.Root(obj);
+            std::memset(obj, 1, 16 * 1024);
+            gc.GcInit();
+            while (gc.GcMarkStep()) { }
+            gc.GcCollect();
+        }
+        gc.FullGc();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds{20});
+    std::cout << "Scavenger released " << gc.PageScavenger()->ReleasedBytes() << " bytes" << std::endl;
+    assert(gc.PageScavenger()->ReleasedBytes() >= 32 * 1024 - 8192);
+    assert(mem.MemStructureValid());
+}
+
+void TestWeakRefs() {
+    struct Something {
+        int a;
+        struct Something* next;
+    };
+
+    {
+        Gc gc{mem};
+        size_t evicted = 0;
+        gc.SetWeakRefCallback([&](Gc::WeakRef, void* data){
+            evicted += reinterpret_cast<uintptr_t>(data);
+        });
+        std::vector<Gc::WeakRef> refs;
+        void* kept = nullptr;
+        HandleScope scope;
+        scope.Root(kept);
+        for (uintptr_t idx = 1; idx <= 20; ++idx) {
+            void* obj = gc.Alloc(sizeof(Something));
+            if (idx == 1) {
+                kept = obj;
+            }
+            refs.push_back(gc.MakeWeakRef(obj, reinterpret_cast<void*>(idx)));
+        }
+        gc.FullGc();
+        // with a callback nothing is queued
+        assert(gc.TakeClearedWeakRefs().empty());
+        assert(evicted == 20 * 21 / 2 - 1);
+        assert(gc.GetWeak(refs[0]) == kept);
+        assert(gc.GetWeak(refs[1]) == nullptr);
+        assert(mem.OccupiedSize() == align(sizeof(Something)) + align(sizeof(Block)));
+        for (Gc::WeakRef ref : refs) {
+            gc.DropWeakRef(ref);
+        }
+        assert(gc.WeakRefCount() == 0);
+        kept = nullptr;
+        gc.FullGc();
+    }
+
+    // handle dropped before the queue is taken is reused, the new reference is not reported
+    {
+        Gc gc{mem};
+        Gc::WeakRef dead_ref = gc.MakeWeakRef(gc.Alloc(sizeof(Something)));
+        gc.FullGc();
+        assert(gc.GetWeak(dead_ref) == nullptr);
+        gc.DropWeakRef(dead_ref);
+        void* obj = gc.Alloc(sizeof(Something));
+        gc.RegisterRootObject(obj);
+        Gc::WeakRef live_ref = gc.MakeWeakRef(obj);
+        assert(live_ref == dead_ref);
+        assert(gc.TakeClearedWeakRefs().empty());
+        assert(gc.GetWeak(live_ref) == obj);
+        gc.DropWeakRef(live_ref);
+        gc.UnregisterRootObject(obj);
+        gc.FullGc();
+        assert(mem.OccupiedSize() == 0);
+    }
+
+    // reference counting clears the reference as soon as the object dies
+    {
+        Gc gc{mem};
+        gc.EnableRefCounting();
+        auto* holder = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+        holder->a = 0;
+        holder->next = nullptr;
+        gc.RegisterRootObject(holder);
+        auto* obj = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+        obj->next = nullptr;
+        holder->next = gc.LinkToObj(holder, obj);
+        Gc::WeakRef ref = gc.MakeWeakRef(obj);
+        gc.ProcessRefCounts();
+        assert(gc.GetWeak(ref) == obj);
+        holder->next = gc.LinkToObj(holder, static_cast<Something*>(nullptr), obj);
+        gc.ProcessRefCounts();
+        assert(gc.GetWeak(ref) == nullptr);
+        assert(gc.TakeClearedWeakRefs().size() == 1);
+        gc.DropWeakRef(ref);
+        gc.UnregisterRootObject(holder);
+        gc.FullGc();
+        assert(mem.OccupiedSize() == 0);
+    }
+
+    // cache holds only weak references, it grows till the heap is full and shrinks at collections
+    {
+        Gc gc{mem};
+        GcPacer pacer{mem, gc, -1};
+        std::vector<Gc::WeakRef> cache;
+        size_t max_cache = 0;
+        for (int idx = 0; idx < 2000; ++idx) {
+            void* obj = gc.Alloc(200);
+            assert(obj != nullptr);
+            for (Gc::WeakRef ref : gc.TakeClearedWeakRefs()) {
+                cache.erase(std::find(cache.begin(), cache.end(), ref));
+                gc.DropWeakRef(ref);
+            }
+            cache.push_back(gc.MakeWeakRef(obj));
+            max_cache = std::max(max_cache, cache.size());
+        }
+        std::cout << "Weak cache: " << pacer.Cycles() << " cycles, at most " << max_cache
+                  << " entries, " << cache.size() << " at the end" << std::endl;
+        assert(pacer.Cycles() > 0);
+        assert(max_cache * 200 > pool_size / 2);
+        assert(gc.WeakRefCount() == cache.size());
+        gc.FullGc();
+        assert(gc.TakeClearedWeakRefs().size() == cache.size());
+        assert(mem.OccupiedSize() == 0);
+    }
+
+    // callback runs after the heap is unlocked, it drops the cleared references itself
+    {
+        Gc gc{mem};
+        GcPacer pacer{mem, gc, -1};
+        std::vector<Gc::WeakRef> cache;
+        size_t evicted = 0;
+        gc.SetWeakRefCallback([&](Gc::WeakRef ref, void*){
+            cache.erase(std::find(cache.begin(), cache.end(), ref));
+            gc.DropWeakRef(ref);
+            ++evicted;
+        });
+        for (int idx = 0; idx < 2000; ++idx) {
+            void* obj = gc.Alloc(200);
+            assert(obj != nullptr);
+            cache.push_back(gc.MakeWeakRef(obj));
+        }
+        assert(pacer.Cycles() > 0 && evicted > 0);
+        assert(gc.WeakRefCount() == cache.size());
+
+        const size_t before = evicted;
+        gc.Free(gc.GetWeak(cache.back()));
+        assert(evicted == before + 1);
+        gc.FullGc();
+        assert(cache.empty() && gc.WeakRefCount() == 0);
+        assert(mem.OccupiedSize() == 0);
+    }
+}
+
+// reference moved from the heap into a handle during marking survives the cycle
+void TestRootChangedWhileMarking() {
+    struct Something {
+        int a;
+        struct Something* next;
+    };
+
+    Gc gc{mem};
+    auto* holder = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+    auto* obj = reinterpret_cast<Something*>(gc.Alloc(sizeof(Something)));
+    holder->a = 0;
+    obj->a = 42;
+    obj->next = nullptr;
+    holder->next = gc.LinkToObj(holder, obj);
+    gc.RegisterRootObject(holder);
+    {
+        HandleScope scope;
+        Something* handle = nullptr;
+        scope.Root(handle);
+
+        gc.GcInit();
+        handle = holder->next;
+        holder->next = nullptr;
+        while (gc.GcMarkStep()) { }
+        gc.GcCollect();
+
+        assert(!Block::FromUserData(handle).IsFree());
+        assert(handle->a == 42);
+    }
+    gc.UnregisterRootObject(holder);
+    gc.FullGc();
+    assert(mem.OccupiedSize() == 0);
+}
+
+// handle slots are per thread, a collection of one heap must not touch objects of another
+void TestTwoHeaps() {
+    static char other_pool[pool_size];
+    Memory other{other_pool, &other_pool[pool_size]};
+    HandleScope scope;
+    void* foreign = other.alloc(64);
+    void* large = other.alloc(Memory::DefaultLargeObjectThreshold);
+    scope.Root(foreign);
+    scope.Root(large);
+
+    Gc gc{mem};
+    gc.FullGc();
+    assert(other.MemStructureValid());
+    assert(!LargeObject::FromUserData(large).marked);
+    other.free(large);
+    other.free(foreign);
 }
 
 int main(int argc, char** argv) {
     Test();
+    TestBackgroundSweep();
+    TestRefCounting();
+    TestRefCountedLinks();
+    TestScavenger();
+    TestWeakRefs();
+    TestRootChangedWhileMarking();
+    TestTwoHeaps();
     return 0;
 }
@@ -0,0 +1,115 @@
+#include "gc.h"
+#include "heap_region.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+
+/*
+Heap walks and gc marking over a heap of page sized objects, so every block header
+is on its own page and both are bound by TLB misses.
+Pool from operator new[] is compared with HeapRegion with and without huge pages and prefaulting.
+*/
+
+static const size_t pool_size = 64 << 20;
+static const size_t object_size = 4096;
+static const size_t objects = 4096;
+static const size_t walks = 100;
+
+// keeps the walks from being optimized away without asserts
+static volatile size_t sink;
+
+struct Node {
+    Node* next;
+    char payload[object_size - sizeof(Node*)];
+};
+
+template <class F>
+double Measure(F&& f) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Run(const char* name, void* lowest, void* highest) {
+    Memory mem{lowest, highest};
+    Gc gc{mem};
+
+    std::vector<Node*> nodes(objects);
+    const double alloc_ms = Measure([&](){
+        for (auto& node : nodes) {
+            node = reinterpret_cast<Node*>(mem.alloc(sizeof(Node)));
+            assert(node != nullptr);
+            std::memset(node->payload, 0, sizeof(node->payload));
+        }
+    });
+
+    // list in random order, marking jumps all over the heap
+    std::shuffle(nodes.begin(), nodes.end(), std::mt19937{42});
+    for (size_t idx = 0; idx < objects; ++idx) {
+        nodes[idx]->next = idx + 1 < objects ? nodes[idx + 1] : nullptr;
+    }
+    gc.RegisterRootObject(nodes.front());
+
+    size_t blocks = 0;
+    size_t bytes = 0;
+    const double walk_ms = Measure([&](){
+        for (size_t idx = 0; idx < walks; ++idx) {
+            mem.ForAllBlocks([&](const Block& blk){
+                ++blocks;
+                bytes += blk.GetUserDataSize();
+                return true;
+            });
+        }
+    });
+    assert(blocks == walks * (objects + 1));
+    sink = bytes;
+
+    const double mark_ms = Measure([&](){
+        gc.FullGc();
+    });
+    assert(mem.OccupiedSize() > objects * sizeof(Node));
+
+    std::cout << std::setw(24) << name
+              << std::setw(12) << std::fixed << std::setprecision(2) << alloc_ms
+              << std::setw(12) << walk_ms
+              << std::setw(12) << mark_ms
+              << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::cout << "                    pool    alloc ms     walk ms       gc ms" << std::endl;
+    {
+        std::unique_ptr<char[]> pool{new char[pool_size]};
+        Run("new[]", pool.get(), pool.get() + pool_size);
+    }
+    {
+        HeapRegion region{pool_size, false};
+        assert(region.Valid());
+        Run("region", region.lowest(), region.highest());
+    }
+    {
+        HeapRegion region{pool_size, true};
+        assert(region.Valid());
+        Run("region+thp", region.lowest(), region.highest());
+    }
+    {
+        HeapRegion region{pool_size, true, HeapRegion::Prefault::Sync};
+        assert(region.Valid() && region.Prefaulted());
+        Run("region+thp+prefault", region.lowest(), region.highest());
+    }
+    {
+        HeapRegion region{pool_size, true, HeapRegion::Prefault::Background};
+        assert(region.Valid());
+        Run("region+thp+background", region.lowest(), region.highest());
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include "immix.h"
+#include "memory.h"
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <cstddef>
+
+/*
+Allocation speed and locality of the live set over several gc cycles.
+A table holds live list nodes, every allocation replaces a random one of them
+(the replaced node is garbage). After every round the live list is walked.
+ImmixSpace collects by itself when its blocks run out; Memory gets explicit frees
+of the replaced nodes, it is the free list baseline.
+*/
+
+static const size_t pool_size = 4 << 20;
+static const size_t live_objects = 2048;
+static const size_t allocations = 20000;
+static const size_t rounds = 6;
+
+struct Node {
+    Node* next;
+    size_t payload[5];
+};
+
+static volatile size_t sink;
+
+template <class F>
+double Measure(F&& f) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+// links table entries in table order, walk visits them in allocation order of the slots
+double Walk(Node** table) {
+    for (size_t idx = 0; idx + 1 < live_objects; ++idx) {
+        table[idx]->next = table[idx + 1];
+    }
+    table[live_objects - 1]->next = nullptr;
+    size_t sum = 0;
+    const double ns = Measure([&](){
+        for (int repeat = 0; repeat < 100; ++repeat) {
+            for (const Node* node = table[0]; node != nullptr; node = node->next) {
+                sum += node->payload[0];
+            }
+        }
+    });
+    sink = sum;
+    return ns / (100 * live_objects);
+}
+
+template <typename AllocF, typename FreeF, typename CyclesF>
+void Run(const char* name, AllocF&& alloc, FreeF&& free, CyclesF&& cycles, Node** table) {
+    std::mt19937 random{42};
+    for (size_t idx = 0; idx < live_objects; ++idx) {
+        table[idx] = alloc();
+    }
+    for (size_t round = 0; round < rounds; ++round) {
+        const double alloc_ns = Measure([&](){
+            for (size_t idx = 0; idx < allocations; ++idx) {
+                Node* node = alloc();
+                node->payload[0] = idx;
+                Node*& slot = table[random() % live_objects];
+                free(slot);
+                slot = node;
+            }
+        }) / allocations;
+        const double walk_ns = Walk(table);
+        std::cout << std::setw(10) << name
+                  << std::setw(8) << round
+                  << std::setw(14) << std::fixed << std::setprecision(1) << alloc_ns
+                  << std::setw(14) << walk_ns
+                  << std::setw(8) << cycles()
+                  << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    std::cout << "     space   round  alloc ns/obj   walk ns/obj  cycles" << std::endl;
+    {
+        std::unique_ptr<char[]> pool{new char[pool_size]};
+        ImmixSpace space{pool.get(), pool.get() + pool_size};
+        auto** table = reinterpret_cast<Node**>(space.alloc(live_objects * sizeof(Node*), live_objects));
+        space.RegisterRootObject(table);
+        Run("immix",
+            [&](){ return reinterpret_cast<Node*>(space.alloc(sizeof(Node), 1)); },
+            [](Node*){},
+            [&](){ return space.Cycles(); },
+            table);
+    }
+    {
+        std::unique_ptr<char[]> pool{new char[pool_size]};
+        Memory mem{pool.get(), pool.get() + pool_size};
+        std::vector<Node*> table(live_objects);
+        Run("free list",
+            [&](){ return reinterpret_cast<Node*>(mem.alloc(sizeof(Node))); },
+            [&](Node* node){ mem.free(node); },
+            [](){ return size_t{0}; },
+            table.data());
+    }
+    return 0;
+}
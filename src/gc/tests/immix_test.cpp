@@ -0,0 +1,132 @@
+#include "immix.h"
+
+#include <iostream>
+#include <vector>
+
+#include <cassert>
+#include <cstddef>
+
+static const size_t pool_size = 1 << 20;
+
+alignas(ImmixSpace::BlockSize) static char mempool[pool_size];
+
+struct Node {
+    Node* next;
+    size_t value;
+};
+
+Node* NewNode(ImmixSpace& space, Node* next, size_t value) {
+    auto* node = reinterpret_cast<Node*>(space.alloc(sizeof(Node), 1));
+    assert(node != nullptr);
+    node->next = next;
+    node->value = value;
+    return node;
+}
+
+size_t CheckList(const Node* node, size_t count) {
+    size_t seen = 0;
+    for (; node != nullptr; node = node->next) {
+        assert(node->value == count - 1 - seen);
+        ++seen;
+    }
+    assert(seen == count);
+    return seen;
+}
+
+void Test() {
+    ImmixSpace space{mempool, &mempool[pool_size]};
+    std::cout << "blocks: " << space.Blocks() << std::endl;
+    assert(space.Blocks() == pool_size / ImmixSpace::BlockSize);
+
+    // list of live nodes scattered between garbage, every block is sparse
+    const size_t count = 200;
+    auto* head_holder = reinterpret_cast<Node*>(space.alloc(sizeof(Node), 1));
+    space.RegisterRootObject(head_holder);
+    for (size_t idx = 0; idx < count; ++idx) {
+        head_holder->next = NewNode(space, head_holder->next, idx);
+        space.alloc(1000);
+    }
+    std::vector<Node*> before;
+    for (Node* node = head_holder->next; node != nullptr; node = node->next) {
+        before.push_back(node);
+    }
+
+    space.Collect();
+    std::cout << "after first collection: free " << space.FreeBlocks()
+              << ", recyclable " << space.RecyclableBlocks()
+              << ", live lines " << space.LiveLines() << std::endl;
+    assert(space.RecyclableBlocks() > 0);
+    assert(space.EvacuatedObjects() == 0);
+    CheckList(head_holder->next, count);
+
+    // object in a handle scope is pinned, the rest of the sparse blocks is evacuated
+    Node* pinned = before[count / 2];
+    {
+        HandleScope scope;
+        scope.Root(pinned);
+        space.Collect();
+    }
+    std::cout << "after second collection: evacuated " << space.EvacuatedObjects()
+              << " objects, free " << space.FreeBlocks()
+              << ", recyclable " << space.RecyclableBlocks() << std::endl;
+    assert(space.EvacuatedObjects() > 0);
+    CheckList(head_holder->next, count);
+    size_t moved = 0;
+    size_t idx = 0;
+    for (Node* node = head_holder->next; node != nullptr; node = node->next, ++idx) {
+        moved += node != before[idx];
+        if (before[idx] == pinned) {
+            assert(node == pinned);
+        }
+    }
+    assert(moved > 0);
+    // live objects are compacted, there are fewer used blocks
+    assert(space.RecyclableBlocks() < 8);
+
+    // large objects are scanned precisely too
+    auto** big = reinterpret_cast<Node**>(space.alloc(ImmixSpace::BlockSize, 1));
+    assert(!space.Contains(big));
+    big[0] = NewNode(space, nullptr, 0);
+    space.RegisterRootObject(big);
+    space.Collect();
+    assert(space.LargeObjects().Count() == 1);
+    CheckList(big[0], 1);
+    space.UnregisterRootObject(big);
+    space.Collect();
+    assert(space.LargeObjects().Count() == 0);
+
+    // conservative stack roots pin objects as well
+    {
+        ShadowStack::Current().RegisterThreadStack();
+        space.Roots().EnableStackScanning(true);
+        Node* volatile node = NewNode(space, nullptr, 42);
+        space.Collect();
+        assert(node->value == 42);
+        space.Roots().EnableStackScanning(false);
+        ShadowStack::Current().UnregisterThreadStack();
+    }
+
+    // collections triggered by allocation, holes are reused
+    const size_t cycles = space.Cycles();
+    auto* table = reinterpret_cast<Node**>(space.alloc(256 * sizeof(Node*), 256));
+    space.RegisterRootObject(table);
+    for (size_t idx = 0; idx < 200000; ++idx) {
+        Node* node = NewNode(space, nullptr, idx);
+        Node*& slot = table[idx % 256];
+        assert(slot == nullptr || slot->value == idx - 256);
+        slot = node;
+    }
+    std::cout << "allocation triggered " << space.Cycles() - cycles << " collections" << std::endl;
+    assert(space.Cycles() > cycles);
+    CheckList(head_holder->next, count);
+
+    space.UnregisterRootObject(table);
+    space.UnregisterRootObject(head_holder);
+    space.Collect();
+    assert(space.FreeBlocks() == space.Blocks());
+}
+
+int main(int argc, char** argv) {
+    Test();
+    return 0;
+}
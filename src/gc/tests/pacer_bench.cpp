@@ -0,0 +1,66 @@
+#include "pacer.h"
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+
+#include <cassert>
+#include <cstddef>
+
+/*
+Throughput against peak heap size for several heap growth targets.
+Live set is a rooted table of nodes, every allocation replaces one of them.
+*/
+
+static const size_t pool_size = 1 << 20;
+static const size_t live_objects = 256;
+static const size_t allocations = 20000;
+
+struct Node {
+    size_t value;
+    Node* next;
+};
+
+void Run(int gc_percent, bool incremental) {
+    std::unique_ptr<char[]> pool{new char[pool_size]};
+    Memory mem{pool.get(), pool.get() + pool_size};
+    Gc gc{mem};
+    GcPacer pacer{mem, gc, gc_percent, incremental};
+
+    auto** table = reinterpret_cast<Node**>(mem.alloc(live_objects * sizeof(Node*)));
+    for (size_t idx = 0; idx < live_objects; ++idx) {
+        table[idx] = nullptr;
+    }
+    gc.RegisterRootObject(table);
+
+    size_t peak = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t idx = 0; idx < allocations; ++idx) {
+        auto* node = reinterpret_cast<Node*>(mem.alloc(sizeof(Node)));
+        assert(node != nullptr);
+        node->value = idx;
+        node->next = nullptr;
+        table[idx % live_objects] = gc.LinkToObj(table, node);
+        peak = std::max(peak, mem.OccupiedSize());
+    }
+    const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << std::setw(8) << gc_percent
+              << std::setw(13) << (incremental ? "incremental" : "full")
+              << std::setw(14) << std::fixed << std::setprecision(0) << allocations / elapsed
+              << std::setw(12) << peak
+              << std::setw(8) << pacer.Cycles()
+              << std::setw(12) << pacer.MarkSteps()
+              << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::cout << "  gc_pct         mode    allocs/sec  peak bytes  cycles  mark steps" << std::endl;
+    for (bool incremental : {false, true}) {
+        for (int gc_percent : {25, 50, 100, 200, 400}) {
+            Run(gc_percent, incremental);
+        }
+    }
+    return 0;
+}
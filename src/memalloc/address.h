@@ -45,6 +45,10 @@ public:
                 return a;
             }
         }
+        Size operator-(const Address& RHS) const {
+            assert(addr_ >= RHS.addr_);
+            return {static_cast<size_t>(reinterpret_cast<uintptr_t>(addr_) - reinterpret_cast<uintptr_t>(RHS.addr_))};
+        }
         bool operator==(const Address& RHS) const { return  addr_ == RHS.addr_; }
         bool operator!=(const Address& RHS) const { return  addr_ != RHS.addr_; }
         bool operator>=(const Address& RHS) const { return  addr_ >= RHS.addr_; }
@@ -71,6 +71,8 @@ std::ostream& operator<<(std::ostream& os, const Block& b) {
        << ", " << (b.IsFree() ? "Free" : "Occupied")
        << (b.root ? ", Root" : "")
        << (b.marked ? ", Marked" : "")
-       << (b.to_be_checked ? ", ToBeChecked" : "");
+       << (b.to_be_checked ? ", ToBeChecked" : "")
+       << (b.no_pointers ? ", NoPointers" : "")
+       << (b.sampled ? ", Sampled" : "");
     return os;
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 
 /*
 Этот класс для связывания каких-либо классов в дважды-связанный список.
@@ -13,6 +15,7 @@
 1. Не поддерживает копирование (не возможно создать два элемента с одинаковыми указателями prev/next)
 2. Не поддерживает перемещение
 3. При удалении отлинковывается из списка
+4. Ссылки prev/next - смещения относительно элемента, а не абсолютные указатели
 
 Это всё позволяет сделать работу со списками чуть более безошибочной.
 */
@@ -23,26 +26,26 @@ class DlElt {
 
     template <typename Chain>
     void replace_till(Chain chain, Self& to) {
-        Self* prev = prev_;
-        Self* next = to.next_;
+        Self* prev = prev_elt();
+        Self* next = to.next_elt();
         unlink_till(to);
         Self& c = chain();
         Self& start = c.start();
         Self& end = c.end();
         if (prev != nullptr) {
-            prev->next_ = &start;
-            start.prev_ = prev;
+            prev->set_next(&start);
+            start.set_prev(prev);
         }
         if (next != nullptr) {
-            next->prev_ = &end;
-            end.next_ = next;
+            next->set_prev(&end);
+            end.set_next(next);
         }
     }
 
     void unlink_till(Self& to) {
-        Self* elt = &to;
+        Self* elt = this;
         while (elt != nullptr && elt != &to) {
-            Self* next = elt->next_;
+            Self* next = elt->next_elt();
             elt->Unlink();
             elt = next;
         };
@@ -51,36 +54,58 @@ class DlElt {
         }
     }
 
+    // без рекурсии: список может быть длиной в сотни тысяч элементов
     Self& start() {
-        if (prev_ == nullptr) {
-            return *this;
-        } else {
-            return prev_->start();
+        Self* elt = this;
+        while (elt->prev_ != 0) {
+            elt = elt->prev_elt();
         }
+        return *elt;
     }
 
     Self& end() {
-        if (next_ == nullptr) {
-            return *this;
-        } else {
-            return next_->end();
+        Self* elt = this;
+        while (elt->next_ != 0) {
+            elt = elt->next_elt();
         }
+        return *elt;
     }
 
     void insert_above(Self& elt) {
-        next_ = elt.next_;
-        if (next_ != nullptr) { next_->prev_ = this; }
-        elt.next_ = this;
-        prev_ = &elt;
+        set_next(elt.next_elt());
+        if (next_ != 0) { next_elt()->set_prev(this); }
+        elt.set_next(this);
+        set_prev(&elt);
     }
 
     void insert_below(Self& elt) {
-        prev_ = elt.prev_;
-        if (prev_ != nullptr) { prev_->next_ = this; }
-        elt.prev_ = this;
-        next_ = elt;
+        set_prev(elt.prev_elt());
+        if (prev_ != 0) { prev_elt()->set_next(this); }
+        elt.set_prev(this);
+        set_next(&elt);
     }
 
+    /*
+    Ссылки хранятся как смещения относительно самого элемента (0 - нет ссылки),
+    поэтому список не зависит от адреса, по которому он лежит в памяти:
+    область памяти со списком можно сохранить в файл и отобразить обратно по другому адресу.
+    */
+    static std::ptrdiff_t offset(const Self* from, const Self* to) {
+        return to == nullptr
+            ? 0
+            : static_cast<std::ptrdiff_t>(reinterpret_cast<uintptr_t>(to) - reinterpret_cast<uintptr_t>(from));
+    }
+
+    Self* at_offset(std::ptrdiff_t off) const {
+        return off == 0
+            ? nullptr
+            : reinterpret_cast<Self*>(reinterpret_cast<uintptr_t>(this) + off);
+    }
+
+    Self* prev_elt() const { return at_offset(prev_); }
+    Self* next_elt() const { return at_offset(next_); }
+    void set_prev(const Self* elt) { prev_ = offset(this, elt); }
+    void set_next(const Self* elt) { next_ = offset(this, elt); }
 
 public:
     DlElt() = default;
@@ -88,7 +113,7 @@ public:
     DlElt(DlElt&& elt) = delete;
     DlElt& operator=(const DlElt&) = delete;
     DlElt& operator=(DlElt&& elt) = delete;
-    virtual ~DlElt() { Unlink(); }
+    ~DlElt() { Unlink(); }
 
     template <typename Chain>
     void Replace(Chain chain) { replace_till(chain, *this); }
@@ -99,27 +124,38 @@ public:
     void UnlinkTill(T& to) { unlink_till(to); }
 
     void Unlink() {
-        if (prev_ != nullptr) { prev_->next_ = next_; }
-        if (next_ != nullptr) { next_->prev_ = prev_; }
-        prev_ = next_ = nullptr;
+        Self* prev = prev_elt();
+        Self* next = next_elt();
+        if (prev != nullptr) { prev->set_next(next); }
+        if (next != nullptr) { next->set_prev(prev); }
+        prev_ = next_ = 0;
     }
 
     void InsertAbove(T& t) { insert_above(t); }
     void InsertBelow(T& t) { insert_below(t); }
 
-    bool HasNext() const { return next_ != nullptr; }
-    bool HasPrev() const { return prev_ != nullptr; }
+    bool HasNext() const { return next_ != 0; }
+    bool HasPrev() const { return prev_ != 0; }
 
-    T& Next() { return *dynamic_cast<T*>(next_); }
-    T& Prev() { return *dynamic_cast<T*>(prev_); }
-    T& Start() { return start(); }
-    T& End() { return end(); }
+    T& Next() { return *static_cast<T*>(next_elt()); }
+    T& Prev() { return *static_cast<T*>(prev_elt()); }
+    T& Start() { return static_cast<T&>(start()); }
+    T& End() { return static_cast<T&>(end()); }
 
     template<typename Handler>
     void ForAll(Handler handler) {
         Self* elt = &start();
-        while(handler(*dynamic_cast<T*>(elt)) && elt->HasNext()) {
-            elt = elt->next_;
+        while(handler(*static_cast<T*>(elt)) && elt->HasNext()) {
+            elt = elt->next_elt();
+        }
+    }
+
+    // this element and all elements after it
+    template<typename Handler>
+    void ForAllFrom(Handler handler) {
+        Self* elt = this;
+        while(handler(*static_cast<T*>(elt)) && elt->HasNext()) {
+            elt = elt->next_elt();
         }
     }
 
@@ -131,6 +167,6 @@ public:
     }
 
 private:
-    Self* prev_ = nullptr;
-    Self* next_ = nullptr;
+    std::ptrdiff_t prev_ = 0;
+    std::ptrdiff_t next_ = 0;
 };
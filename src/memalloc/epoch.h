@@ -0,0 +1,242 @@
+#pragma once
+
+#include "memory.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/*
+Epoch based reclamation for lock-free structures built on Memory.
+
+A lock-free structure can not free a node it has unlinked, other threads may still
+be reading it. Instead the node is retired: put on the limbo list of the thread.
+Every thread announces the global epoch while it is inside a critical section (EpochGuard).
+Global epoch advances only when all threads in critical sections have seen it, so a node
+retired in epoch e is unreachable for everybody once the global epoch is e + 2, and the
+whole limbo list of epoch e is freed with one free_batch.
+
+Memory is not thread safe, the manager serializes access to it: threads allocate with
+EpochManager::Alloc and never call Memory directly while the manager is in use.
+
+    EpochManager ebr{mem};
+    EpochManager::Participant& self = ebr.Register();   // once per thread
+    {
+        EpochGuard guard{self};
+        Node* top = head.load();
+        ...
+        self.Retire(top);
+    }
+    ebr.Unregister(self);
+*/
+class EpochManager {
+public:
+    // retired nodes per thread before it tries to advance the epoch
+    static const size_t DefaultBatch = 64;
+
+    class Participant {
+    public:
+        Participant(const Participant&) = delete;
+        Participant& operator=(const Participant&) = delete;
+
+        // critical sections may nest
+        void Enter() {
+            if (nesting_++ == 0) {
+                epoch_.store(manager_.global_epoch_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                // announcement must be visible before any shared pointer is read
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+        }
+
+        void Exit() {
+            if (--nesting_ == 0) {
+                epoch_.store(Quiescent, std::memory_order_release);
+            }
+        }
+
+        // ptr is unlinked from the shared structure and is freed when no thread can see it
+        void Retire(void* ptr) {
+            const uint64_t epoch = manager_.global_epoch_.load(std::memory_order_acquire);
+            Limbo& limbo = limbo_[epoch % Limbos];
+            if (limbo.epoch != epoch) {
+                // the list holds nodes of epoch - 3, they are safe already
+                manager_.Free(limbo.ptrs);
+                limbo.epoch = epoch;
+            }
+            limbo.ptrs.push_back(ptr);
+            if (++retired_ >= manager_.batch_) {
+                retired_ = 0;
+                manager_.TryAdvance();
+                Reclaim();
+            }
+        }
+
+        // frees limbo lists whose grace period is over
+        void Reclaim() {
+            const uint64_t epoch = manager_.global_epoch_.load(std::memory_order_acquire);
+            for (Limbo& limbo : limbo_) {
+                if (!limbo.ptrs.empty() && limbo.epoch + 2 <= epoch) {
+                    manager_.Free(limbo.ptrs);
+                }
+            }
+        }
+
+        size_t Pending() const {
+            return limbo_[0].ptrs.size() + limbo_[1].ptrs.size() + limbo_[2].ptrs.size();
+        }
+
+    private:
+        static const uint64_t Quiescent = std::numeric_limits<uint64_t>::max();
+        static const size_t Limbos = 3;
+
+        struct Limbo {
+            uint64_t epoch = 0;
+            std::vector<void*> ptrs;
+        };
+
+        explicit Participant(EpochManager& manager) : manager_{manager} {}
+
+        EpochManager& manager_;
+        std::atomic<uint64_t> epoch_{Quiescent};
+        std::atomic<bool> in_use_{true};
+        Participant* next_ = nullptr;
+        size_t nesting_ = 0;
+        size_t retired_ = 0;
+        Limbo limbo_[Limbos];
+
+        friend class EpochManager;
+    };
+
+    explicit EpochManager(Memory& mem, size_t batch = DefaultBatch)
+        : memory_{mem}
+        , batch_{batch}
+    { }
+
+    EpochManager(const EpochManager&) = delete;
+    EpochManager& operator=(const EpochManager&) = delete;
+
+    // no thread may be inside a critical section, everything retired is freed
+    ~EpochManager() {
+        Participant* p = participants_.load();
+        while (p != nullptr) {
+            for (auto& limbo : p->limbo_) {
+                Free(limbo.ptrs);
+            }
+            Participant* next = p->next_;
+            delete p;
+            p = next;
+        }
+        std::lock_guard<std::mutex> lock{memory_mutex_};
+        for (auto& [epoch, ptr] : orphans_) {
+            memory_.free(ptr);
+        }
+    }
+
+    // participant of the calling thread, records of unregistered threads are reused
+    Participant& Register() {
+        for (Participant* p = participants_.load(); p != nullptr; p = p->next_) {
+            bool expected = false;
+            if (p->in_use_.compare_exchange_strong(expected, true)) {
+                return *p;
+            }
+        }
+        Participant* p = new Participant{*this};
+        p->next_ = participants_.load();
+        while (!participants_.compare_exchange_weak(p->next_, p)) { }
+        return *p;
+    }
+
+    // nodes the thread did not free yet are left to other threads
+    void Unregister(Participant& p) {
+        assert(p.nesting_ == 0);
+        TryAdvance();
+        p.Reclaim();
+        {
+            std::lock_guard<std::mutex> lock{memory_mutex_};
+            for (auto& limbo : p.limbo_) {
+                for (void* ptr : limbo.ptrs) {
+                    orphans_.emplace_back(limbo.epoch, ptr);
+                }
+                limbo.ptrs.clear();
+            }
+        }
+        p.retired_ = 0;
+        p.in_use_.store(false, std::memory_order_release);
+    }
+
+    void* Alloc(size_t sz) {
+        std::lock_guard<std::mutex> lock{memory_mutex_};
+        return memory_.alloc(sz);
+    }
+
+    // advances the global epoch if every thread in a critical section has seen the current one
+    bool TryAdvance() {
+        uint64_t epoch = global_epoch_.load(std::memory_order_acquire);
+        for (Participant* p = participants_.load(std::memory_order_acquire); p != nullptr; p = p->next_) {
+            const uint64_t local = p->epoch_.load(std::memory_order_acquire);
+            if (local != Participant::Quiescent && local != epoch) {
+                return false;
+            }
+        }
+        const bool advanced = global_epoch_.compare_exchange_strong(epoch, epoch + 1, std::memory_order_acq_rel);
+        if (advanced) {
+            advances_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return advanced;
+    }
+
+    uint64_t Epoch() const { return global_epoch_.load(); }
+    size_t Advances() const { return advances_.load(); }
+    size_t Freed() const { return freed_.load(); }
+    size_t FreeBatches() const { return free_batches_.load(); }
+
+private:
+    void Free(std::vector<void*>& ptrs) {
+        if (ptrs.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock{memory_mutex_};
+        const uint64_t epoch = global_epoch_.load(std::memory_order_acquire);
+        // orphans of unregistered threads ride along with the batch
+        for (size_t idx = 0; idx < orphans_.size(); ) {
+            if (orphans_[idx].first + 2 <= epoch) {
+                ptrs.push_back(orphans_[idx].second);
+                orphans_[idx] = orphans_.back();
+                orphans_.pop_back();
+            } else {
+                ++idx;
+            }
+        }
+        memory_.free_batch(ptrs.data(), ptrs.size());
+        freed_.fetch_add(ptrs.size(), std::memory_order_relaxed);
+        free_batches_.fetch_add(1, std::memory_order_relaxed);
+        ptrs.clear();
+    }
+
+    Memory& memory_;
+    std::mutex memory_mutex_;
+    const size_t batch_;
+
+    std::atomic<uint64_t> global_epoch_{Participant::Limbos};
+    std::atomic<Participant*> participants_{nullptr};
+    std::vector<std::pair<uint64_t, void*>> orphans_;
+
+    std::atomic<size_t> advances_{0};
+    std::atomic<size_t> freed_{0};
+    std::atomic<size_t> free_batches_{0};
+};
+
+class EpochGuard {
+public:
+    explicit EpochGuard(EpochManager::Participant& p) : participant_{p} { participant_.Enter(); }
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+    ~EpochGuard() { participant_.Exit(); }
+
+private:
+    EpochManager::Participant& participant_;
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "block.h"
+#include "size.h"
+
+#include <cstddef>
+
+/*
+Policies for choosing a free block for allocation, a template parameter of BasicMemory.
+
+Policy has two methods, both are inlined into BasicMemory:
+    Block* Find(Block& first, Size sz) - free block of at least sz bytes (header included) or nullptr,
+                                         first is the block at the lowest address
+    void BeforeReplace(Block& first, Block& last) - blocks from first to last are about
+                                         to be split or joined, a block still starts at first afterwards
+
+Block list is ordered by address, so plain first fit is address ordered first fit.
+*/
+
+// smallest block that fits, whole list is searched
+class BestFit {
+public:
+    Block* Find(Block& first, Size sz) {
+        Block* blk = nullptr;
+        first.ForAll([&blk, sz](Block& b){
+            if (b.IsFree() && b.GetSize() >= sz) {
+                if (blk == nullptr || blk->GetSize() > b.GetSize()) {
+                    blk = &b;
+                }
+            }
+            return true;
+        });
+        return blk;
+    }
+
+    void BeforeReplace(Block&, Block&) {}
+};
+
+// lowest block that fits
+class FirstFit {
+public:
+    Block* Find(Block& first, Size sz) {
+        Block* blk = nullptr;
+        first.ForAll([&blk, sz](Block& b){
+            if (b.IsFree() && b.GetSize() >= sz) {
+                blk = &b;
+                return false;
+            }
+            return true;
+        });
+        return blk;
+    }
+
+    void BeforeReplace(Block&, Block&) {}
+};
+
+using AddressOrderedFirstFit = FirstFit;
+
+// first fit starting from where the previous search stopped, wraps around to the lowest block
+class NextFit {
+public:
+    Block* Find(Block& first, Size sz) {
+        Block& start = rover_ == nullptr ? first : *rover_;
+        Block* blk = nullptr;
+        auto fits = [&blk, sz](Block& b){
+            if (b.IsFree() && b.GetSize() >= sz) {
+                blk = &b;
+                return false;
+            }
+            return true;
+        };
+        start.ForAllFrom(fits);
+        if (blk == nullptr && &start != &first) {
+            first.ForAll([&](Block& b){
+                return &b != &start && fits(b);
+            });
+        }
+        if (blk != nullptr) {
+            rover_ = blk;
+        }
+        return blk;
+    }
+
+    // rover inside of replaced blocks would point to a dead header
+    void BeforeReplace(Block& first, Block& last) {
+        if (rover_ != nullptr && rover_->GetAddress() >= first.GetAddress() && rover_->GetAddress() <= last.GetAddress()) {
+            rover_ = &first;
+        }
+    }
+
+private:
+    Block* rover_ = nullptr;
+};
+
+/*
+Bounded best fit: stops at a block that wastes at most 1/SlackRatio of the request
+or after MaxCandidates fitting blocks, and takes the best of what it has seen.
+*/
+template <size_t MaxCandidates = 8, size_t SlackRatio = 8>
+class GoodFit {
+public:
+    Block* Find(Block& first, Size sz) {
+        const Size good_enough = sz + sz / SlackRatio;
+        Block* blk = nullptr;
+        size_t candidates = 0;
+        first.ForAll([&](Block& b){
+            if (b.IsFree() && b.GetSize() >= sz) {
+                if (blk == nullptr || blk->GetSize() > b.GetSize()) {
+                    blk = &b;
+                }
+                return blk->GetSize() > good_enough && ++candidates < MaxCandidates;
+            }
+            return true;
+        });
+        return blk;
+    }
+
+    void BeforeReplace(Block&, Block&) {}
+};
@@ -1,7 +1,16 @@
 #pragma once
 
+#include <cstdint>
+
 struct GcInfo {
-    bool marked;
-    bool to_be_checked;
-    bool root;
+    // reference count stops here, such objects are freed only by tracing
+    static const uint8_t StickyRefCount = UINT8_MAX;
+
+    bool marked = false;
+    bool to_be_checked = false;
+    bool root = false;
+    bool no_pointers = false; // object never holds pointers, gc does not scan it
+    bool sampled = false; // allocation was sampled by HeapProfiler
+    bool zct = false; // object is in the zero count table of reference counting
+    uint8_t ref_count = 0; // references from heap objects, see Gc::EnableRefCounting
 };
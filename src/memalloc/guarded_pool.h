@@ -0,0 +1,417 @@
+#pragma once
+
+#include "large_object_space.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+Sampling detector of heap overflows and use-after-free, cheap enough to stay on in production.
+
+One of about sample_rate allocations is served from a pool of guarded slots instead of the heap.
+Every slot is one page between two inaccessible guard pages, the object is placed at the end
+of its page, so reading or writing past its end faults at once. Freed slots are made
+inaccessible and go to the end of a FIFO, so a slot is reused as late as possible and
+use-after-free of a sampled object faults for a long time after free.
+Bytes between the object end and the page end (alignment slack) are filled with a pattern
+that is checked on free.
+
+On a fault in the pool the SIGSEGV handler prints what happened with the stacks of allocation
+and free of the object, then the process dies of the same signal. Double and invalid free
+of sampled objects are reported the same way and abort.
+
+Sampled objects have a LargeObject header like objects of the large object space, so header
+flags and GetUserDataSize work for them, but they are not linked into the space: pool is meant
+for heaps with explicit free, collectors do not trace objects outside of Memory and its LOS
+and refuse a heap with a pool.
+
+    GuardedPool pool;
+    mem.SetGuardedPool(&pool);
+
+Only one pool per process handles signals, faults outside of it are passed on to the handler
+that was installed before. A pool may be shared by heaps of several threads. Costs on the fast
+path are an atomic countdown in alloc and an address range check in free, slots are taken and
+given back under a mutex.
+*/
+class GuardedPool {
+public:
+    static const size_t DefaultSlots = 64;
+    static const size_t DefaultSampleRate = 5000;
+    static const int MaxFrames = 16;
+    static const unsigned char SlackPattern = 0xAB;
+
+    enum class Error { None, UseAfterFree, BufferOverflow, BufferUnderflow, DoubleFree, InvalidFree, SlackCorruption, Unknown };
+
+    // sample_rate 1 samples every allocation that fits a slot
+    GuardedPool(size_t slots = DefaultSlots, size_t sample_rate = DefaultSampleRate, uint64_t seed = 0x9E3779B97F4A7C15ull)
+        : slots_{slots}
+        , sample_rate_{sample_rate}
+        , page_size_{static_cast<size_t>(::sysconf(_SC_PAGESIZE))}
+        , random_{seed == 0 ? 1 : seed}
+    {
+        assert(slots > 0 && sample_rate > 0);
+        mapping_size_ = (2 * slots_ + 1) * page_size_;
+        void* addr = ::mmap(nullptr, mapping_size_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        assert(addr != MAP_FAILED);
+        pool_ = static_cast<char*>(addr);
+
+        meta_ = new SlotMeta[slots_];
+        free_slots_ = new size_t[slots_];
+        for (size_t idx = 0; idx < slots_; ++idx) {
+            free_slots_[idx] = idx;
+        }
+        free_count_ = slots_;
+        countdown_ = NextCountdown();
+
+        // first backtrace call loads the unwinder, it must not happen in the signal handler
+        void* frames[1];
+        ::backtrace(frames, 1);
+        InstallHandler();
+    }
+
+    GuardedPool(const GuardedPool&) = delete;
+    GuardedPool& operator=(const GuardedPool&) = delete;
+
+    ~GuardedPool() {
+        RemoveHandler();
+        ::munmap(pool_, mapping_size_);
+        delete[] meta_;
+        delete[] free_slots_;
+    }
+
+    // biggest request a slot can hold
+    size_t MaxSize() const { return page_size_ - LargeObject::HeaderSize; }
+
+    // called on every allocation, true if this one should be guarded
+    bool ShouldSample() {
+        // only the thread that takes the countdown to zero draws the next one, acquire and
+        // release order its use of random_ after the previous draw
+        if (countdown_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return false;
+        }
+        countdown_.store(NextCountdown(), std::memory_order_release);
+        return true;
+    }
+
+    // nullptr if sz does not fit a slot or all slots are busy, caller allocates as usual then
+    void* alloc(size_t sz) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        if (sz > MaxSize() || free_count_ == 0) {
+            return nullptr;
+        }
+        const size_t slot = free_slots_[free_head_];
+        free_head_ = (free_head_ + 1) % slots_;
+        --free_count_;
+
+        char* page = SlotPage(slot);
+        int rc = ::mprotect(page, page_size_, PROT_READ | PROT_WRITE);
+        assert(rc == 0);
+        (void)rc;
+
+        const size_t aligned = align(sz);
+        char* user = page + page_size_ - aligned;
+        new(user - LargeObject::HeaderSize) LargeObject{page_size_, sz};
+        std::memset(user + sz, SlackPattern, aligned - sz);
+
+        SlotMeta& meta = meta_[slot];
+        meta.state = SlotState::Allocated;
+        meta.ptr = user;
+        meta.size = sz;
+        meta.alloc_depth = ::backtrace(meta.alloc_stack, MaxFrames);
+        meta.free_depth = 0;
+        ++allocated_;
+        return user;
+    }
+
+    bool Contains(const void* ptr) const {
+        return ptr >= pool_ && ptr < pool_ + mapping_size_;
+    }
+
+    // size of the sampled object that is about to be freed, reports double or invalid free
+    size_t CheckFree(void* ptr) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        return CheckFreeLocked(ptr);
+    }
+
+    void free(void* ptr) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        CheckFreeLocked(ptr);
+        const size_t slot = SlotOf(ptr).index;
+        SlotMeta& meta = meta_[slot];
+        meta.state = SlotState::Freed;
+        meta.free_depth = ::backtrace(meta.free_stack, MaxFrames);
+        int rc = ::mprotect(SlotPage(slot), page_size_, PROT_NONE);
+        assert(rc == 0);
+        (void)rc;
+
+        free_slots_[(free_head_ + free_count_) % slots_] = slot;
+        ++free_count_;
+        ++freed_;
+    }
+
+    // what a fault at addr would be reported as
+    Error Classify(const void* addr) const {
+        const Slot slot = SlotOf(addr);
+        if (slot.index == NoSlot) {
+            return Error::Unknown;
+        }
+        const SlotMeta& meta = meta_[slot.index];
+        if (slot.in_page) {
+            return meta.state == SlotState::Freed ? Error::UseAfterFree : Error::Unknown;
+        }
+        if (meta.state == SlotState::Unused) {
+            return Error::Unknown;
+        }
+        return addr < meta.ptr ? Error::BufferUnderflow : Error::BufferOverflow;
+    }
+
+    size_t Slots() const { return slots_; }
+    size_t FreeSlots() const {
+        std::lock_guard<std::mutex> lock{mutex_};
+        return free_count_;
+    }
+    size_t Allocated() const {
+        std::lock_guard<std::mutex> lock{mutex_};
+        return allocated_;
+    }
+    size_t Freed() const {
+        std::lock_guard<std::mutex> lock{mutex_};
+        return freed_;
+    }
+
+    static const char* ErrorName(Error error) {
+        switch (error) {
+        case Error::None: return "none";
+        case Error::UseAfterFree: return "use-after-free";
+        case Error::BufferOverflow: return "buffer-overflow";
+        case Error::BufferUnderflow: return "buffer-underflow";
+        case Error::DoubleFree: return "double-free";
+        case Error::InvalidFree: return "invalid-free";
+        case Error::SlackCorruption: return "buffer-overflow (alignment slack)";
+        case Error::Unknown: return "unknown";
+        }
+        return "unknown";
+    }
+
+private:
+    static const size_t NoSlot = static_cast<size_t>(-1);
+
+    enum class SlotState : uint8_t { Unused, Allocated, Freed };
+
+    struct SlotMeta {
+        SlotState state = SlotState::Unused;
+        void* ptr = nullptr;
+        size_t size = 0;
+        int alloc_depth = 0;
+        int free_depth = 0;
+        void* alloc_stack[MaxFrames];
+        void* free_stack[MaxFrames];
+    };
+
+    // slot whose page or nearby guard page holds an address
+    struct Slot {
+        size_t index;
+        bool in_page;
+    };
+
+    size_t CheckFreeLocked(void* ptr) {
+        const Slot slot = SlotOf(ptr);
+        if (slot.index == NoSlot || !slot.in_page) {
+            Report(Error::InvalidFree, ptr, nullptr);
+        }
+        SlotMeta& meta = meta_[slot.index];
+        if (meta.state == SlotState::Freed) {
+            Report(Error::DoubleFree, ptr, &meta);
+        }
+        if (meta.state != SlotState::Allocated || meta.ptr != ptr) {
+            Report(Error::InvalidFree, ptr, &meta);
+        }
+        const unsigned char* slack = static_cast<unsigned char*>(ptr) + meta.size;
+        for (size_t idx = 0; idx < align(meta.size) - meta.size; ++idx) {
+            if (slack[idx] != SlackPattern) {
+                Report(Error::SlackCorruption, const_cast<unsigned char*>(slack + idx), &meta);
+            }
+        }
+        return meta.size;
+    }
+
+    char* SlotPage(size_t slot) const {
+        return pool_ + (2 * slot + 1) * page_size_;
+    }
+
+    /*
+    Pages alternate: guard, slot 0, guard, slot 1, ..., guard.
+    Objects are at the end of their pages, so a guard page is taken for an overflow
+    of the slot before it, unless that slot was never used.
+    */
+    Slot SlotOf(const void* addr) const {
+        if (!Contains(addr)) {
+            return {NoSlot, false};
+        }
+        const size_t page = (static_cast<const char*>(addr) - pool_) / page_size_;
+        if (page % 2 == 1) {
+            return {page / 2, true};
+        }
+        const size_t after = page / 2;
+        if (after > 0 && (after == slots_ || meta_[after - 1].state != SlotState::Unused)) {
+            return {after - 1, false};
+        }
+        return {after == slots_ ? NoSlot : after, false};
+    }
+
+    size_t NextCountdown() {
+        // xorshift, uniform in [1, 2 * sample_rate]
+        random_ ^= random_ << 13;
+        random_ ^= random_ >> 7;
+        random_ ^= random_ << 17;
+        return sample_rate_ == 1 ? 1 : 1 + random_ % (2 * sample_rate_);
+    }
+
+    // only async signal safe calls from here on
+
+    static void Write(const char* str) {
+        ssize_t rc = ::write(STDERR_FILENO, str, std::strlen(str));
+        (void)rc;
+    }
+
+    static void WriteNumber(uintptr_t value, unsigned base) {
+        char buf[2 + 2 * sizeof(value) * 4];
+        char* end = buf + sizeof(buf) - 1;
+        char* pos = end;
+        *pos = '\0';
+        do {
+            *--pos = "0123456789abcdef"[value % base];
+            value /= base;
+        } while (value != 0);
+        if (base == 16) {
+            *--pos = 'x';
+            *--pos = '0';
+        }
+        Write(pos);
+    }
+
+    static void WriteStack(void* const* frames, int depth) {
+        if (depth > 0) {
+            ::backtrace_symbols_fd(frames, depth, STDERR_FILENO);
+        }
+    }
+
+    void Describe(Error error, const void* addr, const SlotMeta* meta) const {
+        Write("==guarded pool== ");
+        Write(ErrorName(error));
+        Write(" at ");
+        WriteNumber(reinterpret_cast<uintptr_t>(addr), 16);
+        Write("\n");
+        if (meta == nullptr || meta->state == SlotState::Unused) {
+            return;
+        }
+        const intptr_t offset = static_cast<const char*>(addr) - static_cast<const char*>(meta->ptr);
+        Write("object of ");
+        WriteNumber(meta->size, 10);
+        Write(" bytes at ");
+        WriteNumber(reinterpret_cast<uintptr_t>(meta->ptr), 16);
+        Write(offset < 0 ? ", access is " : ", access is at offset ");
+        WriteNumber(static_cast<uintptr_t>(offset < 0 ? -offset : offset), 10);
+        Write(offset < 0 ? " bytes before it\n" : "\n");
+        Write("allocated at:\n");
+        WriteStack(meta->alloc_stack, meta->alloc_depth);
+        if (meta->state == SlotState::Freed) {
+            Write("freed at:\n");
+            WriteStack(meta->free_stack, meta->free_depth);
+        }
+    }
+
+    [[noreturn]] void Report(Error error, const void* addr, const SlotMeta* meta) const {
+        Describe(error, addr, meta);
+        Write("current stack:\n");
+        void* frames[MaxFrames];
+        WriteStack(frames, ::backtrace(frames, MaxFrames));
+        std::abort();
+    }
+
+    static std::atomic<GuardedPool*>& Installed() {
+        static std::atomic<GuardedPool*> installed{nullptr};
+        return installed;
+    }
+
+    static struct sigaction& PreviousAction() {
+        static struct sigaction previous;
+        return previous;
+    }
+
+    void InstallHandler() {
+        GuardedPool* expected = nullptr;
+        if (!Installed().compare_exchange_strong(expected, this)) {
+            return;
+        }
+        struct sigaction action{};
+        action.sa_sigaction = &GuardedPool::HandleSignal;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+        ::sigaction(SIGSEGV, &action, &PreviousAction());
+    }
+
+    void RemoveHandler() {
+        GuardedPool* expected = this;
+        if (Installed().compare_exchange_strong(expected, nullptr)) {
+            ::sigaction(SIGSEGV, &PreviousAction(), nullptr);
+        }
+    }
+
+    /*
+    Faults in the pool are reported, then the default action kills the process when the
+    faulting instruction runs again. Other faults are passed to the previous handler and the
+    pool handler stays installed, so a program that handles its own faults keeps working.
+    Previous default action is taken the same way as for pool faults, an ignored fault returns.
+    */
+    static void HandleSignal(int sig, siginfo_t* info, void* context) {
+        GuardedPool* pool = Installed().load();
+        if (pool != nullptr && pool->Contains(info->si_addr)) {
+            const Slot slot = pool->SlotOf(info->si_addr);
+            pool->Describe(pool->Classify(info->si_addr), info->si_addr,
+                           slot.index == NoSlot ? nullptr : &pool->meta_[slot.index]);
+            signal(sig, SIG_DFL);
+            return;
+        }
+        const struct sigaction& previous = PreviousAction();
+        if (previous.sa_flags & SA_SIGINFO) {
+            previous.sa_sigaction(sig, info, context);
+        } else if (previous.sa_handler == SIG_DFL) {
+            signal(sig, SIG_DFL);
+        } else if (previous.sa_handler != SIG_IGN) {
+            previous.sa_handler(sig);
+        }
+    }
+
+    const size_t slots_;
+    const size_t sample_rate_;
+    const size_t page_size_;
+    size_t mapping_size_ = 0;
+    char* pool_ = nullptr;
+
+    // slot bookkeeping, the signal handler reads it without the lock, the process is dying then
+    mutable std::mutex mutex_;
+    SlotMeta* meta_ = nullptr;
+    // FIFO of free slots, freed slots are reused last
+    size_t* free_slots_ = nullptr;
+    size_t free_head_ = 0;
+    size_t free_count_ = 0;
+
+    std::atomic<size_t> countdown_{0};
+    // only touched by the thread that resets the countdown
+    uint64_t random_;
+
+    size_t allocated_ = 0;
+    size_t freed_ = 0;
+};
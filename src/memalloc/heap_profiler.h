@@ -0,0 +1,206 @@
+#pragma once
+
+#include "memory.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <ios>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include <execinfo.h>
+
+/*
+Sampling heap profiler for Memory, shows which call sites hold the heap.
+
+About every sample_period allocated bytes one allocation is sampled: distance
+to the next sample is drawn from exponential distribution, so sampling is
+a Poisson process over allocated bytes and big objects are sampled more often.
+Only sampled allocations pay for a stack trace and a hash table insert.
+Sampled objects have the sampled flag in their header, so free of other objects
+costs one flag check.
+
+Profile is written in pprof legacy heap format (heap_v2), pprof scales sampled
+counts back using the sample period:
+
+    HeapProfiler profiler{mem};
+    ...
+    profiler.WriteProfile("heap.prof");
+    // pprof --inuse_space ./binary heap.prof
+
+Profiler uses the standard allocator for its own data, never the Memory it watches.
+*/
+class HeapProfiler : public MemoryObserver {
+public:
+    static const size_t DefaultSamplePeriod = 512 * 1024;
+    static const int MaxFrames = 32;
+
+    struct CallSite {
+        std::vector<void*> stack;
+        size_t inuse_objects = 0;
+        size_t inuse_bytes = 0;
+        size_t alloc_objects = 0;
+        size_t alloc_bytes = 0;
+    };
+
+    // sample_period 0 samples every allocation
+    HeapProfiler(Memory& mem, size_t sample_period = DefaultSamplePeriod, uint64_t seed = std::random_device{}())
+        : memory_{mem}
+        , sample_period_{sample_period}
+        , random_{seed}
+    {
+        // first backtrace call loads the unwinder, it must not happen inside alloc
+        void* frames[1];
+        ::backtrace(frames, 1);
+        bytes_until_sample_ = NextSampleDistance();
+        memory_.AddObserver(this);
+    }
+
+    HeapProfiler(const HeapProfiler&) = delete;
+    HeapProfiler& operator=(const HeapProfiler&) = delete;
+
+    ~HeapProfiler() {
+        memory_.RemoveObserver(this);
+        for (auto& [ptr, sample] : live_) {
+            GetGcInfo(ptr).sampled = false;
+        }
+    }
+
+    void OnAlloc(void* ptr, size_t sz) override {
+        if (sz < bytes_until_sample_) {
+            bytes_until_sample_ -= sz;
+            return;
+        }
+        bytes_until_sample_ = NextSampleDistance();
+        Sample(ptr, sz);
+    }
+
+    void OnFree(void* ptr, size_t) override {
+        GcInfo& info = GetGcInfo(ptr);
+        if (!info.sampled) {
+            return;
+        }
+        info.sampled = false;
+        auto it = live_.find(ptr);
+        if (it == live_.end()) {
+            // sampled by another profiler
+            return;
+        }
+        CallSite& site = sites_[it->second.site];
+        --site.inuse_objects;
+        site.inuse_bytes -= it->second.size;
+        live_.erase(it);
+    }
+
+    size_t SamplePeriod() const { return sample_period_; }
+    size_t SampledObjects() const { return sampled_; }
+    size_t LiveSampledObjects() const { return live_.size(); }
+
+    const std::vector<CallSite>& CallSites() const { return sites_; }
+
+    // pprof legacy heap profile of sampled live (inuse) and all time (alloc) allocations
+    void WriteProfile(std::ostream& os) const {
+        CallSite total;
+        for (const CallSite& site : sites_) {
+            total.inuse_objects += site.inuse_objects;
+            total.inuse_bytes += site.inuse_bytes;
+            total.alloc_objects += site.alloc_objects;
+            total.alloc_bytes += site.alloc_bytes;
+        }
+        os << "heap profile: ";
+        WriteCounts(os, total);
+        os << " @ heap_v2/" << sample_period_ << '\n';
+        for (const CallSite& site : sites_) {
+            WriteCounts(os, site);
+            os << " @";
+            for (void* frame : site.stack) {
+                os << " 0x" << std::hex << reinterpret_cast<uintptr_t>(frame) << std::dec;
+            }
+            os << '\n';
+        }
+        // pprof needs the mappings to symbolize addresses
+        os << "\nMAPPED_LIBRARIES:\n";
+        std::ifstream maps{"/proc/self/maps"};
+        os << maps.rdbuf();
+    }
+
+    bool WriteProfile(const char* path) const {
+        std::ofstream os{path};
+        WriteProfile(os);
+        return static_cast<bool>(os);
+    }
+
+private:
+    struct LiveSample {
+        size_t site;
+        size_t size;
+    };
+
+    struct StackHash {
+        size_t operator()(const std::vector<void*>& stack) const {
+            size_t h = stack.size();
+            for (void* frame : stack) {
+                h = h * 31 + std::hash<void*>{}(frame);
+            }
+            return h;
+        }
+    };
+
+    size_t NextSampleDistance() {
+        if (sample_period_ == 0) {
+            return 0;
+        }
+        std::exponential_distribution<double> distance{1.0 / sample_period_};
+        return static_cast<size_t>(distance(random_)) + 1;
+    }
+
+    void Sample(void* ptr, size_t sz) {
+        void* frames[MaxFrames];
+        int depth = ::backtrace(frames, MaxFrames);
+        // drop Sample, OnAlloc and Memory frames, they are the same for all call sites
+        int skip = depth > SkipFrames ? SkipFrames : 0;
+        std::vector<void*> stack(frames + skip, frames + depth);
+
+        auto [it, inserted] = site_index_.try_emplace(std::move(stack), sites_.size());
+        if (inserted) {
+            sites_.emplace_back();
+            sites_.back().stack = it->first;
+        }
+        CallSite& site = sites_[it->second];
+        ++site.inuse_objects;
+        site.inuse_bytes += sz;
+        ++site.alloc_objects;
+        site.alloc_bytes += sz;
+
+        GetGcInfo(ptr).sampled = true;
+        live_[ptr] = LiveSample{it->second, sz};
+        ++sampled_;
+    }
+
+    GcInfo& GetGcInfo(void* ptr) {
+        if (memory_.IsInAddrSpace(ptr)) {
+            return Block::FromUserData(ptr);
+        }
+        return LargeObject::FromUserData(ptr);
+    }
+
+    static void WriteCounts(std::ostream& os, const CallSite& site) {
+        os << site.inuse_objects << ": " << site.inuse_bytes
+           << " [" << site.alloc_objects << ": " << site.alloc_bytes << "]";
+    }
+
+    static const int SkipFrames = 3;
+
+    Memory& memory_;
+    const size_t sample_period_;
+    std::mt19937_64 random_;
+    size_t bytes_until_sample_ = 0;
+    size_t sampled_ = 0;
+
+    std::vector<CallSite> sites_;
+    std::unordered_map<std::vector<void*>, size_t, StackHash> site_index_;
+    std::unordered_map<void*, LiveSample> live_;
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "size.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+Memory region for Memory, taken straight from the OS instead of a static array.
+
+Region is aligned to the huge page size (2 MB), transparent huge pages are requested
+for it with madvise(MADV_HUGEPAGE), so heap walks and gc marking do fewer TLB misses.
+Region may be prefaulted - synchronously or on a background thread - so the first
+touches of the heap do not cause a storm of page faults.
+
+    HeapRegion region{256 << 20, true, HeapRegion::Prefault::Background};
+    Memory mem{region.lowest(), region.highest()};
+*/
+class HeapRegion {
+public:
+    static const size_t HugePageSize = 2 << 20;
+
+    enum class Prefault { None, Sync, Background };
+
+    HeapRegion(size_t size, bool huge_pages = true, Prefault prefault = Prefault::None)
+        : size_{align(size, HugePageSize)}
+    {
+        // map with extra huge page to be able to cut an aligned region out of it
+        const size_t mapping_size = size_ + HugePageSize;
+        void* mapping = ::mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) {
+            return;
+        }
+        const uintptr_t start = reinterpret_cast<uintptr_t>(mapping);
+        const uintptr_t aligned = align(start, HugePageSize);
+        if (aligned != start) {
+            ::munmap(mapping, aligned - start);
+        }
+        const uintptr_t tail = aligned + size_;
+        const uintptr_t end = start + mapping_size;
+        if (end != tail) {
+            ::munmap(reinterpret_cast<void*>(tail), end - tail);
+        }
+        base_ = reinterpret_cast<char*>(aligned);
+
+        huge_pages_ = ::madvise(base_, size_, huge_pages ? MADV_HUGEPAGE : MADV_NOHUGEPAGE) == 0 && huge_pages;
+
+        if (prefault == Prefault::Sync) {
+            PrefaultRange();
+        } else if (prefault == Prefault::Background) {
+            prefault_thread_ = std::thread{[this](){ PrefaultRange(); }};
+        }
+    }
+
+    HeapRegion(const HeapRegion&) = delete;
+    HeapRegion& operator=(const HeapRegion&) = delete;
+
+    ~HeapRegion() {
+        stop_ = true;
+        WaitPrefault();
+        if (base_ != nullptr) {
+            ::munmap(base_, size_);
+        }
+    }
+
+    bool Valid() const { return base_ != nullptr; }
+
+    void* lowest() const { return base_; }
+    void* highest() const { return base_ + size_; }
+    size_t size() const { return size_; }
+
+    // madvise(MADV_HUGEPAGE) succeeded, kernel still decides if huge pages are used
+    bool HugePages() const { return huge_pages_; }
+
+    bool Prefaulted() const { return prefaulted_; }
+
+    void WaitPrefault() {
+        if (prefault_thread_.joinable()) {
+            prefault_thread_.join();
+        }
+    }
+
+private:
+    // the region may already be in use, so pages are touched without changing their content
+    void PrefaultRange() {
+#ifdef MADV_POPULATE_WRITE
+        if (::madvise(base_, size_, MADV_POPULATE_WRITE) == 0) {
+            prefaulted_ = true;
+            return;
+        }
+#endif
+        const size_t step = huge_pages_ ? HugePageSize : static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        for (size_t offset = 0; offset < size_ && !stop_; offset += step) {
+            __atomic_fetch_add(base_ + offset, 0, __ATOMIC_RELAXED);
+        }
+        prefaulted_ = !stop_;
+    }
+
+    const size_t size_;
+    char* base_ = nullptr;
+    bool huge_pages_ = false;
+    std::atomic<bool> prefaulted_{false};
+    std::atomic<bool> stop_{false};
+    std::thread prefault_thread_;
+};
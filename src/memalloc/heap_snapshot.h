@@ -0,0 +1,596 @@
+#pragma once
+
+#include "memory.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+Binary heap snapshots: every block and large object with its size, state and gc bits,
+optionally with outgoing pointer edges. Meant for big heaps where operator<< is too slow.
+
+File is a header followed by a stream of records in heap address order (large objects after
+blocks), edges of a record follow it, the stream ends with an End record:
+
+    HeapSnapshotHeader
+    HeapSnapshotRecord [uint64_t target] * edges
+    ...
+    HeapSnapshotRecord{kind = End, addr = number of records}
+
+Objects are identified by the address of their user data. An edge is a word of the object that
+points into another object (interior pointers too, like the collector takes them), its target
+is the user data address of that object. Values are in the byte order of the writing machine.
+
+Writer walks the heap without changing it, the heap must not change during the walk: take the
+heap lock or stop the world, or write from a forked child (WriteHeapSnapshotForked), then the
+pause is only the fork. The child writes a copy-on-write image of the heap and uses malloc,
+glibc keeps malloc usable in the child of a multithreaded process.
+
+HeapSnapshot reads a file back and computes fragmentation, dominators with retained sizes
+and differences between two snapshots, tools/heap_snapshot_tool.cpp prints them.
+*/
+
+struct HeapSnapshotHeader {
+    static constexpr char Magic[8] = {'H', 'E', 'A', 'P', 'S', 'N', 'A', 'P'};
+    static const uint32_t CurrentVersion = 1;
+    static const uint32_t HasEdges = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t heap_lowest;
+    uint64_t heap_size;
+};
+
+struct HeapSnapshotRecord {
+    enum Kind : uint8_t { Free, Block, Large, End };
+    enum Flags : uint8_t { Marked = 1, ToBeChecked = 2, Root = 4, NoPointers = 8, Sampled = 16, Zct = 32 };
+
+    uint64_t addr;   // user data address
+    uint64_t size;   // bytes taken from the heap, header included
+    uint32_t edges;  // targets following the record
+    uint8_t kind;
+    uint8_t flags;
+    uint8_t ref_count;
+    uint8_t reserved;
+};
+static_assert(sizeof(HeapSnapshotRecord) == 24, "snapshot record layout changed");
+
+// writes a snapshot to a file descriptor through its own buffer, no flush per record
+class HeapSnapshotWriter {
+public:
+    static const size_t BufferSize = 1 << 16;
+
+    explicit HeapSnapshotWriter(int fd) : fd_{fd}, buffer_(BufferSize) {}
+
+    HeapSnapshotWriter(const HeapSnapshotWriter&) = delete;
+    HeapSnapshotWriter& operator=(const HeapSnapshotWriter&) = delete;
+
+    template <typename FitPolicy>
+    bool Write(const BasicMemory<FitPolicy>& mem, bool edges = true) {
+        HeapSnapshotHeader header{};
+        std::memcpy(header.magic, HeapSnapshotHeader::Magic, sizeof(header.magic));
+        header.version = HeapSnapshotHeader::CurrentVersion;
+        header.flags = edges ? HeapSnapshotHeader::HasEdges : 0;
+        header.heap_lowest = reinterpret_cast<uintptr_t>(&mem.FirstBlock());
+        header.heap_size = mem.MemSize();
+        Put(&header, sizeof(header));
+
+        if (edges) {
+            IndexObjects(mem);
+        }
+        uint64_t records = 0;
+        mem.ForAllBlocks([&](const Block& blk){
+            const uint8_t kind = blk.IsFree() ? HeapSnapshotRecord::Free : HeapSnapshotRecord::Block;
+            PutObject(blk, kind, blk.GetUserDataSize() + align(sizeof(Block)), edges && !blk.IsFree());
+            ++records;
+            return true;
+        });
+        mem.LargeObjects().ForAllObjects([&](const LargeObject& obj){
+            PutObject(obj, HeapSnapshotRecord::Large, obj.GetMappingSize(), edges);
+            ++records;
+            return true;
+        });
+
+        HeapSnapshotRecord end{};
+        end.kind = HeapSnapshotRecord::End;
+        end.addr = records;
+        Put(&end, sizeof(end));
+        return Flush();
+    }
+
+    uint64_t BytesWritten() const { return written_; }
+
+private:
+    struct Range {
+        uintptr_t begin;
+        uintptr_t end;
+        uintptr_t user;
+    };
+
+    template <typename FitPolicy>
+    void IndexObjects(const BasicMemory<FitPolicy>& mem) {
+        objects_.clear();
+        mem.ForAllBlocks([&](const Block& blk){
+            if (!blk.IsFree()) {
+                const uintptr_t user = reinterpret_cast<uintptr_t>(blk.ToUserData());
+                objects_.push_back({user - align(sizeof(Block)), user + blk.GetUserDataSize(), user});
+            }
+            return true;
+        });
+        mem.LargeObjects().ForAllObjects([&](const LargeObject& obj){
+            const uintptr_t user = reinterpret_cast<uintptr_t>(obj.ToUserData());
+            objects_.push_back({user, user + obj.GetUserDataSize(), user});
+            return true;
+        });
+        std::sort(objects_.begin(), objects_.end(), [](const Range& lhs, const Range& rhs){
+            return lhs.begin < rhs.begin;
+        });
+    }
+
+    // user data address of the object holding addr, 0 if there is none
+    uintptr_t FindObject(uintptr_t addr) const {
+        auto it = std::upper_bound(objects_.begin(), objects_.end(), addr, [](uintptr_t a, const Range& range){
+            return a < range.begin;
+        });
+        if (it == objects_.begin()) {
+            return 0;
+        }
+        --it;
+        return addr < it->end ? it->user : 0;
+    }
+
+    template <typename Obj>
+    void PutObject(const Obj& obj, uint8_t kind, uint64_t size, bool edges) {
+        targets_.clear();
+        if (edges && !obj.no_pointers) {
+            const uintptr_t* words = reinterpret_cast<const uintptr_t*>(obj.ToUserData());
+            for (size_t idx = 0; idx < obj.GetUserDataSize() / sizeof(uintptr_t); ++idx) {
+                if (uintptr_t target = FindObject(words[idx])) {
+                    targets_.push_back(target);
+                }
+            }
+            std::sort(targets_.begin(), targets_.end());
+            targets_.erase(std::unique(targets_.begin(), targets_.end()), targets_.end());
+        }
+
+        HeapSnapshotRecord record{};
+        record.addr = reinterpret_cast<uintptr_t>(obj.ToUserData());
+        record.size = size;
+        record.edges = static_cast<uint32_t>(targets_.size());
+        record.kind = kind;
+        record.flags = (obj.marked ? HeapSnapshotRecord::Marked : 0)
+                     | (obj.to_be_checked ? HeapSnapshotRecord::ToBeChecked : 0)
+                     | (obj.root ? HeapSnapshotRecord::Root : 0)
+                     | (obj.no_pointers ? HeapSnapshotRecord::NoPointers : 0)
+                     | (obj.sampled ? HeapSnapshotRecord::Sampled : 0)
+                     | (obj.zct ? HeapSnapshotRecord::Zct : 0);
+        record.ref_count = obj.ref_count;
+        Put(&record, sizeof(record));
+        for (uint64_t target : targets_) {
+            Put(&target, sizeof(target));
+        }
+    }
+
+    void Put(const void* data, size_t sz) {
+        if (used_ + sz > buffer_.size()) {
+            Flush();
+        }
+        std::memcpy(buffer_.data() + used_, data, sz);
+        used_ += sz;
+    }
+
+    bool Flush() {
+        size_t done = 0;
+        while (done < used_ && ok_) {
+            const ssize_t n = ::write(fd_, buffer_.data() + done, used_ - done);
+            if (n > 0) {
+                done += n;
+            } else if (n < 0 && errno != EINTR) {
+                ok_ = false;
+            }
+        }
+        written_ += done;
+        used_ = 0;
+        return ok_;
+    }
+
+    const int fd_;
+    std::vector<char> buffer_;
+    size_t used_ = 0;
+    uint64_t written_ = 0;
+    bool ok_ = true;
+
+    std::vector<Range> objects_;
+    std::vector<uint64_t> targets_;
+};
+
+template <typename FitPolicy>
+bool WriteHeapSnapshot(const BasicMemory<FitPolicy>& mem, const char* path, bool edges = true) {
+    const int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    HeapSnapshotWriter writer{fd};
+    const bool ok = writer.Write(mem, edges);
+    return ::close(fd) == 0 && ok;
+}
+
+// snapshot is written by a child process, returns its pid (-1 if fork failed) for WaitHeapSnapshot
+template <typename FitPolicy>
+pid_t WriteHeapSnapshotForked(const BasicMemory<FitPolicy>& mem, const char* path, bool edges = true) {
+    const pid_t pid = ::fork();
+    if (pid == 0) {
+        ::_exit(WriteHeapSnapshot(mem, path, edges) ? 0 : 1);
+    }
+    return pid;
+}
+
+inline bool WaitHeapSnapshot(pid_t pid) {
+    int status = 0;
+    while (::waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// snapshot read back for offline analysis
+class HeapSnapshot {
+public:
+    struct Object {
+        uint64_t addr;
+        uint64_t size;
+        uint8_t kind;
+        uint8_t flags;
+        uint8_t ref_count;
+        size_t first_edge;  // edges of the object are edges()[first_edge, first_edge + edge_count)
+        uint32_t edge_count;
+    };
+
+    struct Fragmentation {
+        uint64_t heap_size = 0;
+        uint64_t occupied = 0;
+        uint64_t free = 0;
+        uint64_t largest_free = 0;
+        uint64_t large_objects = 0;
+        size_t blocks = 0;
+        size_t free_blocks = 0;
+        // free blocks by size: counts[i] holds sizes in [2^i, 2^(i+1))
+        std::vector<size_t> free_histogram;
+
+        // 1 - largest free block / free memory
+        double Ratio() const { return free == 0 ? 0 : 1 - static_cast<double>(largest_free) / free; }
+    };
+
+    struct Retained {
+        uint64_t addr;
+        uint64_t size;
+        uint64_t retained;
+    };
+
+    struct SizeDelta {
+        uint64_t size;
+        int64_t objects;
+    };
+
+    struct Diff {
+        size_t allocated_objects = 0;
+        uint64_t allocated_bytes = 0;
+        size_t freed_objects = 0;
+        uint64_t freed_bytes = 0;
+        size_t kept_objects = 0;
+        // change of object count per object size, biggest change in bytes first
+        std::vector<SizeDelta> by_size;
+    };
+
+    static constexpr uint64_t NoObject = static_cast<uint64_t>(-1);
+
+    bool Read(const char* path) {
+        objects_.clear();
+        edges_.clear();
+        const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        const bool ok = Read(fd);
+        ::close(fd);
+        if (ok) {
+            std::sort(objects_.begin(), objects_.end(), [](const Object& lhs, const Object& rhs){
+                return lhs.addr < rhs.addr;
+            });
+        }
+        return ok;
+    }
+
+    const HeapSnapshotHeader& Header() const { return header_; }
+    bool HasEdges() const { return (header_.flags & HeapSnapshotHeader::HasEdges) != 0; }
+    const std::vector<Object>& Objects() const { return objects_; }
+    const std::vector<uint64_t>& Edges() const { return edges_; }
+
+    // index of the object with user data at addr, NoObject if there is none
+    uint64_t Find(uint64_t addr) const {
+        auto it = std::lower_bound(objects_.begin(), objects_.end(), addr, [](const Object& obj, uint64_t a){
+            return obj.addr < a;
+        });
+        return it != objects_.end() && it->addr == addr ? it - objects_.begin() : NoObject;
+    }
+
+    Fragmentation GetFragmentation() const {
+        Fragmentation result;
+        result.heap_size = header_.heap_size;
+        for (const Object& obj : objects_) {
+            if (obj.kind == HeapSnapshotRecord::Large) {
+                result.large_objects += obj.size;
+                continue;
+            }
+            ++result.blocks;
+            if (obj.kind == HeapSnapshotRecord::Block) {
+                result.occupied += obj.size;
+                continue;
+            }
+            ++result.free_blocks;
+            result.free += obj.size;
+            result.largest_free = std::max(result.largest_free, obj.size);
+            size_t bucket = 0;
+            while ((obj.size >> (bucket + 1)) != 0) {
+                ++bucket;
+            }
+            if (result.free_histogram.size() <= bucket) {
+                result.free_histogram.resize(bucket + 1);
+            }
+            ++result.free_histogram[bucket];
+        }
+        return result;
+    }
+
+    /*
+    Retained size of an object is the memory freed if it died: its own size and sizes
+    of objects it dominates. Graph roots are objects with the root flag and objects nobody
+    points to, garbage cycles are reached from one of their members. Immediate dominators
+    are computed by the iterative algorithm of Cooper, Harvey and Kennedy over a virtual
+    root above all graph roots. Returns live objects, biggest retained size first.
+    */
+    std::vector<Retained> GetDominators(std::vector<uint64_t>* idom_addrs = nullptr) const {
+        const size_t n = objects_.size();
+        const size_t virtual_root = n;
+        std::vector<std::vector<size_t>> preds(n + 1);
+        std::vector<bool> referenced(n, false);
+        for (size_t idx = 0; idx < n; ++idx) {
+            ForAllTargets(idx, [&](size_t target){
+                preds[target].push_back(idx);
+                referenced[target] = true;
+            });
+        }
+
+        // reverse postorder from the virtual root
+        std::vector<size_t> order;
+        std::vector<size_t> rpo_number(n + 1, NoNumber);
+        std::vector<bool> visited(n + 1, false);
+        auto visit = [&](size_t start){
+            std::vector<std::pair<size_t, size_t>> stack{{start, 0}};
+            visited[start] = true;
+            while (!stack.empty()) {
+                auto& [node, next_edge] = stack.back();
+                if (node != virtual_root && next_edge < objects_[node].edge_count) {
+                    const uint64_t target = Find(edges_[objects_[node].first_edge + next_edge++]);
+                    if (target != NoObject && IsLive(target) && !visited[target]) {
+                        visited[target] = true;
+                        stack.push_back({target, 0});
+                    }
+                    continue;
+                }
+                order.push_back(node);
+                stack.pop_back();
+            }
+        };
+        auto add_root = [&](size_t idx){
+            preds[idx].push_back(virtual_root);
+            if (!visited[idx]) {
+                visit(idx);
+            }
+        };
+        visited[virtual_root] = true;
+        // a root hangs from the virtual root even if some other object points to it
+        for (size_t idx = 0; idx < n; ++idx) {
+            if (IsLive(idx) && (objects_[idx].flags & HeapSnapshotRecord::Root)) {
+                add_root(idx);
+            }
+        }
+        for (size_t idx = 0; idx < n; ++idx) {
+            if (IsLive(idx) && !visited[idx] && !referenced[idx]) {
+                add_root(idx);
+            }
+        }
+        for (size_t idx = 0; idx < n; ++idx) {
+            if (IsLive(idx) && !visited[idx]) {
+                add_root(idx);
+            }
+        }
+        order.push_back(virtual_root);
+        std::reverse(order.begin(), order.end());
+        for (size_t idx = 0; idx < order.size(); ++idx) {
+            rpo_number[order[idx]] = idx;
+        }
+
+        std::vector<size_t> idom(n + 1, NoNumber);
+        idom[virtual_root] = virtual_root;
+        auto intersect = [&](size_t a, size_t b){
+            while (a != b) {
+                while (rpo_number[a] > rpo_number[b]) {
+                    a = idom[a];
+                }
+                while (rpo_number[b] > rpo_number[a]) {
+                    b = idom[b];
+                }
+            }
+            return a;
+        };
+        for (bool changed = true; changed; ) {
+            changed = false;
+            for (size_t idx = 1; idx < order.size(); ++idx) {
+                const size_t node = order[idx];
+                size_t new_idom = NoNumber;
+                for (size_t pred : preds[node]) {
+                    if (rpo_number[pred] == NoNumber || idom[pred] == NoNumber) {
+                        continue;
+                    }
+                    new_idom = new_idom == NoNumber ? pred : intersect(pred, new_idom);
+                }
+                if (idom[node] != new_idom) {
+                    idom[node] = new_idom;
+                    changed = true;
+                }
+            }
+        }
+
+        // children come after their dominators in reverse postorder
+        std::vector<uint64_t> retained(n + 1, 0);
+        for (size_t idx = order.size(); idx-- > 1; ) {
+            const size_t node = order[idx];
+            retained[node] += objects_[node].size;
+            retained[idom[node]] += retained[node];
+        }
+
+        std::vector<Retained> result;
+        if (idom_addrs != nullptr) {
+            idom_addrs->assign(n, 0);
+        }
+        for (size_t idx = 0; idx < n; ++idx) {
+            if (!IsLive(idx)) {
+                continue;
+            }
+            result.push_back({objects_[idx].addr, objects_[idx].size, retained[idx]});
+            if (idom_addrs != nullptr && idom[idx] != virtual_root) {
+                (*idom_addrs)[idx] = objects_[idom[idx]].addr;
+            }
+        }
+        std::stable_sort(result.begin(), result.end(), [](const Retained& lhs, const Retained& rhs){
+            return lhs.retained > rhs.retained;
+        });
+        return result;
+    }
+
+    // objects are matched by address and size, so an address reused by another object counts as free and allocation
+    Diff GetDiff(const HeapSnapshot& after) const {
+        Diff result;
+        std::map<uint64_t, int64_t> by_size;
+        size_t lhs = 0;
+        size_t rhs = 0;
+        const auto& before_objs = objects_;
+        const auto& after_objs = after.objects_;
+        auto freed = [&](const Object& obj){
+            ++result.freed_objects;
+            result.freed_bytes += obj.size;
+            --by_size[obj.size];
+        };
+        auto allocated = [&](const Object& obj){
+            ++result.allocated_objects;
+            result.allocated_bytes += obj.size;
+            ++by_size[obj.size];
+        };
+        while (lhs < before_objs.size() || rhs < after_objs.size()) {
+            if (lhs < before_objs.size() && before_objs[lhs].kind == HeapSnapshotRecord::Free) {
+                ++lhs;
+            } else if (rhs < after_objs.size() && after_objs[rhs].kind == HeapSnapshotRecord::Free) {
+                ++rhs;
+            } else if (rhs == after_objs.size() || (lhs < before_objs.size() && before_objs[lhs].addr < after_objs[rhs].addr)) {
+                freed(before_objs[lhs++]);
+            } else if (lhs == before_objs.size() || after_objs[rhs].addr < before_objs[lhs].addr) {
+                allocated(after_objs[rhs++]);
+            } else if (before_objs[lhs].size != after_objs[rhs].size) {
+                freed(before_objs[lhs++]);
+                allocated(after_objs[rhs++]);
+            } else {
+                ++result.kept_objects;
+                ++lhs;
+                ++rhs;
+            }
+        }
+        for (auto& [size, objects] : by_size) {
+            if (objects != 0) {
+                result.by_size.push_back({size, objects});
+            }
+        }
+        std::stable_sort(result.by_size.begin(), result.by_size.end(), [](const SizeDelta& a, const SizeDelta& b){
+            return static_cast<uint64_t>(std::abs(a.objects)) * a.size > static_cast<uint64_t>(std::abs(b.objects)) * b.size;
+        });
+        return result;
+    }
+
+private:
+    static constexpr size_t NoNumber = static_cast<size_t>(-1);
+
+    bool IsLive(size_t idx) const { return objects_[idx].kind != HeapSnapshotRecord::Free; }
+
+    template <typename Handler>
+    void ForAllTargets(size_t idx, Handler&& handler) const {
+        const Object& obj = objects_[idx];
+        for (size_t edge = obj.first_edge; edge < obj.first_edge + obj.edge_count; ++edge) {
+            const uint64_t target = Find(edges_[edge]);
+            if (target != NoObject && IsLive(target)) {
+                handler(target);
+            }
+        }
+    }
+
+    bool Read(int fd) {
+        std::vector<char> buffer(HeapSnapshotWriter::BufferSize);
+        size_t begin = 0;
+        size_t end = 0;
+        auto get = [&](void* data, size_t sz){
+            char* out = static_cast<char*>(data);
+            while (sz > 0) {
+                if (begin == end) {
+                    const ssize_t n = ::read(fd, buffer.data(), buffer.size());
+                    if (n <= 0) {
+                        return false;
+                    }
+                    begin = 0;
+                    end = n;
+                }
+                const size_t chunk = std::min(sz, end - begin);
+                std::memcpy(out, buffer.data() + begin, chunk);
+                begin += chunk;
+                out += chunk;
+                sz -= chunk;
+            }
+            return true;
+        };
+
+        if (!get(&header_, sizeof(header_))
+            || std::memcmp(header_.magic, HeapSnapshotHeader::Magic, sizeof(header_.magic)) != 0
+            || header_.version != HeapSnapshotHeader::CurrentVersion) {
+            return false;
+        }
+        HeapSnapshotRecord record;
+        while (get(&record, sizeof(record))) {
+            if (record.kind == HeapSnapshotRecord::End) {
+                return record.addr == objects_.size();
+            }
+            objects_.push_back({record.addr, record.size, record.kind, record.flags, record.ref_count,
+                                edges_.size(), record.edges});
+            edges_.resize(edges_.size() + record.edges);
+            if (record.edges != 0 && !get(&edges_[edges_.size() - record.edges], record.edges * sizeof(uint64_t))) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    HeapSnapshotHeader header_{};
+    std::vector<Object> objects_;
+    std::vector<uint64_t> edges_;
+};
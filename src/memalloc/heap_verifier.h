@@ -0,0 +1,285 @@
+#pragma once
+
+#include "memory.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+Heap verification for big heaps.
+
+Verify() is the fused single pass check (the same as Memory::MemStructureValid)
+that also remembers segment anchors - first blocks of equal parts of the address space.
+
+VerifyParallel() checks segments between anchors on the worker threads started by the
+constructor (heaps too small to pay for the hand-off are checked inline), every segment
+must end exactly at the anchor of the next one, so continuity is checked where segments meet.
+Anchors may become stale after the heap changed (e.g. anchored block was joined with
+the previous one), such anchors are detected and skipped; if a seam still does not match,
+a serial pass is done and anchors are refreshed.
+
+Step() is the incremental mode: every call checks a bounded slice of blocks and continues
+from where the previous call stopped. Memory may change between calls, in that case the
+current pass can not check block size sums and they are checked only for passes
+that ran without intervening changes. Broken links and sizes are reported in any pass:
+a failed slice of a changed pass is confirmed by a full walk before it is reported.
+
+Memory must not be changed while Verify/VerifyParallel/Step is running.
+*/
+class HeapVerifier {
+public:
+    using Address = Memory::Address;
+
+    // parallel check is worth the hand-off only with this many blocks per thread
+    static const size_t MinBlocksPerThread = 256;
+
+    // threads - 1 workers are started once and reused, the calling thread is the last one
+    HeapVerifier(const Memory& mem, size_t segments = 64, size_t threads = 1)
+        : memory_{mem}
+        , segments_{segments}
+        , threads_{threads}
+    {
+        assert(segments_ > 0);
+        assert(threads_ > 0);
+        for (size_t idx = 1; idx < threads_; ++idx) {
+            workers_.emplace_back([this](){ Work(); });
+        }
+    }
+
+    HeapVerifier(const HeapVerifier&) = delete;
+    HeapVerifier& operator=(const HeapVerifier&) = delete;
+
+    ~HeapVerifier() {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            stop_ = true;
+        }
+        work_cv_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    bool Verify() {
+        anchors_.clear();
+        Memory::SegmentSummary total;
+        Block* from = &memory_.FirstBlock();
+        for (size_t seg = 1; seg <= segments_ && from != nullptr; ++seg) {
+            anchors_.push_back(from);
+            const Address until = seg == segments_ ? memory_.aspace_.null() : Boundary(seg);
+            const auto s = memory_.VerifySegment(*from, until, std::numeric_limits<size_t>::max());
+            if (!Accumulate(total, s)) {
+                anchors_.clear();
+                return false;
+            }
+            from = s.stop;
+        }
+        blocks_ = total.blocks;
+        return Complete(total);
+    }
+
+    // small heaps are checked inline by Verify
+    bool VerifyParallel() {
+        if (threads_ == 1 || blocks_ < threads_ * MinBlocksPerThread) {
+            return Verify();
+        }
+        std::vector<Block*> anchors;
+        for (Block* anchor : anchors_) {
+            if (IsBlockStart(anchor)) {
+                anchors.push_back(anchor);
+            }
+        }
+        if (anchors.empty() || anchors.front() != &memory_.FirstBlock()) {
+            return Verify();
+        }
+
+        const size_t jobs = std::min(threads_, anchors.size());
+        jobs_.clear();
+        for (size_t job = 0; job < jobs; ++job) {
+            const size_t first = job * anchors.size() / jobs;
+            const size_t last = (job + 1) * anchors.size() / jobs;
+            const Address until = last == anchors.size() ? memory_.aspace_.null() : anchors[last]->GetAddress();
+            jobs_.push_back({anchors[first], until, {}});
+        }
+        RunJobs();
+        ++parallel_passes_;
+
+        Memory::SegmentSummary total;
+        for (size_t job = 0; job < jobs; ++job) {
+            const size_t last = (job + 1) * anchors.size() / jobs;
+            const auto& s = jobs_[job].result;
+            const bool seam_ok = last == anchors.size() ? s.reached_end : s.stop == anchors[last];
+            if (!s.ok || !seam_ok) {
+                // either corruption or stale anchor, serial pass tells which one
+                return Verify();
+            }
+            Accumulate(total, s);
+        }
+        return Complete(total);
+    }
+
+    // checks next max_blocks blocks, returns false if corruption was found
+    bool Step(size_t max_blocks) {
+        if (cursor_ != nullptr && memory_.mutations_ != pass_mutations_) {
+            // heap changed since the previous step
+            pass_clean_ = false;
+            if (!IsBlockStart(cursor_)) {
+                Restart();
+            }
+        }
+        if (cursor_ == nullptr) {
+            Restart();
+        }
+
+        const auto s = memory_.VerifySegment(*cursor_, memory_.aspace_.null(), max_blocks);
+        if (!s.ok) {
+            // after changes the cursor was checked only cheaply, heap does not change during
+            // this call, so a full walk from the first block tells if the failure is real
+            const bool corrupted = pass_clean_
+                || !memory_.VerifySegment(memory_.FirstBlock(), memory_.aspace_.null(), std::numeric_limits<size_t>::max()).ok;
+            Restart();
+            return !corrupted;
+        }
+        Accumulate(pass_, s);
+        pass_mutations_ = memory_.mutations_;
+        cursor_ = s.stop;
+
+        if (s.reached_end) {
+            const bool ok = !pass_clean_ || Complete(pass_);
+            ++completed_passes_;
+            Restart();
+            return ok;
+        }
+        return true;
+    }
+
+    size_t CompletedPasses() const { return completed_passes_; }
+    size_t ParallelPasses() const { return parallel_passes_; }
+
+private:
+    struct Job {
+        Block* from;
+        Address until;
+        Memory::SegmentSummary result;
+    };
+
+    // jobs_ are shared by the workers and the calling thread, returns when all are done
+    void RunJobs() {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            next_job_ = 0;
+            busy_ = workers_.size();
+            ++generation_;
+        }
+        work_cv_.notify_all();
+        ClaimJobs();
+        std::unique_lock<std::mutex> lock{mutex_};
+        done_cv_.wait(lock, [this](){ return busy_ == 0; });
+    }
+
+    void ClaimJobs() {
+        for (size_t job = next_job_++; job < jobs_.size(); job = next_job_++) {
+            jobs_[job].result = memory_.VerifySegment(*jobs_[job].from, jobs_[job].until, std::numeric_limits<size_t>::max());
+        }
+    }
+
+    void Work() {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock{mutex_};
+        while (true) {
+            work_cv_.wait(lock, [&](){ return stop_ || generation_ != seen; });
+            if (stop_) {
+                return;
+            }
+            seen = generation_;
+            lock.unlock();
+            ClaimJobs();
+            lock.lock();
+            if (--busy_ == 0) {
+                done_cv_.notify_all();
+            }
+        }
+    }
+
+    Address Boundary(size_t seg) const {
+        return memory_.aspace_.lowest() + Size{memory_.MemSize() / segments_ * seg};
+    }
+
+    static bool Accumulate(Memory::SegmentSummary& total, const Memory::SegmentSummary& s) {
+        total.ok = total.ok && s.ok;
+        total.reached_end = s.reached_end;
+        total.size = total.size + s.size;
+        total.free = total.free + s.free;
+        total.occupied = total.occupied + s.occupied;
+        total.blocks += s.blocks;
+        return total.ok;
+    }
+
+    bool Complete(const Memory::SegmentSummary& total) const {
+        return total.ok
+               && total.reached_end
+               && total.size == memory_.size_
+               && total.free == memory_.free_size_
+               && total.occupied == memory_.occupied_size_;
+    }
+
+    // cheap check that blk points to a live block header, used for anchors and cursor
+    bool IsBlockStart(Block* blk) const {
+        const AddrSpace& aspace = memory_.aspace_;
+        if (!aspace.IsInAddrSpace(blk)) {
+            return false;
+        }
+        const Address addr = aspace.address(blk);
+        if (addr - aspace.lowest() != (addr - aspace.lowest()).Align()) {
+            return false;
+        }
+        if (!(addr + Block::HeaderSize <= aspace.highest())) {
+            return false;
+        }
+        if (!blk->HasPrev()) {
+            return addr == aspace.lowest();
+        }
+        Block* prev = &blk->Prev();
+        return aspace.IsInAddrSpace(prev)
+               && prev->GetAddress() < addr
+               && prev->GetAddress() + Block::HeaderSize <= aspace.highest()
+               && prev->NextBlockAddress() == addr
+               && prev->HasNext()
+               && &prev->Next() == blk;
+    }
+
+    void Restart() {
+        cursor_ = &memory_.FirstBlock();
+        pass_ = Memory::SegmentSummary{};
+        pass_mutations_ = memory_.mutations_;
+        pass_clean_ = true;
+    }
+
+    const Memory& memory_;
+    const size_t segments_;
+    const size_t threads_;
+    std::vector<Block*> anchors_;
+
+    Block* cursor_ = nullptr;
+    Memory::SegmentSummary pass_;
+    uint64_t pass_mutations_ = 0;
+    bool pass_clean_ = true;
+    size_t completed_passes_ = 0;
+
+    size_t blocks_ = 0; // blocks seen by the last serial pass
+    size_t parallel_passes_ = 0;
+    std::vector<Job> jobs_;
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    std::atomic<size_t> next_job_{0};
+    size_t busy_ = 0;
+    uint64_t generation_ = 0;
+    bool stop_ = false;
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "double_linked_list.h"
+#include "gc_info.h"
+#include "size.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+Large objects are not carved from the Memory block list, every one of them gets
+its own page aligned mapping straight from the OS and is unmapped on free.
+Header of the object lives at the start of the mapping, objects are linked
+into the registry of the space.
+*/
+class LargeObject : public DlElt<LargeObject>, public GcInfo {
+public:
+    static const size_t HeaderSize;
+
+    LargeObject(size_t mapping_size, size_t user_size)
+        : mapping_size_{mapping_size}
+        , user_size_{user_size}
+    {}
+
+    void* ToUserData() const {
+        return reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(this) + HeaderSize);
+    }
+
+    static LargeObject& FromUserData(void* ptr) {
+        return *reinterpret_cast<LargeObject*>(reinterpret_cast<uintptr_t>(ptr) - HeaderSize);
+    }
+
+    size_t GetUserDataSize() const { return user_size_; }
+    size_t GetMappingSize() const { return mapping_size_; }
+
+    bool InObject(const void* ptr) const {
+        return ptr >= ToUserData()
+            && reinterpret_cast<uintptr_t>(ptr) < reinterpret_cast<uintptr_t>(ToUserData()) + user_size_;
+    }
+
+private:
+    const size_t mapping_size_;
+    const size_t user_size_;
+};
+
+const size_t LargeObject::HeaderSize{align(sizeof(LargeObject))};
+
+class LargeObjectSpace {
+public:
+    LargeObjectSpace() = default;
+    LargeObjectSpace(const LargeObjectSpace&) = delete;
+    LargeObjectSpace& operator=(const LargeObjectSpace&) = delete;
+
+    ~LargeObjectSpace() {
+        while (first_ != nullptr) {
+            Unmap(*first_);
+        }
+    }
+
+    void* alloc(size_t sz) {
+        const size_t mapping_size = align(LargeObject::HeaderSize + sz, PageSize());
+        void* addr = ::mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            return nullptr;
+        }
+
+        LargeObject& obj = *(new(addr) LargeObject{mapping_size, sz});
+        if (first_ != nullptr) {
+            obj.InsertBelow(*first_);
+        }
+        first_ = &obj;
+
+        lowest_ = lowest_ == 0 ? Begin(obj) : std::min(lowest_, Begin(obj));
+        highest_ = std::max(highest_, Begin(obj) + mapping_size);
+        size_ += mapping_size;
+        ++count_;
+        return obj.ToUserData();
+    }
+
+    void free(void* ptr) {
+        assert(Find(ptr) == &LargeObject::FromUserData(ptr));
+        Unmap(LargeObject::FromUserData(ptr));
+    }
+
+    // object holding ptr (interior pointers too), nullptr if ptr is not in the space
+    LargeObject* Find(const void* ptr) const {
+        const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+        if (addr < lowest_ || addr >= highest_) {
+            return nullptr;
+        }
+        LargeObject* result = nullptr;
+        ForAllObjects([&](LargeObject& obj){
+            if (obj.InObject(ptr)) {
+                result = &obj;
+                return false;
+            }
+            return true;
+        });
+        return result;
+    }
+
+    bool Owns(const void* ptr) const { return Find(ptr) != nullptr; }
+
+    template <typename F>
+    void ForAllObjects(F&& f) const {
+        if (first_ != nullptr) {
+            first_->ForAll(std::move(f));
+        }
+    }
+
+    size_t Size() const { return size_; }
+    size_t Count() const { return count_; }
+
+private:
+    static size_t PageSize() { return static_cast<size_t>(::sysconf(_SC_PAGESIZE)); }
+    static uintptr_t Begin(const LargeObject& obj) { return reinterpret_cast<uintptr_t>(&obj); }
+
+    void Unmap(LargeObject& obj) {
+        if (first_ == &obj) {
+            first_ = obj.HasNext() ? &obj.Next() : nullptr;
+        }
+        obj.Unlink();
+        size_ -= obj.GetMappingSize();
+        --count_;
+        ::munmap(&obj, obj.GetMappingSize());
+    }
+
+    LargeObject* first_ = nullptr;
+    // bounds of all mappings ever made, cheap filter for Find
+    uintptr_t lowest_ = 0;
+    uintptr_t highest_ = 0;
+    size_t size_ = 0;
+    size_t count_ = 0;
+};
+
+std::ostream& operator<<(std::ostream& os, const LargeObject& obj) {
+    os << "Addr: " << std::hex << &obj
+       << ", Size: " << std::dec << obj.GetMappingSize() << " bytes"
+       << (obj.root ? ", Root" : "")
+       << (obj.marked ? ", Marked" : "")
+       << (obj.to_be_checked ? ", ToBeChecked" : "")
+       << (obj.no_pointers ? ", NoPointers" : "")
+       << (obj.sampled ? ", Sampled" : "");
+    return os;
+}
@@ -1,23 +1,57 @@
 #pragma once
 
 #include "block.h"
+#include "fit_policy.h"
+#include "guarded_pool.h"
+#include "large_object_space.h"
 #include "address.h"
 #include "size.h"
 
 #include <tuple>
+#include <algorithm>
+#include <limits>
 #include <memory>
+#include <new>
+#include <vector>
 #include <iostream>
 #include <ios>
 #include <iomanip>
 
-template <typename T>
+template <typename FitPolicy>
+class BasicMemory;
+
+using Memory = BasicMemory<BestFit>;
+
+template <typename T, typename M = Memory>
 class Allocator;
 
-class Memory {
+// gets notified about allocations and frees, e.g. gc pacer or heap profiler
+class MemoryObserver {
+public:
+    virtual ~MemoryObserver() = default;
+
+    // before memory of the given size is searched for
+    virtual void BeforeAlloc(size_t) {}
+    virtual void OnAlloc(void*, size_t) {}
+    // before the object is released
+    virtual void OnFree(void*, size_t) {}
+    // no memory of the given size, returns true if some memory was freed and allocation should be retried
+    virtual bool OnAllocFailure(size_t) { return false; }
+};
+
+/*
+Heap in [lowest_addr, highest_addr). FitPolicy (see fit_policy.h) chooses the free block
+for every allocation, it is a template parameter so the search is inlined.
+*/
+template <typename FitPolicy>
+class BasicMemory {
 public:
     using Address = AddrSpace::Address;
 
-    Memory(void* lowest_addr, void* highest_addr)
+    static const size_t DefaultLargeObjectThreshold = 1 << 20;
+    static const size_t NoLargeObjects = std::numeric_limits<size_t>::max();
+
+    BasicMemory(void* lowest_addr, void* highest_addr)
         : aspace_{lowest_addr, highest_addr}
         , size_{static_cast<size_t>(reinterpret_cast<uintptr_t>(highest_addr) - reinterpret_cast<uintptr_t>(lowest_addr))}
         , free_size_{size_}
@@ -26,6 +60,14 @@ public:
         Block::MakeAtAddress(aspace_.lowest(), size_);
     }
 
+    // attach to blocks already laid out in [lowest_addr, highest_addr), e.g. a mapped heap image
+    BasicMemory(void* lowest_addr, void* highest_addr, size_t free_size, size_t occupied_size)
+        : aspace_{lowest_addr, highest_addr}
+        , size_{static_cast<size_t>(reinterpret_cast<uintptr_t>(highest_addr) - reinterpret_cast<uintptr_t>(lowest_addr))}
+        , free_size_{free_size}
+        , occupied_size_{occupied_size}
+    { }
+
     bool NoOverlappingAndNoHoles() const {
         bool result = true;
         const Block* prev = nullptr;
@@ -53,26 +95,94 @@ public:
         return size_ == SizeOfAllBlocks() && size_ == free_size_ + occupied_size_;
     }
 
+    // result of checking a run of consecutive blocks
+    struct SegmentSummary {
+        bool ok = true;
+        bool reached_end = false;
+        Size size{0};
+        Size free{0};
+        Size occupied{0};
+        size_t blocks = 0;
+        Block* stop = nullptr; // first block that was not checked, nullptr at the end of memory
+    };
+
+    /*
+    Fused check of NoOverlappingAndNoHoles, NoOverruns and block links for blocks
+    starting from `from` till the first block at or above `until` (null address - till the end),
+    but no more than max_blocks blocks.
+    Block header is not dereferenced before it is known to be inside the address space,
+    so a corrupted heap makes the check fail instead of crashing.
+    */
+    SegmentSummary VerifySegment(Block& from, Address until, size_t max_blocks) const {
+        SegmentSummary result;
+        Block* b = &from;
+        if (b->GetAddress() == aspace_.lowest()) {
+            result.ok = !b->HasPrev();
+        }
+        while (result.ok) {
+            if (!(b->GetAddress() >= aspace_.lowest()) || !(b->GetAddress() + Block::HeaderSize <= aspace_.highest())
+                || !(b->GetSize() > Block::HeaderSize)) {
+                result.ok = false;
+                break;
+            }
+            // a huge size wraps around, next block must still be above this one
+            const Address next_addr = b->NextBlockAddress();
+            if (!(next_addr > b->GetAddress()) || !(next_addr <= aspace_.highest())) {
+                result.ok = false;
+                break;
+            }
+
+            result.size = result.size + b->GetSize();
+            if (b->IsFree()) {
+                result.free = result.free + b->GetSize();
+            } else {
+                result.occupied = result.occupied + b->GetSize();
+            }
+            ++result.blocks;
+
+            if (!b->HasNext()) {
+                result.ok = next_addr == aspace_.highest();
+                result.reached_end = true;
+                break;
+            }
+            Block* next = &b->Next();
+            if (next->GetAddress() != next_addr || !(next_addr + Block::HeaderSize <= aspace_.highest()) || &next->Prev() != b) {
+                result.ok = false;
+                break;
+            }
+            if ((!until.IsNull() && next_addr >= until) || result.blocks == max_blocks) {
+                result.stop = next;
+                break;
+            }
+            b = next;
+        }
+        return result;
+    }
+
+    // single pass over all blocks, same properties as the three checks above
     bool MemStructureValid() const {
-        return NoOverlappingAndNoHoles()
-               && NoOverruns()
-               && SumOfBlockSizesIsConstant();
+        const SegmentSummary s = VerifySegment(FirstBlock(), aspace_.null(), std::numeric_limits<size_t>::max());
+        return s.ok
+               && s.reached_end
+               && s.size == size_
+               && s.free == free_size_
+               && s.occupied == occupied_size_;
     }
 
-    Block& FindSuitableForAllocation(Size sz) {
+    Block* FindFreeBlock(Size sz) {
         // sz is aligned and adjusted by block header size
+        return fit_policy_.Find(FirstBlock(), sz);
+    }
+
+    Block* FindLargestFreeBlock() {
         Block* blk = nullptr;
-        ForAllBlocks([&blk, sz](Block& b){
-            if (b.IsFree() && b.GetSize() >= sz) {
-                if (blk == nullptr || blk->GetSize() > b.GetSize()) {
-                    blk = &b;
-                }
+        ForAllBlocks([&blk](Block& b){
+            if (b.IsFree() && (blk == nullptr || blk->GetSize() < b.GetSize())) {
+                blk = &b;
             }
             return true;
         });
-        assert(blk != nullptr);
-        // todo: memory error handling
-        return *blk;
+        return blk;
     }
 
     Block& Split(Block& b, Size sz) { // split block and return first block of pair
@@ -86,6 +196,8 @@ public:
         Size old_sz = b.GetSize();
         Address old_addr = b.GetAddress();
 
+        ++mutations_;
+        fit_policy_.BeforeReplace(b, b);
         b.Replace([&old_sz, &old_addr, &sz] () -> Block& {
             Block& b1{Block::MakeAtAddress(old_addr, sz)};
             Block& b2{Block::MakeAtAddress(b1.NextBlockAddress(), old_sz - sz)};
@@ -100,38 +212,149 @@ public:
 
     Block& Join(Block& b) {
         assert(b.HasNext());
+        return JoinRun(b, b.Next());
+    }
+
+    Block& JoinRun(Block& first, Block& last) { // join all blocks from first to last inclusive
         assert(MemStructureValid());
 
-        Size sz = b.GetSize() + b.Next().GetSize();
-        Address addr = b.GetAddress();
+        Address addr = first.GetAddress();
+        Size sz = last.NextBlockAddress() - addr;
 
-        b.ReplaceTill([&addr, sz]()->Block&{ return Block::MakeAtAddress(addr, sz);}, b.Next());
+        ++mutations_;
+        fit_policy_.BeforeReplace(first, last);
+        first.ReplaceTill([&addr, sz]()->Block&{ return Block::MakeAtAddress(addr, sz);}, last);
 
         assert(MemStructureValid());
 
         return Block::AtAddress(addr);
     }
 
-    void* alloc(size_t sz) {
-        const Size size = (Block::HeaderSize + Size{sz}).Align();
-        Block& block = FindSuitableForAllocation(size);
+    Block& Carve(Block& b, Size sz, size_t count) { // split block into count blocks of size sz and a tail
+        assert(MemStructureValid());
+        assert(b.IsFree());
+
+        // sz is aligned and adjusted by block header size
+        assert(sz > Block::HeaderSize);
+        assert(count > 0);
 
-        assert(block.IsFree());
+        Size old_sz = b.GetSize();
+        Address old_addr = b.GetAddress();
+        assert(old_sz >= sz * count);
+        Size tail = old_sz - sz * count;
+
+        ++mutations_;
+        fit_policy_.BeforeReplace(b, b);
+        b.Replace([&]() -> Block& {
+            Block* prev = nullptr;
+            Address addr = old_addr;
+            for (size_t idx = 0; idx < count; ++idx) {
+                // too small tail is absorbed by the last carved block
+                const bool absorb_tail = idx + 1 == count && !(tail > Block::HeaderSize);
+                Block& blk{Block::MakeAtAddress(addr, absorb_tail ? sz + tail : sz)};
+                if (prev != nullptr) {
+                    blk.InsertAbove(*prev);
+                }
+                prev = &blk;
+                addr = blk.NextBlockAddress();
+            }
+            if (tail > Block::HeaderSize) {
+                Block::MakeAtAddress(addr, tail).InsertAbove(*prev);
+            }
+            return *prev;
+        });
 
-        free_size_ = free_size_ - size;
-        occupied_size_ = occupied_size_ + size;
+        assert(MemStructureValid());
 
-        if (block.GetSize() > size + Block::HeaderSize) {
-            Block& b = Split(block, size);
-            b.SetOccupied(true);
-            return b.ToUserData();
+        return Block::AtAddress(old_addr);
+    }
+
+    // returns nullptr if there is no memory even after observers tried to free some
+    void* alloc(size_t sz) {
+        NotifyBeforeAlloc(sz);
+        void* ptr = guarded_pool_ != nullptr && guarded_pool_->ShouldSample() ? guarded_pool_->alloc(sz) : nullptr;
+        if (ptr == nullptr) {
+            ptr = TryAlloc(sz);
+        }
+        while (ptr == nullptr && NotifyAllocFailure(sz)) {
+            ptr = TryAlloc(sz);
+        }
+        if (ptr != nullptr) {
+            NotifyAlloc(ptr, sz);
+        }
+        return ptr;
+    }
+
+    // memory that never holds pointers, gc does not scan it
+    void* alloc_noscan(size_t sz) {
+        void* ptr = alloc(sz);
+        if (ptr == nullptr) {
+            return ptr;
+        }
+        if (IsInAddrSpace(ptr)) {
+            Block::FromUserData(ptr).no_pointers = true;
         } else {
-            block.SetOccupied(true);
-            return block.ToUserData();
+            LargeObject::FromUserData(ptr).no_pointers = true;
         }
+        return ptr;
+    }
+
+    /*
+    Allocates count objects of sz bytes, carving them from as few free blocks as possible.
+    Returns number of allocated objects, it is less than count only if memory is exhausted.
+    */
+    size_t alloc_batch(size_t sz, size_t count, void** out) {
+        if (sz >= large_object_threshold_) {
+            for (size_t idx = 0; idx < count; ++idx) {
+                if ((out[idx] = alloc(sz)) == nullptr) {
+                    return idx;
+                }
+            }
+            return count;
+        }
+        NotifyBeforeAlloc(sz * count);
+        const Size size = (Block::HeaderSize + Size{sz}).Align();
+        size_t done = 0;
+        while (done < count) {
+            const size_t rest = count - done;
+            Block* blk = FindFreeBlock(size * rest);
+            size_t n = rest;
+            if (blk == nullptr) {
+                // no single block for the whole batch, take as much as possible from the largest one
+                blk = FindLargestFreeBlock();
+                if (blk == nullptr || blk->GetSize() < size) {
+                    if (NotifyAllocFailure(sz * rest)) {
+                        continue;
+                    }
+                    break;
+                }
+                n = blk->GetSize() / size;
+            }
+
+            Block* b = &Carve(*blk, size, n);
+            for (size_t idx = 0; idx < n; ++idx) {
+                Occupy(*b);
+                out[done++] = b->ToUserData();
+                NotifyAlloc(b->ToUserData(), sz);
+                if (b->HasNext()) {
+                    b = &b->Next();
+                }
+            }
+        }
+        return done;
     }
 
     void free(void* ptr) {
+        if (guarded_pool_ != nullptr && guarded_pool_->Contains(ptr)) {
+            FreeGuarded(ptr);
+            return;
+        }
+        if (!IsInAddrSpace(ptr)) {
+            NotifyFree(ptr, LargeObject::FromUserData(ptr).GetUserDataSize());
+            los_.free(ptr);
+            return;
+        }
+
         // check that address is in some block
         Block* blk_ptr = nullptr;
         Address addr = aspace_.address(ptr);
@@ -150,10 +373,8 @@ public:
 
         // check against double free
         assert(!blk.IsFree());
-        blk.SetOccupied(false);
-
-        free_size_ = free_size_ + blk.GetSize();
-        occupied_size_ = occupied_size_ - blk.GetSize();
+        NotifyFree(ptr, blk.GetUserDataSize());
+        Release(blk);
 
         if (blk.HasNext() && blk.Next().IsFree()) {
             Join(blk);
@@ -164,12 +385,95 @@ public:
         }
     }
 
+    // frees n objects at once, ptrs array is sorted in place
+    void free_batch(void** ptrs, size_t n) {
+        if (n == 0) {
+            return;
+        }
+        std::sort(ptrs, ptrs + n);
+
+        if (guarded_pool_ != nullptr) {
+            void** guarded_end = std::stable_partition(ptrs, ptrs + n, [this](void* ptr){ return !guarded_pool_->Contains(ptr); });
+            for (void** ptr = guarded_end; ptr != ptrs + n; ++ptr) {
+                FreeGuarded(*ptr);
+            }
+            n = guarded_end - ptrs;
+        }
+
+        // large objects are unmapped one by one
+        void** small_end = std::stable_partition(ptrs, ptrs + n, [this](void* ptr){ return IsInAddrSpace(ptr); });
+        for (void** ptr = small_end; ptr != ptrs + n; ++ptr) {
+            NotifyFree(*ptr, LargeObject::FromUserData(*ptr).GetUserDataSize());
+            los_.free(*ptr);
+        }
+        n = small_end - ptrs;
+        if (n == 0) {
+            return;
+        }
+
+        // check all pointers against blocks in one walk
+        size_t checked = 0;
+        ForAllBlocks([&](Block& b){
+            while (checked < n && b.InBlock(aspace_.address(ptrs[checked]))) {
+                assert(b.ToUserData() == ptrs[checked]);
+                assert(!b.IsFree());
+                assert(checked == 0 || ptrs[checked] != ptrs[checked - 1]);
+                ++checked;
+            }
+            return checked < n;
+        });
+        assert(checked == n);
+
+        // release blocks and coalesce every run of adjacent free blocks with a single join
+        for (size_t idx = 0; idx < n; ++idx) {
+            NotifyFree(ptrs[idx], Block::FromUserData(ptrs[idx]).GetUserDataSize());
+        }
+        for (size_t idx = 0; idx < n; ++idx) {
+            Block* first = &Block::FromUserData(ptrs[idx]);
+            Release(*first);
+            if (first->HasPrev() && first->Prev().IsFree()) {
+                first = &first->Prev();
+            }
+            Block* last = first;
+            while (last->HasNext()) {
+                Block& next = last->Next();
+                if (idx + 1 < n && next.ToUserData() == ptrs[idx + 1]) {
+                    Release(next);
+                    ++idx;
+                } else if (!next.IsFree()) {
+                    break;
+                }
+                last = &next;
+            }
+            if (first != last) {
+                JoinRun(*first, *last);
+            }
+        }
+    }
+
     size_t MemSize() const { return size_; }
     size_t FreeSize() const { return free_size_; }
     size_t OccupiedSize() const { return occupied_size_; }
+    size_t LargeObjectsSize() const { return los_.Size(); }
+
+    // requests of at least threshold bytes go to large object space
+    void SetLargeObjectThreshold(size_t threshold) { large_object_threshold_ = threshold; }
+    size_t LargeObjectThreshold() const { return large_object_threshold_; }
+
+    const LargeObjectSpace& LargeObjects() const { return los_; }
+
+    // a sample of allocations is served from pool to catch overflows and use-after-free, nullptr turns it off
+    void SetGuardedPool(GuardedPool* pool) { guarded_pool_ = pool; }
+    GuardedPool* GetGuardedPool() const { return guarded_pool_; }
+
+    void AddObserver(MemoryObserver* observer) { observers_.push_back(observer); }
+
+    void RemoveObserver(MemoryObserver* observer) {
+        observers_.erase(std::remove(observers_.begin(), observers_.end(), observer), observers_.end());
+    }
 
     template <typename T>
-    Allocator<T> allocator() {
+    Allocator<T, BasicMemory> allocator() {
         return {*this};
     }
 
@@ -191,7 +495,7 @@ public:
         return result;
     }
 
-    bool IsInAddrSpace(void* addr) {
+    bool IsInAddrSpace(void* addr) const {
         return aspace_.IsInAddrSpace(addr);
     }
 
@@ -210,40 +514,130 @@ public:
     }
 
 private:
+    void* TryAlloc(size_t sz) {
+        if (sz >= large_object_threshold_) {
+            return los_.alloc(sz);
+        }
+        const Size size = (Block::HeaderSize + Size{sz}).Align();
+        Block* block = FindFreeBlock(size);
+        if (block == nullptr) {
+            return nullptr;
+        }
+
+        assert(block->IsFree());
+
+        Block& b = block->GetSize() > size + Block::HeaderSize ? Split(*block, size) : *block;
+        Occupy(b);
+        return b.ToUserData();
+    }
+
+    void FreeGuarded(void* ptr) {
+        NotifyFree(ptr, guarded_pool_->CheckFree(ptr));
+        guarded_pool_->free(ptr);
+    }
+
+    void NotifyBeforeAlloc(size_t sz) {
+        for (MemoryObserver* observer : observers_) {
+            observer->BeforeAlloc(sz);
+        }
+    }
+
+    void NotifyAlloc(void* ptr, size_t sz) {
+        for (MemoryObserver* observer : observers_) {
+            observer->OnAlloc(ptr, sz);
+        }
+    }
+
+    void NotifyFree(void* ptr, size_t sz) {
+        for (MemoryObserver* observer : observers_) {
+            observer->OnFree(ptr, sz);
+        }
+    }
+
+    bool NotifyAllocFailure(size_t sz) {
+        bool retry = false;
+        for (MemoryObserver* observer : observers_) {
+            retry = observer->OnAllocFailure(sz) || retry;
+        }
+        return retry;
+    }
+
+    void Occupy(Block& b) {
+        ++mutations_;
+        b.SetOccupied(true);
+        free_size_ = free_size_ - b.GetSize();
+        occupied_size_ = occupied_size_ + b.GetSize();
+    }
+
+    void Release(Block& b) {
+        ++mutations_;
+        b.SetOccupied(false);
+        // per object flags must not survive into the next object in this block
+        b.no_pointers = false;
+        b.sampled = false;
+        b.zct = false;
+        b.ref_count = 0;
+        free_size_ = free_size_ + b.GetSize();
+        occupied_size_ = occupied_size_ - b.GetSize();
+    }
+
     const AddrSpace aspace_;
     const Size size_;
     Size free_size_;
     Size occupied_size_;
+    uint64_t mutations_ = 0; // changes of block structure, lets verifiers notice concurrent changes
 
-    friend class Gc;
+    LargeObjectSpace los_;
+    size_t large_object_threshold_ = DefaultLargeObjectThreshold;
+
+    std::vector<MemoryObserver*> observers_;
+    GuardedPool* guarded_pool_ = nullptr;
 
-    friend std::ostream& operator<<(std::ostream& os, const Memory& mem);
+    FitPolicy fit_policy_;
+
+    friend class Gc;
+    friend class HeapVerifier;
+    friend class Sweeper;
 };
 
-std::ostream& operator<<(std::ostream& os, const Memory& mem) {
-    os << "=========== MEM DUMP ===========" << std::endl;
-    os << "memory total size: " << mem.MemSize() << std::endl;
-    os << "memory free size: " << mem.FreeSize() << std::endl;
-    os << "memory occupied size: " << mem.OccupiedSize() << std::endl;
-    os << "blocks:" << std::endl;
+template <typename FitPolicy>
+std::ostream& operator<<(std::ostream& os, const BasicMemory<FitPolicy>& mem) {
+    os << "=========== MEM DUMP ===========" << '\n';
+    os << "memory total size: " << mem.MemSize() << '\n';
+    os << "memory free size: " << mem.FreeSize() << '\n';
+    os << "memory occupied size: " << mem.OccupiedSize() << '\n';
+    os << "blocks:" << '\n';
     int idx = 0;
     mem.ForAllBlocks([&idx, &os](const Block& b){
         os << "  " << std::setw(4) << std::right << std::setfill(' ')
-                   << idx++ << ": " << b << std::endl;
+                   << idx++ << ": " << b << '\n';
         return true;
     });
-    os << "--------------------------------" << std::endl;
+    if (mem.LargeObjects().Count() != 0) {
+        os << "large objects size: " << mem.LargeObjectsSize() << '\n';
+        os << "large objects:" << '\n';
+        idx = 0;
+        mem.LargeObjects().ForAllObjects([&idx, &os](const LargeObject& obj){
+            os << "  " << std::setw(4) << std::right << std::setfill(' ')
+                       << idx++ << ": " << obj << '\n';
+            return true;
+        });
+    }
+    os << "--------------------------------" << '\n';
     return os;
 }
 
-template <typename T>
+template <typename T, typename M>
 class Allocator {
-    Memory& memory_;
+    M& memory_;
+
+    template <typename U, typename N>
+    friend class Allocator;
 public:
-    Allocator(Memory& memory) : memory_{memory} {}
+    Allocator(M& memory) : memory_{memory} {}
 
     template <typename U>
-    Allocator(const Allocator<U>& a) : memory_{a.memory_} {}
+    Allocator(const Allocator<U, M>& a) : memory_{a.memory_} {}
 
     typedef T value_type;
     typedef size_t size_type;
@@ -251,14 +645,37 @@ public:
     typedef const T* const_pointer;
 
     pointer allocate(size_type n) {
-        return reinterpret_cast<pointer>(memory_.alloc(n * sizeof(T)));
+        void* ptr = memory_.alloc(n * sizeof(T));
+        if (ptr == nullptr) {
+            throw std::bad_alloc{};
+        }
+        return reinterpret_cast<pointer>(ptr);
     }
 
     void deallocate(pointer p, size_type n) {
         memory_.free(p);
     }
 
+    // count arrays of n objects each
+    void allocate_batch(size_type n, size_type count, pointer* out) {
+        const size_type done = memory_.alloc_batch(n * sizeof(T), count, reinterpret_cast<void**>(out));
+        if (done != count) {
+            memory_.free_batch(reinterpret_cast<void**>(out), done);
+            throw std::bad_alloc{};
+        }
+    }
+
+    void deallocate_batch(pointer* ps, size_type count) {
+        memory_.free_batch(reinterpret_cast<void**>(ps), count);
+    }
+
     size_type max_size() { return memory_.FreeSize(); }
 
+    template <typename U>
+    bool operator==(const Allocator<U, M>& rhs) const { return &memory_ == &rhs.memory_; }
+
+    template <typename U>
+    bool operator!=(const Allocator<U, M>& rhs) const { return !(*this == rhs); }
+
     ~Allocator() = default;
 };
@@ -0,0 +1,194 @@
+#pragma once
+
+#include "memory.h"
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+Heap backed by a memory-mapped file.
+
+Block links are offsets (see DlElt), so the image does not depend on the address
+it is mapped at and reopening it is just mmap, without any deserialization.
+Large objects would live outside of the image, so large object space is disabled.
+User data is stored as is, so objects in the heap must refer to each other by
+offsets too (see ToOffset/FromOffset).
+
+The image starts with a page holding HeapImage, the heap itself follows it.
+*/
+class PersistentHeap {
+public:
+    static constexpr uint64_t Magic = 0x5041454854534550ull;
+    static constexpr uint32_t Version = 1;
+
+    struct HeapImage {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t clean; // image was closed properly, counters below are valid
+        uint64_t size;
+        uint64_t free_size;
+        uint64_t occupied_size;
+        uint64_t root; // offset of user root object, 0 if not set
+    };
+
+    PersistentHeap(const PersistentHeap&) = delete;
+    PersistentHeap& operator=(const PersistentHeap&) = delete;
+
+    ~PersistentHeap() {
+        Close();
+    }
+
+    // creates new heap image of heap_size bytes, existing file is truncated
+    static std::unique_ptr<PersistentHeap> Create(const std::string& path, size_t heap_size) {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return nullptr;
+        }
+        const size_t file_size = HeaderSize() + align(heap_size, PageSize());
+        if (::ftruncate(fd, file_size) != 0) {
+            ::close(fd);
+            return nullptr;
+        }
+        std::unique_ptr<PersistentHeap> heap{new PersistentHeap{fd, file_size}};
+        if (!heap->Mapped()) {
+            return nullptr;
+        }
+        HeapImage& img = heap->Image();
+        img.magic = Magic;
+        img.version = Version;
+        img.clean = 0;
+        img.size = file_size - HeaderSize();
+        img.root = 0;
+        heap->memory_.reset(new Memory{heap->HeapBegin(), heap->HeapEnd()});
+        heap->memory_->SetLargeObjectThreshold(Memory::NoLargeObjects);
+        heap->Sync();
+        return heap;
+    }
+
+    // maps existing image, O(1) after a clean close unless verify is requested;
+    // after a crash counters are recomputed and memory structure is checked
+    static std::unique_ptr<PersistentHeap> Open(const std::string& path, bool verify = false) {
+        int fd = ::open(path.c_str(), O_RDWR);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) <= HeaderSize()) {
+            ::close(fd);
+            return nullptr;
+        }
+        std::unique_ptr<PersistentHeap> heap{new PersistentHeap{fd, static_cast<size_t>(st.st_size)}};
+        if (!heap->Mapped()) {
+            return nullptr;
+        }
+        HeapImage& img = heap->Image();
+        if (img.magic != Magic || img.version != Version || img.size != heap->file_size_ - HeaderSize()) {
+            return nullptr;
+        }
+
+        const bool clean = img.clean != 0;
+        if (!clean) {
+            if (!heap->Recount()) {
+                return nullptr;
+            }
+        }
+        heap->memory_.reset(new Memory{heap->HeapBegin(), heap->HeapEnd(),
+                                       static_cast<size_t>(img.free_size),
+                                       static_cast<size_t>(img.occupied_size)});
+        heap->memory_->SetLargeObjectThreshold(Memory::NoLargeObjects);
+        if ((verify || !clean) && !heap->memory_->MemStructureValid()) {
+            return nullptr;
+        }
+
+        // image is dirty while it is open
+        img.clean = 0;
+        ::msync(heap->base_, HeaderSize(), MS_SYNC);
+        return heap;
+    }
+
+    Memory& memory() { return *memory_; }
+
+    void SetRoot(void* obj) { Image().root = obj == nullptr ? 0 : ToOffset(obj); }
+    void* GetRoot() { return Image().root == 0 ? nullptr : FromOffset(Image().root); }
+
+    // position independent references to objects inside the heap
+    uint64_t ToOffset(const void* ptr) const {
+        assert(ptr >= base_ && ptr < HeapEnd());
+        return reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(base_);
+    }
+
+    void* FromOffset(uint64_t offset) const {
+        assert(offset >= HeaderSize() && offset < file_size_);
+        return reinterpret_cast<char*>(base_) + offset;
+    }
+
+    // flushes heap and counters to the file, image stays dirty until Close
+    void Sync() {
+        HeapImage& img = Image();
+        img.free_size = memory_->FreeSize();
+        img.occupied_size = memory_->OccupiedSize();
+        ::msync(base_, file_size_, MS_SYNC);
+    }
+
+    void Close() {
+        if (!Mapped()) {
+            return;
+        }
+        if (memory_) {
+            Sync();
+            Image().clean = 1;
+            ::msync(base_, HeaderSize(), MS_SYNC);
+            memory_.reset();
+        }
+        ::munmap(base_, file_size_);
+        ::close(fd_);
+        base_ = nullptr;
+    }
+
+private:
+    PersistentHeap(int fd, size_t file_size)
+        : fd_{fd}
+        , file_size_{file_size}
+    {
+        void* base = ::mmap(nullptr, file_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (base == MAP_FAILED) {
+            ::close(fd_);
+        } else {
+            base_ = base;
+        }
+    }
+
+    static size_t PageSize() { return static_cast<size_t>(::sysconf(_SC_PAGESIZE)); }
+    static size_t HeaderSize() { return align(sizeof(HeapImage), PageSize()); }
+
+    bool Mapped() const { return base_ != nullptr; }
+    HeapImage& Image() const { return *reinterpret_cast<HeapImage*>(base_); }
+    void* HeapBegin() const { return reinterpret_cast<char*>(base_) + HeaderSize(); }
+    void* HeapEnd() const { return reinterpret_cast<char*>(base_) + file_size_; }
+
+    // recomputes counters with the bounds checked walk of Memory::VerifySegment,
+    // so a torn link or size makes Open fail instead of crashing
+    bool Recount() {
+        const AddrSpace aspace{HeapBegin(), HeapEnd()};
+        const Memory probe{HeapBegin(), HeapEnd(), 0, 0};
+        const Memory::SegmentSummary s = probe.VerifySegment(probe.FirstBlock(), aspace.null(), std::numeric_limits<size_t>::max());
+        if (!s.ok || !s.reached_end || static_cast<size_t>(s.size) != Image().size) {
+            return false;
+        }
+        Image().free_size = static_cast<size_t>(s.free);
+        Image().occupied_size = static_cast<size_t>(s.occupied);
+        return true;
+    }
+
+    int fd_;
+    size_t file_size_;
+    void* base_ = nullptr;
+    std::unique_ptr<Memory> memory_;
+};
@@ -0,0 +1,203 @@
+#pragma once
+
+#include "memory.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+Returns memory of big free blocks to the OS, so the resident size of the heap follows
+its live size after a spike instead of staying at the peak.
+
+Every pass walks the blocks and gives whole pages inside free blocks of at least
+min_free_block bytes back with madvise; the page with the block header and the page
+with the header of the next block stay. Pages given back are remembered in a bitmap
+(one bit per page of the heap). The OS maps them again, zero filled or with old content
+for MADV_FREE, on the first touch: when a block laid over them is allocated (alloc,
+Split of the free remainder writes its header there) its pages are counted as
+refaulted and leave the bitmap.
+
+Passes are run by Scavenge with the heap lock held, or by a background thread every
+period (Start), the thread takes the heap lock for a pass.
+
+    std::mutex heap_mutex;
+    Scavenger scavenger{mem, heap_mutex};
+    scavenger.Start(std::chrono::milliseconds{100});
+*/
+class Scavenger : public MemoryObserver {
+public:
+    static const size_t DefaultMinFreeBlock = 64 * 1024;
+
+    enum class Advice { DontNeed, Free };
+
+    Scavenger(Memory& mem, std::mutex& heap_mutex, size_t min_free_block = DefaultMinFreeBlock, Advice advice = Advice::DontNeed)
+        : memory_{mem}
+        , heap_mutex_{heap_mutex}
+        , min_free_block_{min_free_block}
+        , advice_{advice}
+        , page_size_{static_cast<size_t>(::sysconf(_SC_PAGESIZE))}
+        , first_page_{reinterpret_cast<uintptr_t>(&mem.FirstBlock()) / page_size_ * page_size_}
+        , pages_{(reinterpret_cast<uintptr_t>(&mem.FirstBlock()) + mem.MemSize() - first_page_ + page_size_ - 1) / page_size_}
+        , decommitted_((pages_ + 63) / 64, 0)
+    {
+        memory_.AddObserver(this);
+    }
+
+    Scavenger(const Scavenger&) = delete;
+    Scavenger& operator=(const Scavenger&) = delete;
+
+    ~Scavenger() {
+        Stop();
+        memory_.RemoveObserver(this);
+    }
+
+    // heap lock held, returns bytes given back by this pass
+    size_t Scavenge() {
+        size_t released = 0;
+        memory_.ForAllBlocks([&](const Block& blk){
+            const uintptr_t begin = reinterpret_cast<uintptr_t>(&blk);
+            const size_t size = blk.GetUserDataSize() + align(sizeof(Block));
+            if (!blk.IsFree() || size < min_free_block_) {
+                return true;
+            }
+            // pages of this block header and of the next block header are kept
+            size_t page = PageOf(begin + align(sizeof(Block)) + page_size_ - 1);
+            const size_t end = PageOf(begin + size);
+            while (page < end) {
+                if (IsDecommitted(page)) {
+                    ++page;
+                    continue;
+                }
+                const size_t run_begin = page;
+                while (page < end && !IsDecommitted(page)) {
+                    SetDecommitted(page, true);
+                    ++page;
+                }
+                Release(run_begin, page);
+                released += (page - run_begin) * page_size_;
+            }
+            return true;
+        });
+        decommitted_pages_ += released / page_size_;
+        released_bytes_ += released;
+        ++passes_;
+        return released;
+    }
+
+    // runs a pass every period on a background thread
+    void Start(std::chrono::milliseconds period) {
+        Stop();
+        stop_ = false;
+        period_ = period;
+        thread_ = std::thread{[this](){ Run(); }};
+    }
+
+    void Stop() {
+        if (!thread_.joinable()) {
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock{heap_mutex_};
+            stop_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+
+    void OnAlloc(void* ptr, size_t) override {
+        if (decommitted_pages_ == 0 || !memory_.IsInAddrSpace(ptr)) {
+            return;
+        }
+        // the block and the header of the free remainder split off after it are written
+        const Block& blk = Block::FromUserData(ptr);
+        const uintptr_t begin = reinterpret_cast<uintptr_t>(&blk);
+        const uintptr_t end = begin + blk.GetUserDataSize() + 2 * align(sizeof(Block));
+        const size_t last = std::min(PageOf(end - 1), pages_ - 1);
+        for (size_t page = PageOf(begin); page <= last; ++page) {
+            if (IsDecommitted(page)) {
+                SetDecommitted(page, false);
+                --decommitted_pages_;
+                refaulted_bytes_ += page_size_;
+            }
+        }
+    }
+
+    size_t DecommittedBytes() const { return decommitted_pages_ * page_size_; }
+    size_t ReleasedBytes() const { return released_bytes_; }
+    size_t RefaultedBytes() const { return refaulted_bytes_; }
+    size_t Passes() const { return passes_; }
+
+    // resident bytes of [begin, begin + size) by mincore
+    static size_t ResidentBytes(const void* begin, size_t size) {
+        const size_t page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        const uintptr_t first = reinterpret_cast<uintptr_t>(begin) / page_size * page_size;
+        const size_t pages = (reinterpret_cast<uintptr_t>(begin) + size - first + page_size - 1) / page_size;
+        std::vector<unsigned char> resident(pages);
+        if (::mincore(reinterpret_cast<void*>(first), pages * page_size, resident.data()) != 0) {
+            return 0;
+        }
+        size_t result = 0;
+        for (unsigned char page : resident) {
+            result += (page & 1) ? page_size : 0;
+        }
+        return result;
+    }
+
+private:
+    size_t PageOf(uintptr_t addr) const { return (addr - first_page_) / page_size_; }
+
+    bool IsDecommitted(size_t page) const {
+        return (decommitted_[page / 64] >> (page % 64)) & 1;
+    }
+
+    void SetDecommitted(size_t page, bool decommitted) {
+        const uint64_t bit = uint64_t{1} << (page % 64);
+        decommitted_[page / 64] = decommitted ? decommitted_[page / 64] | bit : decommitted_[page / 64] & ~bit;
+    }
+
+    void Release(size_t first, size_t last) {
+        void* addr = reinterpret_cast<void*>(first_page_ + first * page_size_);
+        const size_t len = (last - first) * page_size_;
+        int rc = ::madvise(addr, len, advice_ == Advice::Free ? MADV_FREE : MADV_DONTNEED);
+        assert(rc == 0);
+        (void)rc;
+    }
+
+    void Run() {
+        std::unique_lock<std::mutex> lock{heap_mutex_};
+        while (!stop_) {
+            if (!cv_.wait_for(lock, period_, [this](){ return stop_; })) {
+                Scavenge();
+            }
+        }
+    }
+
+    Memory& memory_;
+    std::mutex& heap_mutex_;
+    const size_t min_free_block_;
+    const Advice advice_;
+    const size_t page_size_;
+    const uintptr_t first_page_;
+    const size_t pages_;
+
+    std::vector<uint64_t> decommitted_;
+    // written under the heap lock, statistics are read without it
+    std::atomic<size_t> decommitted_pages_{0};
+    std::atomic<size_t> released_bytes_{0};
+    std::atomic<size_t> refaulted_bytes_{0};
+    std::atomic<size_t> passes_{0};
+
+    std::thread thread_;
+    std::condition_variable cv_;
+    std::chrono::milliseconds period_{0};
+    bool stop_ = false;
+};
@@ -29,13 +29,16 @@ public:
 
     Size operator+(const Size& s) const { return {sz_ + s.sz_}; }
     Size operator-(const Size& s) const { assert(sz_ >= s.sz_); return {sz_ - s.sz_}; }
+    Size operator*(size_t n) const { return {sz_ * n}; }
+    size_t operator/(const Size& s) const { assert(s.sz_ != 0); return sz_ / s.sz_; }
+    Size operator/(size_t n) const { assert(n != 0); return {sz_ / n}; }
 
     bool operator==(const Size& s) const { return sz_ == s.sz_; }
     bool operator!=(const Size& s) const { return sz_ != s.sz_; }
     bool operator>(const Size& s) const { return sz_ > s.sz_; }
     bool operator>=(const Size& s) const { return sz_ >= s.sz_; }
     bool operator<(const Size& s) const { return sz_ < s.sz_; }
-    bool operator<=(const Size& s) const { return sz_ >= s.sz_; }
+    bool operator<=(const Size& s) const { return sz_ <= s.sz_; }
 
     static const Size zero;
     static const Size max;
@@ -52,8 +55,10 @@ private:
     operator size_t() const { return sz_; }
 
     friend class AddrSpace;
-    friend class Memory;
+    template <typename FitPolicy>
+    friend class BasicMemory;
     friend class Block;
+    friend class PersistentHeap;
     friend std::ostream& operator<<(std::ostream& os, const Size& sz);
 };
 
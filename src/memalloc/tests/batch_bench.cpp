@@ -0,0 +1,93 @@
+#include "memory.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <cassert>
+#include <cstddef>
+
+/*
+Batch API against one call per object: count objects are allocated and freed again,
+in a heap that already holds long lived objects with holes between them.
+
+    single  - alloc and free for every object
+    batch   - one alloc_batch and one free_batch
+
+Time per object is reported.
+*/
+
+static const size_t pool_size = 16 << 20;
+static const size_t live_objects = 2000;
+static const size_t object_size = 32;
+static const size_t rounds = 20;
+
+static char mempool[pool_size];
+
+template <class F>
+double Measure(F&& f) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+// every other object is freed, so the heap has live_objects / 2 small holes
+void Prepare(Memory& mem) {
+    std::vector<void*> live(live_objects);
+    for (void*& obj : live) {
+        obj = mem.alloc(object_size);
+        assert(obj != nullptr);
+    }
+    for (size_t idx = 0; idx < live.size(); idx += 2) {
+        mem.free(live[idx]);
+    }
+}
+
+void Run(size_t count) {
+    Memory mem{mempool, &mempool[pool_size]};
+    Prepare(mem);
+    std::vector<void*> objs(count);
+
+    double single_alloc = 0;
+    double single_free = 0;
+    double batch_alloc = 0;
+    double batch_free = 0;
+    for (size_t round = 0; round < rounds; ++round) {
+        single_alloc += Measure([&](){
+            for (void*& obj : objs) {
+                obj = mem.alloc(object_size);
+            }
+        });
+        single_free += Measure([&](){
+            for (void* obj : objs) {
+                mem.free(obj);
+            }
+        });
+
+        size_t done = 0;
+        batch_alloc += Measure([&](){
+            done = mem.alloc_batch(object_size, count, objs.data());
+        });
+        assert(done == count);
+        batch_free += Measure([&](){
+            mem.free_batch(objs.data(), done);
+        });
+    }
+
+    const double per_object = 1.0 / (rounds * count);
+    std::cout << std::setw(8) << count
+              << std::setw(14) << std::fixed << std::setprecision(1) << single_alloc * per_object
+              << std::setw(14) << batch_alloc * per_object
+              << std::setw(14) << single_free * per_object
+              << std::setw(14) << batch_free * per_object
+              << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::cout << "   count  alloc ns/obj  batch ns/obj   free ns/obj  batch ns/obj" << std::endl;
+    for (size_t count : {16, 256, 4096}) {
+        Run(count);
+    }
+    return 0;
+}
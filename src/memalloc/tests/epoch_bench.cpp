@@ -0,0 +1,126 @@
+#include "epoch.h"
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cstddef>
+
+/*
+Stack under contention: every thread pushes and pops in turn, each push allocates a node in Memory.
+
+    locked  - stack and Memory behind one mutex, pop frees the node right away
+    epoch   - Treiber stack, popped nodes are retired and freed in batches by EpochManager
+
+Time per operation and the number of calls to Memory::free_batch are reported.
+*/
+
+static const size_t pool_size = 16 << 20;
+static const size_t ops_per_thread = 200000;
+static const size_t prefill = 1000;
+
+static char mempool[pool_size];
+
+struct Node {
+    size_t value;
+    Node* next;
+};
+
+double LockedStack(size_t threads) {
+    Memory mem{mempool, &mempool[pool_size]};
+    std::mutex mutex;
+    Node* head = nullptr;
+    auto push = [&](size_t value){
+        std::lock_guard<std::mutex> lock{mutex};
+        Node* node = static_cast<Node*>(mem.alloc(sizeof(Node)));
+        node->value = value;
+        node->next = head;
+        head = node;
+    };
+    for (size_t idx = 0; idx < prefill; ++idx) {
+        push(idx);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (size_t id = 0; id < threads; ++id) {
+        workers.emplace_back([&](){
+            for (size_t op = 0; op < ops_per_thread; ++op) {
+                if (op % 2 == 0) {
+                    push(op);
+                } else {
+                    std::lock_guard<std::mutex> lock{mutex};
+                    if (Node* top = head) {
+                        head = top->next;
+                        mem.free(top);
+                    }
+                }
+            }
+        });
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / (threads * ops_per_thread);
+}
+
+double EpochStack(size_t threads, size_t& batches) {
+    Memory mem{mempool, &mempool[pool_size]};
+    EpochManager ebr{mem};
+    std::atomic<Node*> head{nullptr};
+    auto push = [&](size_t value){
+        Node* node = static_cast<Node*>(ebr.Alloc(sizeof(Node)));
+        node->value = value;
+        node->next = head.load(std::memory_order_relaxed);
+        while (!head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed)) { }
+    };
+    for (size_t idx = 0; idx < prefill; ++idx) {
+        push(idx);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (size_t id = 0; id < threads; ++id) {
+        workers.emplace_back([&](){
+            auto& self = ebr.Register();
+            for (size_t op = 0; op < ops_per_thread; ++op) {
+                EpochGuard guard{self};
+                if (op % 2 == 0) {
+                    push(op);
+                } else {
+                    Node* top = head.load(std::memory_order_acquire);
+                    while (top != nullptr && !head.compare_exchange_weak(top, top->next, std::memory_order_acquire)) { }
+                    if (top != nullptr) {
+                        self.Retire(top);
+                    }
+                }
+            }
+            ebr.Unregister(self);
+        });
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    batches = ebr.FreeBatches();
+    return std::chrono::duration<double, std::nano>(elapsed).count() / (threads * ops_per_thread);
+}
+
+int main(int argc, char** argv) {
+    std::cout << "threads   locked ns/op    epoch ns/op   free batches" << std::endl;
+    for (size_t threads : {1, 2, 4, 8}) {
+        size_t batches = 0;
+        const double locked = LockedStack(threads);
+        const double epoch = EpochStack(threads, batches);
+        std::cout << std::setw(7) << threads
+                  << std::setw(15) << std::fixed << std::setprecision(1) << locked
+                  << std::setw(15) << epoch
+                  << std::setw(15) << batches << std::endl;
+    }
+    return 0;
+}
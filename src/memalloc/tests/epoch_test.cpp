@@ -0,0 +1,142 @@
+#include "epoch.h"
+
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <cassert>
+#include <cstddef>
+
+static const size_t pool_size = 1 << 18;
+
+static char mempool[pool_size];
+
+// retired object stays allocated while a critical section that could see it is open
+void TestGracePeriod() {
+    Memory mem{mempool, &mempool[pool_size]};
+    {
+        EpochManager ebr{mem, 1};
+        auto& reader = ebr.Register();
+        auto& writer = ebr.Register();
+
+        void* obj = ebr.Alloc(64);
+        const size_t occupied = mem.OccupiedSize();
+        {
+            EpochGuard guard{reader};
+            writer.Retire(obj);
+            // reader has seen the epoch of retirement, epoch moves once and stops
+            for (int i = 0; i < 10; ++i) {
+                ebr.TryAdvance();
+                writer.Reclaim();
+            }
+            assert(writer.Pending() == 1);
+            assert(mem.OccupiedSize() == occupied);
+        }
+        assert(ebr.TryAdvance());
+        writer.Reclaim();
+        assert(writer.Pending() == 0);
+        assert(mem.OccupiedSize() == 0);
+        assert(ebr.Freed() == 1);
+
+        ebr.Unregister(reader);
+        ebr.Unregister(writer);
+    }
+    assert(mem.MemStructureValid());
+    std::cout << "grace period ok" << std::endl;
+}
+
+// retired objects are freed in batches, leftovers of unregistered threads too
+void TestBatches() {
+    Memory mem{mempool, &mempool[pool_size]};
+    {
+        EpochManager ebr{mem, 16};
+        auto& self = ebr.Register();
+        for (int i = 0; i < 1000; ++i) {
+            EpochGuard guard{self};
+            void* obj = ebr.Alloc(32);
+            assert(obj != nullptr);
+            self.Retire(obj);
+        }
+        assert(ebr.Freed() > 0);
+        assert(ebr.FreeBatches() < ebr.Freed());
+        ebr.Unregister(self);
+
+        // record is reused, orphans are freed with its next batch
+        auto& again = ebr.Register();
+        assert(&again == &self);
+        for (int i = 0; i < 64; ++i) {
+            again.Retire(ebr.Alloc(32));
+        }
+        ebr.Unregister(again);
+        std::cout << "freed " << ebr.Freed() << " objects in " << ebr.FreeBatches() << " batches, "
+                  << ebr.Advances() << " epochs" << std::endl;
+    }
+    assert(mem.OccupiedSize() == 0);
+    assert(mem.MemStructureValid());
+}
+
+struct Node {
+    size_t value;
+    Node* next;
+};
+
+// threads pop nodes of a shared lock-free stack and push new ones, popped nodes are retired
+void TestStack() {
+    static const size_t threads = 4;
+    static const size_t ops = 5000;
+    Memory mem{mempool, &mempool[pool_size]};
+    {
+        EpochManager ebr{mem};
+        std::atomic<Node*> head{nullptr};
+        std::atomic<size_t> sum_pushed{0};
+        std::atomic<size_t> sum_popped{0};
+
+        std::vector<std::thread> workers;
+        for (size_t id = 0; id < threads; ++id) {
+            workers.emplace_back([&, id](){
+                auto& self = ebr.Register();
+                for (size_t op = 0; op < ops; ++op) {
+                    EpochGuard guard{self};
+                    if (op % 2 == 0) {
+                        Node* node = static_cast<Node*>(ebr.Alloc(sizeof(Node)));
+                        assert(node != nullptr);
+                        node->value = id * ops + op;
+                        node->next = head.load();
+                        while (!head.compare_exchange_weak(node->next, node)) { }
+                        sum_pushed += node->value;
+                    } else {
+                        Node* top = head.load();
+                        while (top != nullptr && !head.compare_exchange_weak(top, top->next)) { }
+                        if (top != nullptr) {
+                            sum_popped += top->value;
+                            self.Retire(top);
+                        }
+                    }
+                }
+                ebr.Unregister(self);
+            });
+        }
+        for (auto& t : workers) {
+            t.join();
+        }
+
+        auto& self = ebr.Register();
+        for (Node* top = head.load(); top != nullptr; top = top->next) {
+            sum_popped += top->value;
+            self.Retire(top);
+        }
+        ebr.Unregister(self);
+        assert(sum_pushed == sum_popped);
+    }
+    assert(mem.OccupiedSize() == 0);
+    assert(mem.MemStructureValid());
+    std::cout << "stack ok" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    TestGracePeriod();
+    TestBatches();
+    TestStack();
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include "memory.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+
+/*
+Replays allocation traces against every fit policy, reports time per operation and fragmentation.
+
+Trace is a text file, one operation per line:
+    a <id> <size>   allocate size bytes as object id
+    f <id>          free object id
+Traces are given on the command line; without arguments synthetic workloads are generated,
+"fitbench -w dir" writes them to dir for later editing or replay.
+
+Fragmentation is 1 - largest free block / free size, sampled over the run, maximum is reported.
+*/
+
+static const size_t pool_size = 16 << 20;
+static const size_t fragmentation_period = 1000;
+
+struct Op {
+    bool alloc;
+    size_t id;
+    size_t size;
+};
+
+struct Trace {
+    std::string name;
+    std::vector<Op> ops;
+    size_t objects = 0;
+};
+
+struct Result {
+    double ns_per_op = 0;
+    double max_fragmentation = 0;
+    size_t failures = 0;
+};
+
+bool Read(const char* path, Trace& trace) {
+    std::ifstream is{path};
+    if (!is) {
+        return false;
+    }
+    trace.name = path;
+    char kind;
+    Op op{};
+    while (is >> kind >> op.id) {
+        op.alloc = kind == 'a';
+        if (op.alloc && !(is >> op.size)) {
+            return false;
+        }
+        trace.objects = std::max(trace.objects, op.id + 1);
+        trace.ops.push_back(op);
+    }
+    return is.eof();
+}
+
+bool Write(const std::string& path, const Trace& trace) {
+    std::ofstream os{path};
+    for (const Op& op : trace.ops) {
+        if (op.alloc) {
+            os << "a " << op.id << ' ' << op.size << '\n';
+        } else {
+            os << "f " << op.id << '\n';
+        }
+    }
+    return static_cast<bool>(os);
+}
+
+// objects live for a random number of later allocations, sizes from size()
+template <typename SizeGen>
+Trace Generate(const char* name, size_t count, size_t max_lifetime, SizeGen&& size) {
+    std::mt19937 random{42};
+    std::vector<std::vector<size_t>> deaths(count + max_lifetime + 1);
+    Trace trace{name, {}, 0};
+    for (size_t id = 0; id < count; ++id) {
+        for (size_t dead : deaths[id]) {
+            trace.ops.push_back({false, dead, 0});
+        }
+        trace.ops.push_back({true, id, size(random, id)});
+        deaths[id + 1 + random() % max_lifetime].push_back(id);
+    }
+    trace.objects = count;
+    return trace;
+}
+
+std::vector<Trace> Synthetic() {
+    std::vector<Trace> traces;
+    traces.push_back(Generate("uniform", 200000, 2000, [](std::mt19937& r, size_t){
+        return 16 + r() % 1024;
+    }));
+    // many short lived small objects with some long lived big ones
+    traces.push_back(Generate("bimodal", 200000, 4000, [](std::mt19937& r, size_t){
+        return r() % 16 == 0 ? 4096 + r() % 16384 : 16 + r() % 64;
+    }));
+    // object size grows over time, old holes are too small for new objects
+    traces.push_back(Generate("ramp", 200000, 2000, [](std::mt19937& r, size_t id){
+        return 16 + id / 256 + r() % 64;
+    }));
+    return traces;
+}
+
+template <typename FitPolicy>
+Result Replay(const Trace& trace) {
+    std::unique_ptr<char[]> pool{new char[pool_size]};
+    BasicMemory<FitPolicy> mem{pool.get(), pool.get() + pool_size};
+    mem.SetLargeObjectThreshold(Memory::NoLargeObjects);
+    std::vector<void*> objects(trace.objects, nullptr);
+
+    Result result;
+    double elapsed = 0;
+    for (size_t idx = 0; idx < trace.ops.size(); idx += fragmentation_period) {
+        const size_t end = std::min(idx + fragmentation_period, trace.ops.size());
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t op = idx; op < end; ++op) {
+            const Op& o = trace.ops[op];
+            if (o.alloc) {
+                objects[o.id] = mem.alloc(o.size);
+                result.failures += objects[o.id] == nullptr;
+            } else if (objects[o.id] != nullptr) {
+                mem.free(objects[o.id]);
+                objects[o.id] = nullptr;
+            }
+        }
+        elapsed += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+        const Block* largest = mem.FindLargestFreeBlock();
+        if (largest != nullptr) {
+            const double fragmentation = 1.0 - double(largest->GetUserDataSize()) / mem.FreeSize();
+            result.max_fragmentation = std::max(result.max_fragmentation, fragmentation);
+        }
+    }
+    result.ns_per_op = elapsed / trace.ops.size();
+    return result;
+}
+
+template <typename FitPolicy>
+void Report(const char* policy, const Trace& trace) {
+    const Result r = Replay<FitPolicy>(trace);
+    std::cout << std::setw(12) << trace.name
+              << std::setw(12) << policy
+              << std::setw(12) << std::fixed << std::setprecision(1) << r.ns_per_op
+              << std::setw(12) << std::setprecision(3) << r.max_fragmentation
+              << std::setw(10) << r.failures
+              << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::vector<Trace> traces;
+    if (argc == 3 && std::string{argv[1]} == "-w") {
+        for (const Trace& trace : Synthetic()) {
+            if (!Write(std::string{argv[2]} + "/" + trace.name + ".trace", trace)) {
+                std::cerr << "cannot write " << trace.name << std::endl;
+                return 1;
+            }
+        }
+        return 0;
+    }
+    if (argc > 1) {
+        for (int idx = 1; idx < argc; ++idx) {
+            traces.emplace_back();
+            if (!Read(argv[idx], traces.back())) {
+                std::cerr << "cannot read trace " << argv[idx] << std::endl;
+                return 1;
+            }
+        }
+    } else {
+        traces = Synthetic();
+    }
+
+    std::cout << "       trace      policy       ns/op    max frag  failures" << std::endl;
+    for (const Trace& trace : traces) {
+        Report<BestFit>("best", trace);
+        Report<FirstFit>("first", trace);
+        Report<NextFit>("next", trace);
+        Report<GoodFit<>>("good", trace);
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include "memory.h"
+
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <cassert>
+#include <cstddef>
+
+static const size_t pool_size = 1 << 16;
+
+static char mempool[pool_size];
+
+// holes of 256 and 128 bytes between occupied blocks, big free tail after them
+template <typename FitPolicy>
+void MakeHoles(BasicMemory<FitPolicy>& mem, void** objs) {
+    objs[0] = mem.alloc(64);
+    objs[1] = mem.alloc(256);
+    objs[2] = mem.alloc(64);
+    objs[3] = mem.alloc(128);
+    objs[4] = mem.alloc(64);
+    mem.free(objs[1]);
+    mem.free(objs[3]);
+}
+
+void TestChoice() {
+    void* objs[5];
+    {
+        BasicMemory<BestFit> mem{mempool, &mempool[pool_size]};
+        MakeHoles(mem, objs);
+        assert(mem.alloc(100) == objs[3]);
+    }
+    {
+        BasicMemory<FirstFit> mem{mempool, &mempool[pool_size]};
+        MakeHoles(mem, objs);
+        assert(mem.alloc(100) == objs[1]);
+    }
+    {
+        // 128 bytes hole fits exactly, search stops there
+        BasicMemory<GoodFit<>> mem{mempool, &mempool[pool_size]};
+        MakeHoles(mem, objs);
+        assert(mem.alloc(128) == objs[3]);
+        assert(mem.alloc(100) == objs[1]);
+    }
+    {
+        BasicMemory<NextFit> mem{mempool, &mempool[pool_size]};
+        MakeHoles(mem, objs);
+        // search continues after the last allocated block, holes before it are not used
+        void* ptr = mem.alloc(32);
+        assert(ptr > objs[4]);
+        void* next = mem.alloc(32);
+        assert(next > ptr);
+        // wraps around when the tail is exhausted
+        void* tail = mem.alloc(mem.FindLargestFreeBlock()->GetUserDataSize());
+        assert(tail != nullptr);
+        assert(mem.alloc(32) == objs[1]);
+        // rover stays valid when its block is joined with neighbours
+        mem.free(tail);
+        mem.free(next);
+        mem.free(ptr);
+        assert(mem.MemStructureValid());
+        assert(mem.alloc(32) != nullptr);
+        assert(mem.MemStructureValid());
+    }
+}
+
+template <typename FitPolicy>
+void TestRandom(const char* name) {
+    BasicMemory<FitPolicy> mem{mempool, &mempool[pool_size]};
+    std::mt19937 random{42};
+    std::vector<void*> live;
+    size_t failures = 0;
+    for (size_t idx = 0; idx < 5000; ++idx) {
+        if (live.empty() || (live.size() < 150 && random() % 2 == 0)) {
+            void* ptr = mem.alloc(8 + random() % 512);
+            if (ptr == nullptr) {
+                ++failures;
+            } else {
+                live.push_back(ptr);
+            }
+        } else {
+            const size_t victim = random() % live.size();
+            mem.free(live[victim]);
+            live[victim] = live.back();
+            live.pop_back();
+        }
+    }
+    assert(mem.MemStructureValid());
+    mem.free_batch(live.data(), live.size());
+    assert(mem.OccupiedSize() == 0);
+    std::cout << name << ": " << failures << " failed allocations" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    TestChoice();
+    TestRandom<BestFit>("best fit");
+    TestRandom<FirstFit>("first fit");
+    TestRandom<NextFit>("next fit");
+    TestRandom<GoodFit<>>("good fit");
+    return 0;
+}
@@ -0,0 +1,215 @@
+#include "memory.h"
+
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cassert>
+#include <csignal>
+#include <cstddef>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const size_t pool_size = 1 << 16;
+
+static char mempool[pool_size];
+
+// every allocation is sampled, objects end at the page end, freed slots are reused last
+void TestSampled() {
+    Memory mem{mempool, &mempool[pool_size]};
+    GuardedPool pool{4, 1};
+    mem.SetGuardedPool(&pool);
+
+    char* obj = static_cast<char*>(mem.alloc(100));
+    assert(pool.Contains(obj));
+    assert(!mem.IsInAddrSpace(obj));
+    assert(reinterpret_cast<uintptr_t>(obj + align(100)) % ::sysconf(_SC_PAGESIZE) == 0);
+    assert(mem.OccupiedSize() == 0);
+    for (size_t idx = 0; idx < 100; ++idx) {
+        obj[idx] = static_cast<char>(idx);
+    }
+    mem.free(obj);
+    assert(pool.FreeSlots() == 4);
+
+    std::vector<void*> objs;
+    for (size_t idx = 0; idx < 4; ++idx) {
+        objs.push_back(mem.alloc(16));
+        assert(objs.back() != obj);
+    }
+    // slots are exhausted and requests too big for a slot are served by Memory
+    void* heap = mem.alloc(16);
+    void* big = mem.alloc(pool.MaxSize() + 1);
+    assert(mem.IsInAddrSpace(heap) && mem.IsInAddrSpace(big));
+
+    void* noscan = nullptr;
+    mem.free(objs.back());
+    objs.pop_back();
+    noscan = mem.alloc_noscan(24);
+    assert(pool.Contains(noscan) && LargeObject::FromUserData(noscan).no_pointers);
+    objs.push_back(noscan);
+    objs.push_back(heap);
+    objs.push_back(big);
+    mem.free_batch(objs.data(), objs.size());
+
+    assert(mem.OccupiedSize() == 0);
+    assert(mem.MemStructureValid());
+    assert(pool.FreeSlots() == 4);
+    std::cout << "guarded allocations: " << pool.Allocated() << std::endl;
+}
+
+void TestRate() {
+    Memory mem{mempool, &mempool[pool_size]};
+    GuardedPool pool{16, 100};
+    mem.SetGuardedPool(&pool);
+    for (size_t idx = 0; idx < 100000; ++idx) {
+        mem.free(mem.alloc(32));
+    }
+    assert(pool.Allocated() > 800 && pool.Allocated() < 1200);
+    assert(mem.MemStructureValid());
+    std::cout << "sampled " << pool.Allocated() << " of 100000, expected about 1000" << std::endl;
+}
+
+// heaps of two threads share one pool, every allocation is counted once
+void TestThreads() {
+    static char other_pool[pool_size];
+    GuardedPool pool{16, 10};
+    auto run = [&pool](char* begin, char* end){
+        Memory mem{begin, end};
+        mem.SetGuardedPool(&pool);
+        for (size_t idx = 0; idx < 20000; ++idx) {
+            mem.free(mem.alloc(32));
+        }
+        assert(mem.MemStructureValid());
+    };
+    std::thread other{run, other_pool, &other_pool[pool_size]};
+    run(mempool, &mempool[pool_size]);
+    other.join();
+    assert(pool.Allocated() == pool.Freed() && pool.FreeSlots() == 16);
+    assert(pool.Allocated() > 2000 && pool.Allocated() < 6000);
+    std::cout << "sampled " << pool.Allocated() << " of 40000 in two threads, expected about 4000" << std::endl;
+}
+
+static char* handled_page = nullptr;
+static size_t handled_faults = 0;
+
+// stands for a program that handles faults on its own pages, e.g. a write barrier
+void UnprotectPage(int, siginfo_t* info, void*) {
+    assert(info->si_addr >= handled_page && info->si_addr < handled_page + ::sysconf(_SC_PAGESIZE));
+    ::mprotect(handled_page, ::sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE);
+    ++handled_faults;
+}
+
+// runs bug in a child process, returns its report, signal is the one that killed it
+std::string RunChild(const std::function<void()>& bug, int& signal) {
+    int fds[2];
+    int rc = ::pipe(fds);
+    assert(rc == 0);
+    pid_t pid = ::fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        ::dup2(fds[1], STDERR_FILENO);
+        ::close(fds[0]);
+        bug();
+        ::_exit(0);
+    }
+    ::close(fds[1]);
+    std::string report;
+    char buf[4096];
+    ssize_t n;
+    while ((n = ::read(fds[0], buf, sizeof(buf))) > 0) {
+        report.append(buf, n);
+    }
+    ::close(fds[0]);
+    int status = 0;
+    ::waitpid(pid, &status, 0);
+    signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+    (void)rc;
+    return report;
+}
+
+void Expect(const char* name, int expected_signal, const std::function<void()>& bug) {
+    int signal = 0;
+    const std::string report = RunChild(bug, signal);
+    assert(signal == expected_signal);
+    assert(report.find(std::string{"==guarded pool== "} + name) != std::string::npos);
+    assert(report.find("allocated at:") != std::string::npos);
+    std::cout << name << " detected" << std::endl;
+}
+
+void TestErrors() {
+    Memory mem{mempool, &mempool[pool_size]};
+    GuardedPool pool{4, 1};
+    mem.SetGuardedPool(&pool);
+
+    Expect("buffer-overflow", SIGSEGV, [&](){
+        volatile char* obj = static_cast<char*>(mem.alloc(64));
+        obj[64] = 1;
+    });
+    Expect("use-after-free", SIGSEGV, [&](){
+        volatile char* obj = static_cast<char*>(mem.alloc(64));
+        mem.free(const_cast<char*>(obj));
+        obj[0] = 1;
+    });
+    Expect("double-free", SIGABRT, [&](){
+        void* obj = mem.alloc(64);
+        mem.free(obj);
+        mem.free(obj);
+    });
+    Expect("buffer-overflow (alignment slack)", SIGABRT, [&](){
+        char* obj = static_cast<char*>(mem.alloc(61));
+        obj[62] = 1;
+        mem.free(obj);
+    });
+    Expect("invalid-free", SIGABRT, [&](){
+        char* obj = static_cast<char*>(mem.alloc(64));
+        mem.free(obj + 8);
+    });
+
+    // faults outside of the pool still reach the previous handler
+    int signal = 0;
+    RunChild([](){
+        volatile char* null = nullptr;
+        null[0] = 1;
+    }, signal);
+    assert(signal == SIGSEGV);
+}
+
+// the previous handler gets every fault outside of the pool and the pool handler stays
+void TestChaining() {
+    Expect("buffer-overflow", SIGSEGV, [](){
+        const size_t page_size = ::sysconf(_SC_PAGESIZE);
+        handled_page = static_cast<char*>(::mmap(nullptr, page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        struct sigaction action{};
+        action.sa_sigaction = &UnprotectPage;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        ::sigaction(SIGSEGV, &action, nullptr);
+
+        Memory mem{mempool, &mempool[pool_size]};
+        GuardedPool pool{4, 1};
+        mem.SetGuardedPool(&pool);
+        for (size_t round = 0; round < 2; ++round) {
+            volatile char* page = handled_page;
+            page[0] = 1;
+            ::mprotect(handled_page, page_size, PROT_NONE);
+        }
+        if (handled_faults != 2) {
+            ::_exit(1);
+        }
+        volatile char* obj = static_cast<char*>(mem.alloc(64));
+        obj[64] = 1;
+    });
+}
+
+int main(int argc, char** argv) {
+    TestSampled();
+    TestRate();
+    TestThreads();
+    TestErrors();
+    TestChaining();
+    return 0;
+}
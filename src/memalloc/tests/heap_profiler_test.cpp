@@ -0,0 +1,110 @@
+#include "heap_profiler.h"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <cassert>
+#include <cstddef>
+
+static const size_t pool_size = 1 << 20;
+
+static char mempool[pool_size];
+
+static Memory mem{mempool, &mempool[pool_size]};
+
+__attribute__((noinline)) void* AllocSmall() {
+    return mem.alloc(32);
+}
+
+__attribute__((noinline)) void* AllocBig() {
+    return mem.alloc(1024);
+}
+
+void TestEverySample() {
+    HeapProfiler profiler{mem, 0};
+
+    void* small[10];
+    void* big[5];
+    for (auto& ptr : small) {
+        ptr = AllocSmall();
+    }
+    for (auto& ptr : big) {
+        ptr = AllocBig();
+    }
+    assert(profiler.SampledObjects() == 15);
+    assert(profiler.LiveSampledObjects() == 15);
+    assert(Block::FromUserData(small[0]).sampled);
+
+    // two call sites, every loop iteration has the same stack
+    assert(profiler.CallSites().size() == 2);
+    size_t inuse_bytes = 0;
+    for (const auto& site : profiler.CallSites()) {
+        assert(site.inuse_objects == 10 || site.inuse_objects == 5);
+        inuse_bytes += site.inuse_bytes;
+    }
+    assert(inuse_bytes == 10 * 32 + 5 * 1024);
+
+    for (void* ptr : big) {
+        mem.free(ptr);
+    }
+    assert(profiler.LiveSampledObjects() == 10);
+    for (const auto& site : profiler.CallSites()) {
+        if (site.alloc_objects == 5) {
+            assert(site.inuse_objects == 0 && site.inuse_bytes == 0);
+            assert(site.alloc_bytes == 5 * 1024);
+        }
+    }
+
+    std::stringstream profile;
+    profiler.WriteProfile(profile);
+    std::string header;
+    std::getline(profile, header);
+    std::cout << header << std::endl;
+    assert(header == "heap profile: 10: 320 [15: 5440] @ heap_v2/0");
+    assert(profile.str().find("MAPPED_LIBRARIES:") != std::string::npos);
+
+    mem.free_batch(small, 10);
+    assert(profiler.LiveSampledObjects() == 0);
+    assert(mem.OccupiedSize() == 0);
+}
+
+void TestPoissonSampling() {
+    const size_t period = 4096;
+    const size_t count = 20000;
+    const size_t sz = 16;
+    HeapProfiler profiler{mem, period, 42};
+
+    for (size_t idx = 0; idx < count; ++idx) {
+        mem.free(AllocSmall());
+        void* ptr = mem.alloc(sz);
+        mem.free(ptr);
+    }
+    // 20000 * (32 + 16) bytes, about 234 samples expected
+    const size_t expected = count * (32 + sz) / period;
+    std::cout << "sampled " << profiler.SampledObjects() << " of " << 2 * count
+              << ", expected about " << expected << std::endl;
+    assert(profiler.SampledObjects() > expected / 2 && profiler.SampledObjects() < expected * 2);
+    assert(profiler.LiveSampledObjects() == 0);
+}
+
+void TestRemovedProfiler() {
+    void* ptr = nullptr;
+    {
+        HeapProfiler profiler{mem, 0};
+        ptr = AllocSmall();
+        assert(Block::FromUserData(ptr).sampled);
+    }
+    // flag is cleared with the profiler, later frees do not look for the sample
+    assert(!Block::FromUserData(ptr).sampled);
+    HeapProfiler profiler{mem, 0};
+    mem.free(ptr);
+    assert(profiler.LiveSampledObjects() == 0);
+}
+
+int main(int argc, char** argv) {
+    TestEverySample();
+    TestPoissonSampling();
+    TestRemovedProfiler();
+    return 0;
+}
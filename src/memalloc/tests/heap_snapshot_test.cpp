@@ -0,0 +1,216 @@
+#include "heap_snapshot.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <cassert>
+#include <cstddef>
+
+static const size_t pool_size = 1 << 20;
+
+static char mempool[pool_size];
+
+struct Node {
+    Node* left;
+    Node* right;
+    size_t value;
+};
+
+static const size_t NodeSize = align(sizeof(Node)) + align(sizeof(Block));
+
+static std::string Path(const char* name) {
+    return std::string{"/tmp/heap_snapshot_test_"} + std::to_string(::getpid()) + "_" + name;
+}
+
+// root -> a -> {b, c}, root -> d -> c, cycle e <-> f nobody points to
+void TestGraph() {
+    Memory mem{mempool, &mempool[pool_size]};
+    auto node = [&](){
+        Node* n = static_cast<Node*>(mem.alloc(sizeof(Node)));
+        n->left = n->right = nullptr;
+        n->value = 0;
+        return n;
+    };
+    Node* root = node();
+    Node* a = node();
+    Node* b = node();
+    Node* c = node();
+    Node* d = node();
+    Node* e = node();
+    Node* f = node();
+    void* gap = mem.alloc(1000);
+    Node* g = node();
+    mem.free(gap);
+    Block::FromUserData(root).root = true;
+    root->left = a;
+    root->right = d;
+    a->left = b;
+    a->right = c;
+    d->left = c;
+    e->left = f;
+    f->left = e;
+    // interior pointer is an edge too
+    g->left = reinterpret_cast<Node*>(&b->value);
+
+    const std::string path = Path("graph");
+    assert(WriteHeapSnapshot(mem, path.c_str()));
+
+    HeapSnapshot snapshot;
+    assert(snapshot.Read(path.c_str()));
+    assert(snapshot.HasEdges());
+    const uint64_t idx_a = snapshot.Find(reinterpret_cast<uintptr_t>(a));
+    assert(idx_a != HeapSnapshot::NoObject);
+    assert(snapshot.Objects()[idx_a].edge_count == 2);
+    assert(snapshot.Objects()[snapshot.Find(reinterpret_cast<uintptr_t>(root))].flags & HeapSnapshotRecord::Root);
+
+    const auto frag = snapshot.GetFragmentation();
+    assert(frag.occupied == 8 * NodeSize);
+    assert(frag.free_blocks == 2);
+    assert(frag.occupied + frag.free == pool_size);
+
+    std::vector<uint64_t> idoms;
+    auto retained = snapshot.GetDominators(&idoms);
+    auto retained_of = [&](void* obj){
+        for (const auto& r : retained) {
+            if (r.addr == reinterpret_cast<uintptr_t>(obj)) {
+                return r.retained;
+            }
+        }
+        return uint64_t{0};
+    };
+    // c is reached through a and d, so root dominates it; b is also reached from g
+    assert(retained_of(root) == 4 * NodeSize);
+    assert(retained_of(a) == NodeSize);
+    assert(retained_of(d) == NodeSize);
+    assert(retained_of(e) == 2 * NodeSize);
+    assert(retained_of(g) == NodeSize);
+    assert(idoms[snapshot.Find(reinterpret_cast<uintptr_t>(c))] == reinterpret_cast<uintptr_t>(root));
+    assert(retained.front().addr == reinterpret_cast<uintptr_t>(root));
+
+    // diff: b freed, two new nodes
+    node();
+    node();
+    g->left = nullptr;
+    mem.free(b);
+    const std::string after_path = Path("after");
+    assert(WriteHeapSnapshot(mem, after_path.c_str(), false));
+    HeapSnapshot after;
+    assert(after.Read(after_path.c_str()));
+    assert(!after.HasEdges());
+    const auto diff = snapshot.GetDiff(after);
+    assert(diff.freed_objects == 1);
+    assert(diff.allocated_objects == 2);
+    assert(diff.kept_objects == 7);
+    assert(diff.by_size.size() == 1 && diff.by_size[0].objects == 1);
+
+    ::unlink(path.c_str());
+    ::unlink(after_path.c_str());
+    std::cout << "graph snapshot ok" << std::endl;
+}
+
+// unreferenced a below the root points to it: a does not dominate root -> b
+void TestPointerToRoot() {
+    Memory mem{mempool, &mempool[pool_size]};
+    auto node = [&](){
+        Node* n = static_cast<Node*>(mem.alloc(sizeof(Node)));
+        n->left = n->right = nullptr;
+        n->value = 0;
+        return n;
+    };
+    Node* a = node();
+    Node* root = node();
+    Node* b = node();
+    Block::FromUserData(root).root = true;
+    a->left = root;
+    root->left = b;
+
+    const std::string path = Path("to_root");
+    assert(WriteHeapSnapshot(mem, path.c_str()));
+    HeapSnapshot snapshot;
+    assert(snapshot.Read(path.c_str()));
+    std::vector<uint64_t> idoms;
+    const auto retained = snapshot.GetDominators(&idoms);
+    for (const auto& r : retained) {
+        if (r.addr == reinterpret_cast<uintptr_t>(a)) {
+            assert(r.retained == NodeSize);
+        } else if (r.addr == reinterpret_cast<uintptr_t>(root)) {
+            assert(r.retained == 2 * NodeSize);
+        }
+    }
+    assert(idoms[snapshot.Find(reinterpret_cast<uintptr_t>(root))] == 0);
+    assert(idoms[snapshot.Find(reinterpret_cast<uintptr_t>(b))] == reinterpret_cast<uintptr_t>(root));
+
+    ::unlink(path.c_str());
+    std::cout << "pointer to root ok" << std::endl;
+}
+
+// many small objects, snapshot written inline and by a forked child, text dump for comparison
+void TestLargeHeap() {
+    Memory mem{mempool, &mempool[pool_size]};
+    Node* prev = nullptr;
+    size_t count = 0;
+    while (Node* n = static_cast<Node*>(mem.alloc(sizeof(Node)))) {
+        n->left = prev;
+        n->right = nullptr;
+        n->value = count;
+        prev = n;
+        ++count;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    auto ms = [](Clock::duration d){ return std::chrono::duration<double, std::milli>(d).count(); };
+
+    const std::string path = Path("inline");
+    assert(WriteHeapSnapshot(mem, path.c_str()));
+
+    const std::string forked_path = Path("forked");
+    auto start = Clock::now();
+    const pid_t pid = WriteHeapSnapshotForked(mem, forked_path.c_str());
+    const double pause_ms = ms(Clock::now() - start);
+    assert(pid > 0);
+    assert(WaitHeapSnapshot(pid));
+
+    // same content both ways: blocks without edges, written to a file and flushed
+    const std::string plain_path = Path("plain");
+    start = Clock::now();
+    const bool written = WriteHeapSnapshot(mem, plain_path.c_str(), false);
+    const double binary_ms = ms(Clock::now() - start);
+    assert(written);
+
+    const std::string text_path = Path("text");
+    start = Clock::now();
+    std::ofstream text{text_path};
+    text << mem;
+    text.close();
+    const double text_ms = ms(Clock::now() - start);
+    assert(!text.fail());
+
+    HeapSnapshot inline_snapshot;
+    HeapSnapshot forked_snapshot;
+    assert(inline_snapshot.Read(path.c_str()));
+    assert(forked_snapshot.Read(forked_path.c_str()));
+    assert(inline_snapshot.Objects().size() == forked_snapshot.Objects().size());
+    assert(inline_snapshot.Edges().size() == count - 1);
+    const auto diff = inline_snapshot.GetDiff(forked_snapshot);
+    assert(diff.allocated_objects == 0 && diff.freed_objects == 0 && diff.kept_objects == count);
+
+    // a chain: every node retains the ones allocated before it
+    const auto retained = inline_snapshot.GetDominators();
+    assert(retained.front().retained == inline_snapshot.GetFragmentation().occupied);
+
+    std::cout << count << " objects: binary snapshot " << binary_ms << " ms, text dump " << text_ms
+              << " ms, pause with fork " << pause_ms << " ms" << std::endl;
+    ::unlink(path.c_str());
+    ::unlink(forked_path.c_str());
+    ::unlink(plain_path.c_str());
+    ::unlink(text_path.c_str());
+}
+
+int main(int argc, char** argv) {
+    TestGraph();
+    TestPointerToRoot();
+    TestLargeHeap();
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include "heap_verifier.h"
+
+#include <iostream>
+
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+
+static const size_t pool_size = 1 << 20;
+
+static char mempool[pool_size];
+
+static Memory mem{mempool, &mempool[pool_size]};
+
+void Test() {
+    HeapVerifier verifier{mem, 16, 4};
+
+    static void* objs[4000];
+    mem.alloc_batch(100, 4000, objs);
+    for (size_t idx = 0; idx < 4000; idx += 3) {
+        mem.free(objs[idx]);
+    }
+
+    assert(mem.MemStructureValid());
+    assert(verifier.Verify());
+    assert(verifier.VerifyParallel());
+
+    // anchors get stale after changes, parallel check still has to pass
+    for (size_t idx = 1; idx < 4000; idx += 3) {
+        mem.free(objs[idx]);
+    }
+    assert(verifier.VerifyParallel());
+    assert(verifier.VerifyParallel());
+    // workers are reused, no threads are started per call
+    assert(verifier.ParallelPasses() == 3);
+
+    // incremental check interleaved with allocations
+    while (verifier.CompletedPasses() < 3) {
+        assert(verifier.Step(50));
+        void* ptr = mem.alloc(64);
+        assert(verifier.Step(50));
+        mem.free(ptr);
+    }
+
+    std::cout << "verified: " << verifier.CompletedPasses() << " incremental passes" << std::endl;
+
+    // overrun of an object damages the header of the next block
+    std::memset(objs[2], 0xff, 100 + 32);
+    assert(!mem.MemStructureValid());
+    assert(!verifier.Verify());
+    assert(!verifier.VerifyParallel());
+
+    std::cout << "corruption detected" << std::endl;
+}
+
+// corruption is reported while the heap keeps changing between steps
+void TestStepWithChanges() {
+    static char pool[65536];
+    Memory heap{pool, &pool[sizeof(pool)]};
+    HeapVerifier verifier{heap};
+    // single thread and small heap, checked inline
+    assert(verifier.VerifyParallel() && verifier.ParallelPasses() == 0);
+
+    void* objs[200];
+    heap.alloc_batch(100, 200, objs);
+    // damaged size of a block far from the object that is freed and allocated again
+    // (size is the last field of the block header)
+    char* size_field = reinterpret_cast<char*>(&Block::FromUserData(objs[150])) + sizeof(Block) - sizeof(Size);
+    const Size size = Block::FromUserData(objs[150]).GetSize();
+    const Size bad_size = size + Size{64};
+    std::memcpy(size_field, &bad_size, sizeof(Size));
+    assert(!heap.MemStructureValid());
+
+    bool detected = false;
+    for (size_t step = 0; step < 100 && !detected; ++step) {
+        detected = !verifier.Step(50);
+        // same size block is reused in place, links stay untouched
+        heap.free(objs[0]);
+        objs[0] = heap.alloc(100);
+    }
+    assert(detected);
+    std::memcpy(size_field, &size, sizeof(Size));
+    assert(heap.MemStructureValid());
+
+    std::cout << "corruption detected by incremental check" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    Test();
+    TestStepWithChanges();
+    return 0;
+}
@@ -3,6 +3,7 @@
 #include <iostream>
 
 #include <cstddef>
+#include <cassert>
 
 #include <vector>
 
@@ -48,9 +49,47 @@ void Test() {
 
     std::cout << "vector destroyed: " << std::endl << mem << std::endl;
 
+    {
+        Something* objs[16];
+
+        alloc.allocate_batch(1, 16, objs);
+        assert(mem.MemStructureValid());
+
+        std::cout << "batch of 16 allocated: " << std::endl << mem << std::endl;
+
+        Something* some[] = {objs[9], objs[3], objs[4], objs[10], objs[0]};
+        alloc.deallocate_batch(some, 5);
+        assert(mem.MemStructureValid());
+
+        std::cout << "5 objects from batch freed: " << std::endl << mem << std::endl;
+
+        Something* rest[] = {objs[15], objs[1], objs[2], objs[5], objs[6], objs[7], objs[8],
+                             objs[11], objs[12], objs[13], objs[14]};
+        alloc.deallocate_batch(rest, 11);
+        assert(mem.MemStructureValid());
+        assert(mem.OccupiedSize() == 0);
+
+        std::cout << "whole batch freed: " << std::endl << mem << std::endl;
+    }
+
+}
+
+// carved blocks are linked without recursion, a huge batch does not exhaust the stack
+void TestLargeBatch() {
+    static const size_t count = 300000;
+    std::vector<char> pool(count * (align(8) + align(sizeof(Block))) + 4096);
+    Memory big{pool.data(), pool.data() + pool.size()};
+    std::vector<void*> objs(count);
+    const size_t done = big.alloc_batch(8, count, objs.data());
+    assert(done == count);
+    assert(big.MemStructureValid());
+    big.free_batch(objs.data(), done);
+    assert(big.OccupiedSize() == 0);
+    std::cout << "batch of " << count << " allocated and freed" << std::endl;
 }
 
 int main(int argc, char** argv) {
     Test();
+    TestLargeBatch();
     return 0;
 }
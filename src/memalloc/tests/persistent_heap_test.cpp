@@ -0,0 +1,118 @@
+#include "persistent_heap.h"
+
+#include <iostream>
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char* image_path = "/tmp/persistent_heap_test.img";
+
+struct Node {
+    int value;
+    uint64_t next; // offset of next node in the image, 0 for the last one
+};
+
+void Test() {
+    {
+        auto heap = PersistentHeap::Create(image_path, 65536);
+        assert(heap);
+        Memory& mem = heap->memory();
+
+        uint64_t next = 0;
+        Node* node = nullptr;
+        for (int idx = 0; idx < 3; ++idx) {
+            node = reinterpret_cast<Node*>(mem.alloc(sizeof(Node)));
+            node->value = idx;
+            node->next = next;
+            next = heap->ToOffset(node);
+        }
+        heap->SetRoot(node);
+
+        std::cout << "heap created: " << std::endl << mem << std::endl;
+    }
+
+    {
+        auto heap = PersistentHeap::Open(image_path, true);
+        assert(heap);
+        Memory& mem = heap->memory();
+
+        std::cout << "heap reopened: " << std::endl << mem << std::endl;
+
+        int expected = 2;
+        for (Node* node = reinterpret_cast<Node*>(heap->GetRoot());
+             node != nullptr;
+             node = node->next == 0 ? nullptr : reinterpret_cast<Node*>(heap->FromOffset(node->next))) {
+            assert(node->value == expected--);
+        }
+        assert(expected == -1);
+
+        mem.free(heap->GetRoot());
+        heap->SetRoot(nullptr);
+        assert(mem.MemStructureValid());
+    }
+
+    {
+        auto heap = PersistentHeap::Open(image_path);
+        assert(heap);
+        assert(heap->GetRoot() == nullptr);
+        assert(heap->memory().MemStructureValid());
+
+        std::cout << "heap reopened again: " << std::endl << heap->memory() << std::endl;
+    }
+}
+
+// overwrites size bytes at offset in the image file
+void Patch(off_t offset, const void* data, size_t size) {
+    int fd = ::open(image_path, O_RDWR);
+    assert(fd >= 0);
+    assert(::pwrite(fd, data, size, offset) == static_cast<ssize_t>(size));
+    ::close(fd);
+}
+
+// torn writes in a dirty image make Open fail instead of crashing
+void TestCorruptedImage() {
+    const off_t heap_offset = ::sysconf(_SC_PAGESIZE);
+    const off_t clean_offset = offsetof(PersistentHeap::HeapImage, clean);
+    const uint32_t dirty = 0;
+    const uint64_t far = uint64_t{1} << 40;
+    // size that wraps around and a link back to the same address, below the mapping
+    const uint64_t back = static_cast<uint64_t>(-2 * heap_offset);
+    // next link of the first block (DlElt::next_) and its size (last field of Block)
+    const off_t link = sizeof(std::ptrdiff_t);
+    const off_t size = sizeof(Block) - sizeof(Size);
+    const std::vector<std::vector<std::pair<off_t, uint64_t>>> corruptions{
+        {{link, far}},
+        {{size, far}},
+        {{link, back}},
+        {{size, back}},
+        {{size, back}, {link, back}},
+    };
+    for (const auto& corruption : corruptions) {
+        {
+            auto heap = PersistentHeap::Create(image_path, 65536);
+            assert(heap);
+            heap->memory().alloc(sizeof(Node));
+            heap->memory().alloc(sizeof(Node));
+        }
+        for (const auto& [field, value] : corruption) {
+            Patch(heap_offset + field, &value, sizeof(value));
+        }
+        assert(!PersistentHeap::Open(image_path, true));
+        Patch(clean_offset, &dirty, sizeof(dirty));
+        assert(!PersistentHeap::Open(image_path));
+    }
+    std::cout << "corrupted images rejected" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    Test();
+    TestCorruptedImage();
+    return 0;
+}
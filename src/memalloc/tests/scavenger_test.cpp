@@ -0,0 +1,134 @@
+#include "scavenger.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cassert>
+#include <cstddef>
+
+#include <sys/mman.h>
+
+static const size_t heap_size = 16 << 20;
+static const size_t object_size = 512 * 1024;
+
+// heap without huge pages, so residency is counted in small pages
+static char* MapHeap() {
+    void* addr = ::mmap(nullptr, heap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(addr != MAP_FAILED);
+    ::madvise(addr, heap_size, MADV_NOHUGEPAGE);
+    return static_cast<char*>(addr);
+}
+
+// spike of big objects, after it is freed the resident size goes back down
+void TestScavenge() {
+    char* heap = MapHeap();
+    Memory mem{heap, heap + heap_size};
+    std::mutex heap_mutex;
+    Scavenger scavenger{mem, heap_mutex};
+
+    void* small = mem.alloc(100);
+    std::vector<void*> spike;
+    for (size_t idx = 0; idx < 24; ++idx) {
+        spike.push_back(mem.alloc(object_size));
+        std::memset(spike.back(), 0x5A, object_size);
+    }
+    const size_t peak = Scavenger::ResidentBytes(heap, heap_size);
+    mem.free_batch(spike.data(), spike.size());
+    assert(Scavenger::ResidentBytes(heap, heap_size) == peak);
+
+    const size_t released = scavenger.Scavenge();
+    const size_t after = Scavenger::ResidentBytes(heap, heap_size);
+    std::cout << "resident at peak " << peak << ", after scavenge " << after
+              << ", released " << released << std::endl;
+    assert(released >= 24 * object_size - 2 * ::sysconf(_SC_PAGESIZE));
+    assert(after < 4 * static_cast<size_t>(::sysconf(_SC_PAGESIZE)));
+    assert(mem.MemStructureValid());
+
+    // second pass has nothing to do
+    assert(scavenger.Scavenge() == 0);
+
+    // allocation over decommitted pages refaults them, memory is usable
+    char* obj = static_cast<char*>(mem.alloc(object_size));
+    assert(scavenger.RefaultedBytes() >= object_size);
+    assert(scavenger.DecommittedBytes() == scavenger.ReleasedBytes() - scavenger.RefaultedBytes());
+    std::memset(obj, 1, object_size);
+    assert(obj[object_size - 1] == 1);
+    mem.free(obj);
+    mem.free(small);
+    assert(mem.MemStructureValid());
+    assert(mem.OccupiedSize() == 0);
+    ::munmap(heap, heap_size);
+}
+
+// free blocks below the threshold keep their pages
+void TestSmallBlocks() {
+    char* heap = MapHeap();
+    Memory mem{heap, heap + heap_size};
+    std::mutex heap_mutex;
+    Scavenger scavenger{mem, heap_mutex, 1 << 20};
+
+    std::vector<void*> objs;
+    for (size_t idx = 0; idx < 16; ++idx) {
+        objs.push_back(mem.alloc(256 * 1024));
+        std::memset(objs.back(), 1, 256 * 1024);
+    }
+    // every other object is freed, holes of 256 KB
+    for (size_t idx = 0; idx < objs.size(); idx += 2) {
+        mem.free(objs[idx]);
+    }
+    const size_t resident = Scavenger::ResidentBytes(heap, heap_size);
+    scavenger.Scavenge();
+    assert(Scavenger::ResidentBytes(heap, heap_size) == resident);
+    for (size_t idx = 1; idx < objs.size(); idx += 2) {
+        mem.free(objs[idx]);
+    }
+    scavenger.Scavenge();
+    assert(Scavenger::ResidentBytes(heap, heap_size) < resident);
+    ::munmap(heap, heap_size);
+}
+
+// mutator allocates under the heap lock while the scavenger runs in the background
+void TestBackground() {
+    char* heap = MapHeap();
+    Memory mem{heap, heap + heap_size};
+    std::mutex heap_mutex;
+    Scavenger scavenger{mem, heap_mutex};
+    scavenger.Start(std::chrono::milliseconds{1});
+
+    for (size_t round = 0; round < 20; ++round) {
+        std::vector<void*> objs;
+        for (size_t idx = 0; idx < 8; ++idx) {
+            std::unique_lock<std::mutex> lock{heap_mutex};
+            objs.push_back(mem.alloc(object_size));
+            std::memset(objs.back(), static_cast<int>(round), object_size);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds{2});
+        for (void* obj : objs) {
+            assert(static_cast<char*>(obj)[object_size / 2] == static_cast<char>(round));
+        }
+        {
+            std::unique_lock<std::mutex> lock{heap_mutex};
+            mem.free_batch(objs.data(), objs.size());
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds{2});
+    }
+    scavenger.Stop();
+    std::cout << "background passes " << scavenger.Passes() << ", released " << scavenger.ReleasedBytes()
+              << ", refaulted " << scavenger.RefaultedBytes() << std::endl;
+    assert(scavenger.Passes() > 0);
+    assert(scavenger.ReleasedBytes() > 0);
+    assert(scavenger.RefaultedBytes() > 0);
+    assert(mem.MemStructureValid());
+    ::munmap(heap, heap_size);
+}
+
+int main(int argc, char** argv) {
+    TestScavenge();
+    TestSmallBlocks();
+    TestBackground();
+    return 0;
+}
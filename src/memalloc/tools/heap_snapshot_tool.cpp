@@ -0,0 +1,101 @@
+#include "heap_snapshot.h"
+
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+/*
+Offline analysis of heap snapshots written by HeapSnapshotWriter.
+
+    heapsnap stats <snapshot>              sizes, fragmentation, free block histogram
+    heapsnap dominators <snapshot> [n]     n objects with the biggest retained size (10 by default)
+    heapsnap diff <before> <after> [n]     allocated and freed objects, n biggest changes by object size
+*/
+
+static void Usage() {
+    std::cerr << "usage: heapsnap stats <snapshot>\n"
+              << "       heapsnap dominators <snapshot> [n]\n"
+              << "       heapsnap diff <before> <after> [n]\n";
+}
+
+static bool Load(HeapSnapshot& snapshot, const char* path) {
+    if (!snapshot.Read(path)) {
+        std::cerr << "cannot read snapshot " << path << '\n';
+        return false;
+    }
+    return true;
+}
+
+static void Stats(const HeapSnapshot& snapshot) {
+    const auto frag = snapshot.GetFragmentation();
+    std::cout << "heap size:        " << frag.heap_size << '\n'
+              << "occupied:         " << frag.occupied << '\n'
+              << "free:             " << frag.free << " in " << frag.free_blocks << " of " << frag.blocks << " blocks\n"
+              << "largest free:     " << frag.largest_free << '\n'
+              << "fragmentation:    " << std::fixed << std::setprecision(3) << frag.Ratio() << '\n'
+              << "large objects:    " << frag.large_objects << '\n'
+              << "edges:            " << (snapshot.HasEdges() ? std::to_string(snapshot.Edges().size()) : "not written") << '\n'
+              << "free blocks by size:\n";
+    for (size_t bucket = 0; bucket < frag.free_histogram.size(); ++bucket) {
+        if (frag.free_histogram[bucket] != 0) {
+            std::cout << "  " << std::setw(10) << (uint64_t{1} << bucket) << "+ " << frag.free_histogram[bucket] << '\n';
+        }
+    }
+}
+
+static void Dominators(const HeapSnapshot& snapshot, size_t n) {
+    if (!snapshot.HasEdges()) {
+        std::cerr << "snapshot has no edges\n";
+        return;
+    }
+    const auto retained = snapshot.GetDominators();
+    std::cout << "            object        size    retained\n";
+    for (size_t idx = 0; idx < std::min(n, retained.size()); ++idx) {
+        std::cout << "  0x" << std::hex << std::setw(16) << std::setfill('0') << retained[idx].addr
+                  << std::dec << std::setfill(' ')
+                  << std::setw(10) << retained[idx].size
+                  << std::setw(12) << retained[idx].retained << '\n';
+    }
+}
+
+static void Diff(const HeapSnapshot& before, const HeapSnapshot& after, size_t n) {
+    const auto diff = before.GetDiff(after);
+    std::cout << "allocated: " << diff.allocated_objects << " objects, " << diff.allocated_bytes << " bytes\n"
+              << "freed:     " << diff.freed_objects << " objects, " << diff.freed_bytes << " bytes\n"
+              << "kept:      " << diff.kept_objects << " objects\n"
+              << "      size     objects\n";
+    for (size_t idx = 0; idx < std::min(n, diff.by_size.size()); ++idx) {
+        std::cout << std::setw(10) << diff.by_size[idx].size
+                  << std::setw(12) << std::showpos << diff.by_size[idx].objects << std::noshowpos << '\n';
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        Usage();
+        return 1;
+    }
+    const std::string command = argv[1];
+    HeapSnapshot snapshot;
+    if (command == "stats" && argc == 3) {
+        if (!Load(snapshot, argv[2])) {
+            return 1;
+        }
+        Stats(snapshot);
+    } else if (command == "dominators" && argc <= 4) {
+        if (!Load(snapshot, argv[2])) {
+            return 1;
+        }
+        Dominators(snapshot, argc == 4 ? std::stoul(argv[3]) : 10);
+    } else if (command == "diff" && (argc == 4 || argc == 5)) {
+        HeapSnapshot after;
+        if (!Load(snapshot, argv[2]) || !Load(after, argv[3])) {
+            return 1;
+        }
+        Diff(snapshot, after, argc == 5 ? std::stoul(argv[4]) : 10);
+    } else {
+        Usage();
+        return 1;
+    }
+    return 0;
+}